@@ -274,12 +274,22 @@ static void dispatch_dirty(ScreenPtr pScreen)
 	 * to tell clients not to draw during vblank period. it lets the server merge
 	 * damage and copy during vblank at least, instead of copying immediately.
 	 */
-	for (unsigned i = 0; i < num_cliprects; i++, rect++) {
-		while(spr16_client_sync(rect->x1,
-					rect->y1,
-					rect->x2,
-					rect->y2,
-					SPRITESYNC_FLAG_VBLANK)) {
+	while (num_cliprects) {
+		struct spr16_msgdata_sync rects[SPR16_MAXSYNCRECTS];
+		unsigned count = num_cliprects;
+		uint16_t flags = SPRITESYNC_FLAG_VBLANK;
+		if (count > SPR16_MAXSYNCRECTS) {
+			count = SPR16_MAXSYNCRECTS;
+			flags = 0; /* damage only, last batch syncs */
+		}
+		/* boxes are exclusive, sync regions are inclusive */
+		for (unsigned i = 0; i < count; i++, rect++) {
+			rects[i].xmin = rect->x1;
+			rects[i].ymin = rect->y1;
+			rects[i].xmax = rect->x2 - 1;
+			rects[i].ymax = rect->y2 - 1;
+		}
+		while(spr16_client_sync_rects(rects, count, flags)) {
 			if (errno != EAGAIN) {
 				fprintf(stderr,"spr16 sync error: %s\n",strerror(errno));
 				_exit(-1);
@@ -289,6 +299,7 @@ static void dispatch_dirty(ScreenPtr pScreen)
 				usleep(1000);
 			}
 		}
+		num_cliprects -= count;
 	}
 	DamageEmpty(sporg->damage);
 }
@@ -36,6 +36,14 @@
 #endif
 
 
+/*
+ * sync grid alignment in pixels, see platform/linux/fb.h
+ */
+#ifndef PIXL_ALIGN
+	#define PIXL_ALIGN 16
+#endif
+
+
 /*
  * resource limits
  */
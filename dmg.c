@@ -0,0 +1,369 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "dmg.h"
+#include "platform/blit.h"
+
+struct dmg_tiles *dmg_tiles_create(uint16_t width, uint16_t height)
+{
+	struct dmg_tiles *self;
+	uint32_t count;
+
+	if (!width || !height)
+		return NULL;
+
+	self = calloc(1, sizeof(struct dmg_tiles));
+	if (self == NULL)
+		return NULL;
+
+	self->width   = width;
+	self->height  = height;
+	self->tiles_w = (width  + DMG_TILE_SIZE - 1) / DMG_TILE_SIZE;
+	self->tiles_h = (height + DMG_TILE_SIZE - 1) / DMG_TILE_SIZE;
+	self->longs_w = NLONGS(self->tiles_w);
+	count = self->tiles_w * self->tiles_h;
+
+	self->bits  = calloc(self->longs_w * self->tiles_h, sizeof(unsigned long));
+	self->ymin  = calloc(count, sizeof(uint8_t));
+	self->ymax  = calloc(count, sizeof(uint8_t));
+	self->spans = calloc(count, sizeof(struct spr16_msgdata_sync));
+	self->open  = calloc(self->tiles_w * 2, sizeof(uint32_t));
+	if (!self->bits || !self->ymin || !self->ymax || !self->spans || !self->open) {
+		dmg_tiles_destroy(self);
+		return NULL;
+	}
+	self->row_lo = self->tiles_h;
+	self->row_hi = 0;
+	self->empty  = 1;
+	return self;
+}
+
+void dmg_tiles_destroy(struct dmg_tiles *self)
+{
+	if (self == NULL)
+		return;
+	free(self->bits);
+	free(self->ymin);
+	free(self->ymax);
+	free(self->spans);
+	free(self->open);
+	free(self->hash);
+	free(self->hashed);
+	free(self);
+}
+
+static int tile_is_set(struct dmg_tiles *self, uint16_t tx, uint16_t ty)
+{
+	unsigned long word = self->bits[(ty * self->longs_w) + (tx / LONG_BITS)];
+	return (word >> (tx % LONG_BITS)) & 1;
+}
+
+int dmg_tiles_add(struct dmg_tiles *self, struct spr16_msgdata_sync *rect)
+{
+	uint16_t xmax = rect->xmax;
+	uint16_t ymax = rect->ymax;
+	uint16_t tx, ty;
+	uint16_t tx_end, ty_end;
+
+	if (rect->xmin >= self->width || rect->ymin >= self->height
+			|| rect->xmax < rect->xmin || rect->ymax < rect->ymin)
+		return -1;
+	if (xmax >= self->width)
+		xmax = self->width - 1;
+	if (ymax >= self->height)
+		ymax = self->height - 1;
+
+	tx_end = xmax / DMG_TILE_SIZE;
+	ty_end = ymax / DMG_TILE_SIZE;
+	for (ty = rect->ymin / DMG_TILE_SIZE; ty <= ty_end; ++ty)
+	{
+		const uint32_t row = ty * self->tiles_w;
+		unsigned long *bits = &self->bits[ty * self->longs_w];
+		uint8_t lo = 0;
+		uint8_t hi = DMG_TILE_SIZE - 1;
+		if (ty == rect->ymin / DMG_TILE_SIZE)
+			lo = rect->ymin % DMG_TILE_SIZE;
+		if (ty == ty_end)
+			hi = ymax % DMG_TILE_SIZE;
+
+		for (tx = rect->xmin / DMG_TILE_SIZE; tx <= tx_end; ++tx)
+		{
+			const unsigned long bit = 1UL << (tx % LONG_BITS);
+			if (bits[tx / LONG_BITS] & bit) {
+				if (lo < self->ymin[row + tx])
+					self->ymin[row + tx] = lo;
+				if (hi > self->ymax[row + tx])
+					self->ymax[row + tx] = hi;
+			}
+			else {
+				bits[tx / LONG_BITS] |= bit;
+				self->ymin[row + tx] = lo;
+				self->ymax[row + tx] = hi;
+			}
+		}
+		if (ty < self->row_lo)
+			self->row_lo = ty;
+		if (ty > self->row_hi)
+			self->row_hi = ty;
+	}
+	self->empty = 0;
+	return 0;
+}
+
+/* returns tiles_w if there are no more dirty tiles on this row */
+static uint16_t next_dirty_tile(struct dmg_tiles *self, uint16_t tx, uint16_t ty)
+{
+	unsigned long *bits = &self->bits[ty * self->longs_w];
+	while (tx < self->tiles_w)
+	{
+		if (bits[tx / LONG_BITS] == 0) {
+			/* skip clean words */
+			tx = (tx / LONG_BITS + 1) * LONG_BITS;
+			continue;
+		}
+		if (tile_is_set(self, tx, ty))
+			return tx;
+		++tx;
+	}
+	return self->tiles_w;
+}
+
+uint32_t dmg_tiles_merge(struct dmg_tiles *self)
+{
+	/* spans from previous tile row that touch it's bottom edge, sorted by x */
+	uint32_t *prev = self->open;
+	uint32_t *next = self->open + self->tiles_w;
+	uint32_t prev_count = 0;
+	uint16_t ty;
+
+	self->span_count = 0;
+	if (self->empty)
+		return 0;
+
+	for (ty = self->row_lo; ty <= self->row_hi; ++ty)
+	{
+		const uint32_t row = ty * self->tiles_w;
+		const uint16_t band = ty * DMG_TILE_SIZE;
+		uint32_t next_count = 0;
+		uint32_t p = 0;
+		uint16_t tx = 0;
+		uint32_t *tmp;
+
+		while ((tx = next_dirty_tile(self, tx, ty)) < self->tiles_w)
+		{
+			struct spr16_msgdata_sync *span;
+			const uint8_t lo = self->ymin[row + tx];
+			const uint8_t hi = self->ymax[row + tx];
+			uint16_t xmin = tx * DMG_TILE_SIZE;
+			uint16_t xmax;
+			uint32_t idx = self->span_count;
+
+			/* extend run while neighbours have the same dirty rows */
+			for (++tx; tx < self->tiles_w; ++tx)
+			{
+				if (!tile_is_set(self, tx, ty)
+						|| self->ymin[row + tx] != lo
+						|| self->ymax[row + tx] != hi)
+					break;
+			}
+			if ((uint32_t)tx * DMG_TILE_SIZE >= self->width)
+				xmax = self->width - 1;
+			else
+				xmax = (tx * DMG_TILE_SIZE) - 1;
+
+			/* try to grow a span from the row above */
+			if (lo == 0) {
+				while (p < prev_count && self->spans[prev[p]].xmin < xmin)
+				{
+					++p;
+				}
+				if (p < prev_count && self->spans[prev[p]].xmin == xmin
+						&& self->spans[prev[p]].xmax == xmax) {
+					idx = prev[p];
+				}
+			}
+
+			span = &self->spans[idx];
+			if (idx == self->span_count) {
+				span->xmin = xmin;
+				span->xmax = xmax;
+				span->ymin = band + lo;
+				++self->span_count;
+			}
+			span->ymax = band + hi;
+
+			if (hi == DMG_TILE_SIZE - 1)
+				next[next_count++] = idx;
+		}
+
+		tmp = prev;
+		prev = next;
+		next = tmp;
+		prev_count = next_count;
+	}
+	return self->span_count;
+}
+
+void dmg_tiles_clear(struct dmg_tiles *self)
+{
+	if (self->empty)
+		return;
+	memset(&self->bits[self->row_lo * self->longs_w], 0,
+			sizeof(unsigned long) * self->longs_w
+			* (self->row_hi - self->row_lo + 1));
+	self->row_lo = self->tiles_h;
+	self->row_hi = 0;
+	self->span_count = 0;
+	self->empty = 1;
+}
+
+uint32_t dmg_tiles_count(struct dmg_tiles *self)
+{
+	uint32_t count = 0;
+	uint32_t i;
+
+	if (self->empty)
+		return 0;
+	for (i = self->row_lo * self->longs_w;
+			i < (self->row_hi + 1U) * self->longs_w; ++i)
+	{
+		unsigned long word = self->bits[i];
+		while (word)
+		{
+			word &= word - 1;
+			++count;
+		}
+	}
+	return count;
+}
+
+int dmg_tiles_enable_hash(struct dmg_tiles *self)
+{
+	if (self->hash)
+		return 0;
+	self->hash   = calloc(self->tiles_w * self->tiles_h, sizeof(uint32_t));
+	self->hashed = calloc(self->tiles_w * self->tiles_h, sizeof(uint32_t));
+	if (!self->hash || !self->hashed) {
+		free(self->hash);
+		free(self->hashed);
+		self->hash = NULL;
+		self->hashed = NULL;
+		return -1;
+	}
+	self->hash_gen = 1;
+	return 0;
+}
+
+void dmg_tiles_hash_reset(struct dmg_tiles *self)
+{
+	if (self->hashed == NULL)
+		return;
+	/* copies still queued store theirs with the old generation */
+	if (++self->hash_gen == 0)
+		++self->hash_gen;
+}
+
+void dmg_tiles_hash_filter(struct dmg_tiles *self, char *src,
+			   uint32_t stride, uint32_t weight)
+{
+	uint16_t ty;
+	int empty = 1;
+
+	if (self->hash == NULL || self->empty)
+		return;
+
+	for (ty = self->row_lo; ty <= self->row_hi; ++ty)
+	{
+		const uint32_t row = ty * self->tiles_w;
+		const uint16_t y = ty * DMG_TILE_SIZE;
+		unsigned long *bits = &self->bits[ty * self->longs_w];
+		uint16_t h = DMG_TILE_SIZE;
+		uint16_t tx = 0;
+
+		if (y + h > self->height)
+			h = self->height - y;
+
+		while ((tx = next_dirty_tile(self, tx, ty)) < self->tiles_w)
+		{
+			const unsigned long bit = 1UL << (tx % LONG_BITS);
+			const uint16_t x = tx * DMG_TILE_SIZE;
+			uint16_t w = DMG_TILE_SIZE;
+			uint32_t hash;
+
+			if (x + w > self->width)
+				w = self->width - x;
+			hash = blit_hash_rect(src + (y * stride) + (x * weight),
+					      stride, w * weight, h);
+			if (__atomic_load_n(&self->hashed[row + tx], __ATOMIC_ACQUIRE)
+						== self->hash_gen
+					&& __atomic_load_n(&self->hash[row + tx],
+							   __ATOMIC_RELAXED) == hash) {
+				bits[tx / LONG_BITS] &= ~bit;
+			}
+			else {
+				/* stored again when the copy runs */
+				__atomic_store_n(&self->hashed[row + tx], 0,
+						 __ATOMIC_RELAXED);
+				self->ymin[row + tx] = 0;
+				self->ymax[row + tx] = h - 1;
+				empty = 0;
+			}
+			++tx;
+		}
+	}
+	if (empty)
+		dmg_tiles_clear(self);
+}
+
+void dmg_tiles_hash_store(struct dmg_tiles *self, char *src,
+			  uint32_t stride, uint32_t weight, uint32_t gen,
+			  struct spr16_msgdata_sync *span)
+{
+	uint16_t tx, ty;
+
+	if (self->hash == NULL)
+		return;
+
+	for (ty = span->ymin / DMG_TILE_SIZE; ty <= span->ymax / DMG_TILE_SIZE; ++ty)
+	{
+		const uint32_t row = ty * self->tiles_w;
+		const uint16_t y = ty * DMG_TILE_SIZE;
+		uint16_t h = DMG_TILE_SIZE;
+
+		if (y + h > self->height)
+			h = self->height - y;
+		/* part of a tile says nothing about the rest of it */
+		if (y < span->ymin || y + h - 1 > span->ymax)
+			continue;
+		for (tx = span->xmin / DMG_TILE_SIZE; tx <= span->xmax / DMG_TILE_SIZE; ++tx)
+		{
+			const uint16_t x = tx * DMG_TILE_SIZE;
+			uint16_t w = DMG_TILE_SIZE;
+			uint32_t hash;
+
+			if (x + w > self->width)
+				w = self->width - x;
+			if (x < span->xmin || x + w - 1 > span->xmax)
+				continue;
+			hash = blit_hash_rect(src + (y * stride) + (x * weight),
+					      stride, w * weight, h);
+			__atomic_store_n(&self->hash[row + tx], hash, __ATOMIC_RELAXED);
+			__atomic_store_n(&self->hashed[row + tx], gen, __ATOMIC_RELEASE);
+		}
+	}
+}
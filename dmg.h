@@ -0,0 +1,86 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * damage tracking on a grid of PIXL_ALIGN sized square tiles. each tile
+ * remembers which of it's rows are dirty, so a 1 pixel tall cursor blink
+ * does not turn into a full tile copy. the merge pass walks the grid and
+ * emits non-overlapping rectangles, horizontal runs of tiles with the same
+ * dirty rows are joined, and runs that continue on the next tile row with
+ * the same x range are grown downwards. no pixel is ever emitted twice.
+ *
+ * with hashing enabled each tile also remembers a hash of what was last
+ * copied out, dirty tiles whose content hashes the same are dropped before
+ * merging. a tile that did change is copied whole, and the hash is taken
+ * again where the copy runs, right before it, so the stored hash describes
+ * what went to scanout rather than what the sprite held when it was queued.
+ * that can be the compositor thread, hashes are stored with the generation
+ * they were queued in and only count while it is current.
+ */
+#ifndef DMG_H__
+#define DMG_H__
+
+#include <stdint.h>
+#include "defines.h"
+#include "spr16.h"
+
+#define DMG_TILE_SIZE PIXL_ALIGN
+#if (DMG_TILE_SIZE > 256)
+	#error "DMG_TILE_SIZE must fit dirty rows in uint8_t"
+#endif
+
+struct dmg_tiles {
+	unsigned long *bits;               /* 1 bit per tile, row major */
+	uint8_t *ymin;                     /* dirty rows within each tile */
+	uint8_t *ymax;
+	struct spr16_msgdata_sync *spans;  /* merge output */
+	uint32_t *open;                    /* merge scratch, 2 tile rows */
+	uint32_t *hash;                    /* last copied content, optional */
+	uint32_t *hashed;                  /* hash_gen the hash was stored in */
+	uint32_t hash_gen;                 /* stored hashes are valid in this */
+	uint32_t span_count;
+	uint16_t width;
+	uint16_t height;
+	uint16_t tiles_w;
+	uint16_t tiles_h;
+	uint16_t longs_w;                  /* longs per tile row */
+	uint16_t row_lo;                   /* dirty tile row range */
+	uint16_t row_hi;
+	int empty;
+};
+
+struct dmg_tiles *dmg_tiles_create(uint16_t width, uint16_t height);
+void dmg_tiles_destroy(struct dmg_tiles *self);
+/* rect is inclusive and clamped to width/height, -1 if entirely outside */
+int  dmg_tiles_add(struct dmg_tiles *self, struct spr16_msgdata_sync *rect);
+/* fills self->spans and returns span_count, tiles stay dirty until cleared */
+uint32_t dmg_tiles_merge(struct dmg_tiles *self);
+void dmg_tiles_clear(struct dmg_tiles *self);
+/* number of dirty tiles */
+uint32_t dmg_tiles_count(struct dmg_tiles *self);
+
+int  dmg_tiles_enable_hash(struct dmg_tiles *self);
+/* forget stored hashes, use when scanout was changed by something else */
+void dmg_tiles_hash_reset(struct dmg_tiles *self);
+/* drop dirty tiles that match their stored hash, src is the sprite.
+ * the rest are made whole and their hashes forgotten until stored again */
+void dmg_tiles_hash_filter(struct dmg_tiles *self, char *src,
+			   uint32_t stride, uint32_t weight);
+/* hash every whole tile in span as it is about to be copied, gen is
+ * hash_gen when the copy was queued. safe to run on another thread */
+void dmg_tiles_hash_store(struct dmg_tiles *self, char *src,
+			  uint32_t stride, uint32_t weight, uint32_t gen,
+			  struct spr16_msgdata_sync *span);
+
+#endif
@@ -0,0 +1,667 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * copy kernel, format expansion, and damage merge benchmark. rects are copied into a memfd
+ * backed fake framebuffer, not real scanout memory, so absolute numbers
+ * will be higher than on a write-combined dumb buffer. use it to compare
+ * kernels, PIXL_ALIGN, and thread counts on the same host.
+ *
+ * every case is run once and checked against plain C before it is timed,
+ * the whole touched area of the destination is compared so writes past
+ * the rect are caught too. exits non-zero if any of them mismatched.
+ *
+ * bench_blit [-n iterations] [-k kernel] [-t threads] [-w width] [-h height]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "../defines.h"
+#include "../dmg.h"
+#include "../platform/blit.h"
+#include "../platform/blitpool.h"
+#define STRERR strerror(errno)
+
+#define BENCH_MAX_ITER 100000
+#define BENCH_MAX_RECTS 512
+
+struct bench_rect {
+	uint16_t w;
+	uint16_t h;
+};
+
+/* 0 means full screen */
+static struct bench_rect g_rects[] = {
+	{ 16,   16   },
+	{ 64,   16   },
+	{ 128,  128  },
+	{ 512,  512  },
+	{ 0,    0    }
+};
+static uint32_t g_bpps[]     = { 16, 32 };
+/* extra pitch bytes and dest x offset in pixels. 32 bytes and 16 pixels are
+ * aligned for some kernels but not to a cache line */
+static uint32_t g_pads[]     = { 0, 8, 32 };
+static uint16_t g_xoffs[]    = { 0, 3, 16 };
+static uint32_t g_dmg_counts[] = { 1, 8, 64, BENCH_MAX_RECTS };
+static uint16_t g_formats[]  = { SPR16_FORMAT_RGB565, SPR16_FORMAT_INDEX8,
+				 SPR16_FORMAT_NV12, SPR16_FORMAT_I420 };
+static const char *g_format_names[] = { "xrgb8888", "rgb565", "index8",
+				       "nv12", "i420" };
+static uint32_t g_scales[]   = { 2, 3, 4 };
+static uint32_t g_palette[SPR16_PALETTE_COUNT];
+
+static char *g_ref;  /* destination as the reference left it */
+static char *g_fill; /* what the destination starts out as */
+static size_t g_size;
+static unsigned long g_samples[BENCH_MAX_ITER];
+static unsigned int g_iterations = 200;
+static uint16_t g_width  = 1920;
+static uint16_t g_height = 1080;
+
+static unsigned long nsecs_now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+	return (t.tv_sec * 1000000000UL) + t.tv_nsec;
+}
+
+static int cmp_samples(const void *a, const void *b)
+{
+	const unsigned long l = *(const unsigned long *)a;
+	const unsigned long r = *(const unsigned long *)b;
+	return (l > r) - (l < r);
+}
+
+/* samples must be sorted, returns usecs at percentile */
+static double percentile(unsigned int count, unsigned int pct)
+{
+	return g_samples[((count - 1) * pct) / 100] / 1000.0;
+}
+
+static char *fake_fb(size_t size)
+{
+	char *addr;
+	int fd = syscall(SYS_memfd_create, "bench_blit", 0);
+	if (fd == -1) {
+		printf("memfd_create: %s\n", STRERR);
+		return NULL;
+	}
+	if (ftruncate(fd, size)) {
+		printf("ftruncate: %s\n", STRERR);
+		close(fd);
+		return NULL;
+	}
+	addr = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		printf("mmap: %s\n", STRERR);
+		return NULL;
+	}
+	/* fault it in before timing anything */
+	memset(addr, 0, size);
+	return addr;
+}
+
+/* same starting point for the real thing and the reference */
+static size_t verify_reset(char *fb, size_t bytes)
+{
+	if (bytes > g_size)
+		bytes = g_size;
+	memcpy(fb, g_fill, bytes);
+	memcpy(g_ref, g_fill, bytes);
+	return bytes;
+}
+
+static int verify(const char *what, char *fb, size_t bytes, uint32_t pitch)
+{
+	size_t i;
+	if (memcmp(fb, g_ref, bytes) == 0)
+		return 0;
+	for (i = 0; i < bytes && fb[i] == g_ref[i]; ++i)
+	{
+	}
+	printf("%s: MISMATCH at row %lu byte %lu, got %02x want %02x\n", what,
+			(unsigned long)(i / pitch), (unsigned long)(i % pitch),
+			(uint8_t)fb[i], (uint8_t)g_ref[i]);
+	return -1;
+}
+
+static uint32_t get32(char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static void put32(char *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t ref_rgb565(char *p)
+{
+	uint16_t v;
+	uint32_t r, g, b;
+	memcpy(&v, p, sizeof(v));
+	r = (v >> 11) & 0x1f;
+	g = (v >> 5)  & 0x3f;
+	b =  v        & 0x1f;
+	return 0xff000000 | (((r << 3) | (r >> 2)) << 16)
+			  | (((g << 2) | (g >> 4)) << 8)
+			  |  ((b << 3) | (b >> 2));
+}
+
+/* bt.601 limited range in 6 bit fixed point, saturated to 16 bits */
+static uint32_t ref_yuv_channel(int32_t c)
+{
+	if (c > 32767)
+		c = 32767;
+	else if (c < -32768)
+		c = -32768;
+	c >>= 6;
+	return (c < 0) ? 0 : ((c > 255) ? 255 : c);
+}
+
+static uint32_t ref_yuv(uint8_t luma, uint8_t cb, uint8_t cr)
+{
+	const int32_t y = ((luma - 16) * 75) + 32;
+	const int32_t u = cb - 128;
+	const int32_t v = cr - 128;
+	return 0xff000000 | (ref_yuv_channel(y + (102 * v)) << 16)
+			  | (ref_yuv_channel(y - (25 * u) - (52 * v)) << 8)
+			  |  ref_yuv_channel(y + (129 * u));
+}
+
+static uint32_t ref_blend(uint32_t d, uint32_t s)
+{
+	const uint32_t ia = 255 - (s >> 24);
+	uint32_t out = 0;
+	unsigned int c;
+	for (c = 0; c < 32; c += 8)
+	{
+		uint32_t t = (((d >> c) & 0xff) * ia) + 128;
+		t = ((t + (t >> 8)) >> 8) + ((s >> c) & 0xff);
+		out |= ((t > 255) ? 255 : t) << c;
+	}
+	return out;
+}
+
+static uint32_t ref_lerp(uint32_t a, uint32_t b, uint32_t weight)
+{
+	uint32_t out = 0;
+	unsigned int c;
+	for (c = 0; c < 32; c += 8)
+	{
+		const uint32_t t = (((a >> c) & 0xff) * (256 - weight))
+				 + (((b >> c) & 0xff) * weight);
+		out |= ((t >> 8) & 0xff) << c;
+	}
+	return out;
+}
+
+/* 8 bit fixed point source position of scaled pixel i, centers line up */
+static uint32_t ref_scale_pos(uint32_t i, uint32_t scale, uint32_t len)
+{
+	const int32_t pos = (int32_t)((((2 * i) + 1) * 128) / scale) - 128;
+	if (pos < 0)
+		return 0;
+	if (pos > (int32_t)((len - 1) * 256))
+		return (len - 1) * 256;
+	return pos;
+}
+
+static uint32_t ref_bilinear_row(char *row, uint32_t i, uint32_t scale,
+				 uint32_t len)
+{
+	const uint32_t pos = ref_scale_pos(i, scale, len);
+	const uint32_t a = get32(row + ((pos >> 8) * 4));
+	if (pos & 255)
+		return ref_lerp(a, get32(row + (((pos >> 8) + 1) * 4)), pos & 255);
+	return a;
+}
+
+static uint32_t ref_bilinear(char *src, uint32_t src_pitch, uint32_t w,
+			     uint32_t h, uint32_t scale, uint32_t x, uint32_t y)
+{
+	const uint32_t pos = ref_scale_pos(y, scale, h);
+	char *row = src + ((pos >> 8) * src_pitch);
+	const uint32_t a = ref_bilinear_row(row, x, scale, w);
+	if (pos & 255)
+		return ref_lerp(a, ref_bilinear_row(row + src_pitch, x, scale, w),
+				pos & 255);
+	return a;
+}
+
+static int bench_kernel(struct blit_kernel *kernel, char *fb, char *sprite,
+			 uint32_t bpp, uint32_t pad, uint16_t xoff,
+			 struct bench_rect rect)
+{
+	const uint32_t weight = bpp / 8;
+	const uint32_t pitch = (g_width * weight) + pad;
+	const uint32_t stride = g_width * weight;
+	uint16_t w = rect.w ? rect.w : g_width;
+	uint16_t h = rect.h ? rect.h : g_height;
+	unsigned long total = 0;
+	unsigned int i;
+	size_t bytes;
+	char *dest;
+	char *src;
+	double gbs;
+
+	if (w + xoff > g_width)
+		w = g_width - xoff;
+	dest = fb + xoff * weight;
+	src  = sprite + xoff * weight;
+
+	bytes = verify_reset(fb, (size_t)(h + 1) * pitch);
+	blit_pool_rect(kernel, dest, src, pitch, stride, w * weight, h);
+	for (i = 0; i < h; ++i)
+	{
+		memcpy(g_ref + (xoff * weight) + (i * pitch), src + (i * stride),
+		       w * weight);
+	}
+	if (verify(kernel->name, fb, bytes, pitch))
+		return -1;
+
+	for (i = 0; i < g_iterations; ++i)
+	{
+		unsigned long start = nsecs_now();
+		blit_pool_rect(kernel, dest, src, pitch, stride, w * weight, h);
+		g_samples[i] = nsecs_now() - start;
+		total += g_samples[i];
+	}
+	qsort(g_samples, g_iterations, sizeof(unsigned long), cmp_samples);
+	gbs = ((double)w * weight * h * g_iterations) / (total ? total : 1);
+	printf("%-9s %2d %3d %2d %4dx%-4d %8.2f %9.2f %9.2f %9.2f\n",
+			kernel->name, bpp, pad, xoff, w, h, gbs,
+			percentile(g_iterations, 50),
+			percentile(g_iterations, 90),
+			percentile(g_iterations, 99));
+	return 0;
+}
+
+/* sprite in format expanded to 32bpp, dest x is offset to test alignment */
+static void convert(char *fb, char *sprite, uint16_t format,
+		    uint16_t xoff, uint16_t w, uint16_t h)
+{
+	const uint32_t weight = (format == SPR16_FORMAT_RGB565) ? 2 : 1;
+	const uint32_t pitch = g_width * 4;
+	const uint32_t stride = g_width * weight;
+
+	if (format == SPR16_FORMAT_NV12)
+		blit_convert_yuv_rect(fb + (xoff * 4), pitch, sprite, g_width,
+				      sprite + (g_width * g_height), NULL,
+				      g_width, xoff, 0, w, h);
+	else if (format == SPR16_FORMAT_I420)
+		blit_convert_yuv_rect(fb + (xoff * 4), pitch, sprite, g_width,
+				      sprite + (g_width * g_height),
+				      sprite + (g_width * g_height * 2),
+				      g_width / 2, xoff, 0, w, h);
+	else
+		blit_convert_rect(fb + (xoff * 4), sprite + (xoff * weight),
+				  pitch, stride, w, h, format, g_palette);
+}
+
+static void ref_convert(char *sprite, uint16_t format, uint16_t xoff,
+			uint16_t w, uint16_t h)
+{
+	const uint32_t pitch = g_width * 4;
+	char *cb = sprite + (g_width * g_height);
+	char *cr = cb + (g_width * g_height);
+	uint32_t x, y, c;
+
+	for (y = 0; y < h; ++y)
+	for (x = xoff; x < (uint32_t)xoff + w; ++x)
+	{
+		char *d = g_ref + (y * pitch) + (x * 4);
+		uint8_t luma = sprite[(y * g_width) + x];
+		switch (format)
+		{
+		case SPR16_FORMAT_RGB565:
+			put32(d, ref_rgb565(sprite + (y * g_width * 2) + (x * 2)));
+			break;
+		case SPR16_FORMAT_INDEX8:
+			put32(d, g_palette[luma]);
+			break;
+		case SPR16_FORMAT_NV12:
+			c = ((y / 2) * g_width) + ((x / 2) * 2);
+			put32(d, ref_yuv(luma, cb[c], cb[c + 1]));
+			break;
+		case SPR16_FORMAT_I420:
+			c = ((y / 2) * (g_width / 2)) + (x / 2);
+			put32(d, ref_yuv(luma, cb[c], cr[c]));
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static int bench_convert(char *fb, char *sprite, uint16_t format,
+			 uint16_t xoff, struct bench_rect rect)
+{
+	const uint32_t pitch = g_width * 4;
+	uint16_t w = rect.w ? rect.w : g_width;
+	uint16_t h = rect.h ? rect.h : g_height;
+	unsigned long total = 0;
+	unsigned int i;
+	size_t bytes;
+	double gbs;
+
+	if (w + xoff > g_width)
+		w = g_width - xoff;
+
+	bytes = verify_reset(fb, (size_t)(h + 1) * pitch);
+	convert(fb, sprite, format, xoff, w, h);
+	ref_convert(sprite, format, xoff, w, h);
+	if (verify(g_format_names[format], fb, bytes, pitch))
+		return -1;
+
+	for (i = 0; i < g_iterations; ++i)
+	{
+		unsigned long start = nsecs_now();
+		convert(fb, sprite, format, xoff, w, h);
+		g_samples[i] = nsecs_now() - start;
+		total += g_samples[i];
+	}
+	qsort(g_samples, g_iterations, sizeof(unsigned long), cmp_samples);
+	/* bytes written */
+	gbs = ((double)w * 4 * h * g_iterations) / (total ? total : 1);
+	printf("%-9s %2d %4dx%-4d %8.2f %9.2f %9.2f %9.2f\n",
+			g_format_names[format],
+			xoff, w, h, gbs,
+			percentile(g_iterations, 50),
+			percentile(g_iterations, 90),
+			percentile(g_iterations, 99));
+	return 0;
+}
+
+/* premultiplied sprite over what is already there */
+static int bench_blend(char *fb, char *sprite, uint16_t xoff,
+		       struct bench_rect rect)
+{
+	const uint32_t pitch = g_width * 4;
+	uint16_t w = rect.w ? rect.w : g_width;
+	uint16_t h = rect.h ? rect.h : g_height;
+	unsigned long total = 0;
+	unsigned int i, x;
+	size_t bytes;
+	double gbs;
+
+	if (w + xoff > g_width)
+		w = g_width - xoff;
+
+	bytes = verify_reset(fb, (size_t)(h + 1) * pitch);
+	blit_blend_rect(fb + (xoff * 4), sprite + (xoff * 4), pitch, pitch, w, h);
+	for (i = 0; i < h; ++i)
+	for (x = xoff; x < (uint32_t)xoff + w; ++x)
+	{
+		char *d = g_ref + (i * pitch) + (x * 4);
+		put32(d, ref_blend(get32(d), get32(sprite + (i * pitch) + (x * 4))));
+	}
+	if (verify("blend", fb, bytes, pitch))
+		return -1;
+
+	for (i = 0; i < g_iterations; ++i)
+	{
+		unsigned long start = nsecs_now();
+		blit_blend_rect(fb + (xoff * 4), sprite + (xoff * 4), pitch, pitch,
+				w, h);
+		g_samples[i] = nsecs_now() - start;
+		total += g_samples[i];
+	}
+	qsort(g_samples, g_iterations, sizeof(unsigned long), cmp_samples);
+	/* bytes written */
+	gbs = ((double)w * 4 * h * g_iterations) / (total ? total : 1);
+	printf("%-9s %2d %4dx%-4d %8.2f %9.2f %9.2f %9.2f\n", "blend",
+			xoff, w, h, gbs,
+			percentile(g_iterations, 50),
+			percentile(g_iterations, 90),
+			percentile(g_iterations, 99));
+	return 0;
+}
+
+/* full screen from a sprite scale times smaller */
+static int bench_scale(char *fb, char *sprite, char *scratch,
+		       uint32_t scale, uint32_t filter)
+{
+	const uint32_t pitch = g_width * 4;
+	const uint16_t w = g_width / scale;
+	const uint16_t h = g_height / scale;
+	unsigned long total = 0;
+	unsigned int i, x;
+	size_t bytes;
+	double gbs;
+
+	bytes = verify_reset(fb, (size_t)((h * scale) + 1) * pitch);
+	blit_scale_rect(blit_kernel_get(), fb, pitch, sprite, w * 4, w, h,
+			scale, filter, 0, 0, w * scale, h * scale, scratch);
+	for (i = 0; i < (uint32_t)h * scale; ++i)
+	for (x = 0; x < (uint32_t)w * scale; ++x)
+	{
+		char *d = g_ref + (i * pitch) + (x * 4);
+		if (filter == SPR16_FILTER_BILINEAR)
+			put32(d, ref_bilinear(sprite, w * 4, w, h, scale, x, i));
+		else
+			put32(d, get32(sprite + ((i / scale) * w * 4)
+				       + ((x / scale) * 4)));
+	}
+	if (verify(filter == SPR16_FILTER_BILINEAR ? "bilinear" : "nearest",
+				fb, bytes, pitch))
+		return -1;
+
+	for (i = 0; i < g_iterations; ++i)
+	{
+		unsigned long start = nsecs_now();
+		blit_scale_rect(blit_kernel_get(), fb, pitch, sprite, w * 4, w, h,
+				scale, filter, 0, 0, w * scale, h * scale, scratch);
+		g_samples[i] = nsecs_now() - start;
+		total += g_samples[i];
+	}
+	qsort(g_samples, g_iterations, sizeof(unsigned long), cmp_samples);
+	/* bytes written */
+	gbs = ((double)w * scale * 4 * h * scale * g_iterations) / (total ? total : 1);
+	printf("%-9s %2d %4dx%-4d %8.2f %9.2f %9.2f %9.2f\n",
+			filter == SPR16_FILTER_BILINEAR ? "bilinear" : "nearest",
+			scale, w, h, gbs,
+			percentile(g_iterations, 50),
+			percentile(g_iterations, 90),
+			percentile(g_iterations, 99));
+	return 0;
+}
+
+static void bench_dmg(uint32_t rect_count)
+{
+	struct spr16_msgdata_sync rects[BENCH_MAX_RECTS];
+	struct dmg_tiles *dmg;
+	unsigned long spans = 0;
+	unsigned int i, r;
+
+	dmg = dmg_tiles_create(g_width, g_height);
+	if (dmg == NULL) {
+		printf("dmg_tiles_create failed\n");
+		return;
+	}
+	for (i = 0; i < g_iterations; ++i)
+	{
+		unsigned long start;
+		for (r = 0; r < rect_count; ++r)
+		{
+			rects[r].xmin = rand() % g_width;
+			rects[r].ymin = rand() % g_height;
+			rects[r].xmax = rects[r].xmin + (rand() % 64);
+			rects[r].ymax = rects[r].ymin + (rand() % 64);
+		}
+		start = nsecs_now();
+		for (r = 0; r < rect_count; ++r)
+		{
+			dmg_tiles_add(dmg, &rects[r]);
+		}
+		spans += dmg_tiles_merge(dmg);
+		dmg_tiles_clear(dmg);
+		g_samples[i] = nsecs_now() - start;
+	}
+	qsort(g_samples, g_iterations, sizeof(unsigned long), cmp_samples);
+	printf("%5d %9lu %9.2f %9.2f %9.2f\n", rect_count, spans / g_iterations,
+			percentile(g_iterations, 50),
+			percentile(g_iterations, 90),
+			percentile(g_iterations, 99));
+	dmg_tiles_destroy(dmg);
+}
+
+static int read_args(int argc, char *argv[], char **kernel, int *threads)
+{
+	int i;
+	for (i = 1; i < argc; ++i)
+	{
+		if (i + 1 >= argc) {
+			printf("missing argument for %s\n", argv[i]);
+			return -1;
+		}
+		if (strcmp(argv[i], "-n") == 0)
+			g_iterations = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "-k") == 0)
+			*kernel = argv[++i];
+		else if (strcmp(argv[i], "-t") == 0)
+			*threads = strtol(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "-w") == 0)
+			g_width = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "-h") == 0)
+			g_height = strtoul(argv[++i], NULL, 10);
+		else {
+			printf("unknown argument %s\n", argv[i]);
+			return -1;
+		}
+	}
+	if (g_iterations == 0 || g_iterations > BENCH_MAX_ITER) {
+		printf("iterations must be 1-%d\n", BENCH_MAX_ITER);
+		return -1;
+	}
+	if (g_width < 16 || g_height < 16) {
+		printf("bad screen size\n");
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char *kernel_name = NULL;
+	int threads = 0;
+	size_t size;
+	char *fb;
+	char *sprite;
+	char *scratch;
+	unsigned int k, b, p, x, r, f;
+	int ret = 0;
+
+	if (read_args(argc, argv, &kernel_name, &threads))
+		return -1;
+
+	/* largest pitch for the largest bpp */
+	size = ((g_width * 4) + 64) * g_height;
+	fb = fake_fb(size);
+	sprite = malloc(size);
+	scratch = malloc(((g_width * 4) + 8) * 4);
+	g_ref = malloc(size);
+	g_fill = malloc(size);
+	g_size = size;
+	if (fb == NULL || sprite == NULL || scratch == NULL
+			|| g_ref == NULL || g_fill == NULL)
+		return -1;
+	for (k = 0; k < size; ++k)
+	{
+		sprite[k] = rand();
+		g_fill[k] = rand();
+	}
+	for (k = 0; k < SPR16_PALETTE_COUNT; ++k)
+	{
+		g_palette[k] = rand();
+	}
+	if (blit_pool_create(threads))
+		return -1;
+
+	printf("screen %dx%d, PIXL_ALIGN %d, %d iterations, cpu flags 0x%x\n",
+			g_width, g_height, PIXL_ALIGN, g_iterations, blit_cpu_flags());
+	printf("\n%-9s %2s %3s %2s %9s %8s %9s %9s %9s\n", "kernel", "bpp", "pad",
+			"x", "rect", "GB/s", "p50 us", "p90 us", "p99 us");
+	for (k = 0; k < blit_kernel_count(); ++k)
+	{
+		struct blit_kernel *kernel = blit_kernel_at(k);
+		if (kernel_name && strcmp(kernel_name, kernel->name))
+			continue;
+		if (!blit_kernel_usable(kernel))
+			continue;
+		for (b = 0; b < sizeof(g_bpps) / sizeof(g_bpps[0]); ++b)
+		for (p = 0; p < sizeof(g_pads) / sizeof(g_pads[0]); ++p)
+		for (x = 0; x < sizeof(g_xoffs) / sizeof(g_xoffs[0]); ++x)
+		for (r = 0; r < sizeof(g_rects) / sizeof(g_rects[0]); ++r)
+		{
+			if (bench_kernel(kernel, fb, sprite, g_bpps[b], g_pads[p],
+					g_xoffs[x], g_rects[r]))
+				ret = -1;
+		}
+	}
+
+	printf("\n%-9s %2s %9s %8s %9s %9s %9s\n", "format", "x", "rect",
+			"GB/s", "p50 us", "p90 us", "p99 us");
+	for (f = 0; f < sizeof(g_formats) / sizeof(g_formats[0]); ++f)
+	for (x = 0; x < sizeof(g_xoffs) / sizeof(g_xoffs[0]); ++x)
+	for (r = 0; r < sizeof(g_rects) / sizeof(g_rects[0]); ++r)
+	{
+		if (bench_convert(fb, sprite, g_formats[f], g_xoffs[x], g_rects[r]))
+			ret = -1;
+	}
+	for (x = 0; x < sizeof(g_xoffs) / sizeof(g_xoffs[0]); ++x)
+	for (r = 0; r < sizeof(g_rects) / sizeof(g_rects[0]); ++r)
+	{
+		if (bench_blend(fb, sprite, g_xoffs[x], g_rects[r]))
+			ret = -1;
+	}
+
+	printf("\n%-9s %2s %9s %8s %9s %9s %9s\n", "filter", "x", "from",
+			"GB/s", "p50 us", "p90 us", "p99 us");
+	for (f = 0; f < 2; ++f)
+	for (x = 0; x < sizeof(g_scales) / sizeof(g_scales[0]); ++x)
+	{
+		if (bench_scale(fb, sprite, scratch, g_scales[x], f))
+			ret = -1;
+	}
+
+	printf("\n%5s %9s %9s %9s %9s\n", "rects", "spans", "p50 us",
+			"p90 us", "p99 us");
+	for (r = 0; r < sizeof(g_dmg_counts) / sizeof(g_dmg_counts[0]); ++r)
+	{
+		bench_dmg(g_dmg_counts[r]);
+	}
+
+	blit_pool_destroy();
+	munmap(fb, size);
+	free(sprite);
+	free(scratch);
+	free(g_ref);
+	free(g_fill);
+	if (ret)
+		printf("\nbench_blit: output did not match the reference\n");
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
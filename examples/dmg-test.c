@@ -0,0 +1,363 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * damage tile test. random rects are added to the grid and to a per pixel
+ * bitmap, the merged spans have to stay inside the sprite, never cover a
+ * pixel twice, and cover exactly the whole width of every dirty tile over
+ * the rows that were damaged in it. sizes that are not a multiple of the
+ * tile size check the clamped edge tiles, wide ones cross a bitmap word.
+ *
+ * with hashing on, tiles whose content was stored and did not change have
+ * to be dropped, and any change has to bring its tile back.
+ *
+ * dmg_test, exits non-zero on failure
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../dmg.h"
+
+#define TEST_ROUNDS 2000
+#define TEST_PIXELS (64 * 1024 * 1024) /* fewer rounds for big sizes */
+#define TEST_RECTS  64 /* most rects per round */
+
+struct test_size {
+	uint16_t w;
+	uint16_t h;
+};
+
+static struct test_size g_sizes[] = {
+	{ DMG_TILE_SIZE,       DMG_TILE_SIZE       },
+	{ 1,                   1                   },
+	{ 100,                 37                  },
+	{ 640,                 480                 },
+	{ 1920,                1080                },
+	{ (DMG_TILE_SIZE * 70) + 5, 3 * DMG_TILE_SIZE }
+};
+
+static uint8_t *g_damage; /* pixels added this round */
+static uint8_t *g_want;   /* pixels the spans should cover */
+static uint8_t *g_got;    /* times the spans covered each pixel */
+
+static uint16_t rand_coord(uint16_t len)
+{
+	/* sometimes past the edge, it gets clamped */
+	return rand() % (len + (len / 4) + 2);
+}
+
+static void random_rect(struct test_size *size, struct spr16_msgdata_sync *rect)
+{
+	uint16_t reach = (rand() % 4) ? DMG_TILE_SIZE * 2 : size->w;
+
+	rect->xmin = rand_coord(size->w);
+	rect->ymin = rand_coord(size->h);
+	rect->xmax = rect->xmin + (rand() % (reach + 1));
+	rect->ymax = rect->ymin + (rand() % (reach + 1));
+	if (rand() % 32 == 0) {
+		/* backwards */
+		uint16_t tmp = rect->xmin;
+		rect->xmin = rect->xmax;
+		rect->xmax = tmp;
+	}
+}
+
+static void mark_damage(struct test_size *size, struct spr16_msgdata_sync *rect)
+{
+	uint32_t x, y;
+	for (y = rect->ymin; y <= rect->ymax && y < size->h; ++y)
+	{
+		for (x = rect->xmin; x <= rect->xmax && x < size->w; ++x)
+		{
+			g_damage[(y * size->w) + x] = 1;
+		}
+	}
+}
+
+/* whole tile width, from the first to the last damaged row in the tile */
+static uint32_t expected_tiles(struct test_size *size)
+{
+	const uint32_t tiles_w = (size->w + DMG_TILE_SIZE - 1) / DMG_TILE_SIZE;
+	const uint32_t tiles_h = (size->h + DMG_TILE_SIZE - 1) / DMG_TILE_SIZE;
+	uint32_t tiles = 0;
+	uint32_t tx, ty, x, y;
+
+	memset(g_want, 0, (uint32_t)size->w * size->h);
+	for (ty = 0; ty < tiles_h; ++ty)
+	{
+		for (tx = 0; tx < tiles_w; ++tx)
+		{
+			const uint32_t x0 = tx * DMG_TILE_SIZE;
+			const uint32_t y0 = ty * DMG_TILE_SIZE;
+			uint32_t x1 = x0 + DMG_TILE_SIZE;
+			uint32_t y1 = y0 + DMG_TILE_SIZE;
+			uint32_t lo = y1;
+			uint32_t hi = 0;
+
+			if (x1 > size->w)
+				x1 = size->w;
+			if (y1 > size->h)
+				y1 = size->h;
+			for (y = y0; y < y1; ++y)
+			{
+				for (x = x0; x < x1; ++x)
+				{
+					if (!g_damage[(y * size->w) + x])
+						continue;
+					if (y < lo)
+						lo = y;
+					hi = y;
+				}
+			}
+			if (lo > hi)
+				continue;
+			++tiles;
+			for (y = lo; y <= hi; ++y)
+			{
+				memset(&g_want[(y * size->w) + x0], 1, x1 - x0);
+			}
+		}
+	}
+	return tiles;
+}
+
+static int check_spans(struct test_size *size, struct dmg_tiles *dmg,
+		       uint32_t count, unsigned int round)
+{
+	uint32_t i, x, y;
+
+	memset(g_got, 0, (uint32_t)size->w * size->h);
+	for (i = 0; i < count; ++i)
+	{
+		struct spr16_msgdata_sync *span = &dmg->spans[i];
+		if (span->xmin > span->xmax || span->ymin > span->ymax
+				|| span->xmax >= size->w || span->ymax >= size->h) {
+			printf("%dx%d round %u: bad span (%d, %d, %d, %d)\n",
+					size->w, size->h, round, span->xmin,
+					span->ymin, span->xmax, span->ymax);
+			return -1;
+		}
+		for (y = span->ymin; y <= span->ymax; ++y)
+		{
+			for (x = span->xmin; x <= span->xmax; ++x)
+			{
+				if (++g_got[(y * size->w) + x] > 1) {
+					printf("%dx%d round %u: pixel (%u, %u) copied twice\n",
+							size->w, size->h, round, x, y);
+					return -1;
+				}
+			}
+		}
+	}
+	for (y = 0; y < size->h; ++y)
+	{
+		for (x = 0; x < size->w; ++x)
+		{
+			const uint32_t i = (y * size->w) + x;
+			if (g_got[i] != g_want[i]) {
+				printf("%dx%d round %u: pixel (%u, %u) %s\n",
+						size->w, size->h, round, x, y,
+						g_want[i] ? "missed" : "copied, not dirty");
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int test_merge(struct test_size *size)
+{
+	struct spr16_msgdata_sync rect;
+	struct dmg_tiles *dmg;
+	unsigned int rounds = TEST_PIXELS / ((uint32_t)size->w * size->h);
+	unsigned int round;
+	int ret = -1;
+
+	if (rounds > TEST_ROUNDS)
+		rounds = TEST_ROUNDS;
+	if (rounds < 10)
+		rounds = 10;
+	dmg = dmg_tiles_create(size->w, size->h);
+	if (dmg == NULL) {
+		printf("dmg_tiles_create(%d, %d) failed\n", size->w, size->h);
+		return -1;
+	}
+	for (round = 0; round < rounds; ++round)
+	{
+		const unsigned int count = 1 + (rand() % TEST_RECTS);
+		uint32_t tiles;
+		uint32_t spans;
+		unsigned int r;
+
+		memset(g_damage, 0, (uint32_t)size->w * size->h);
+		for (r = 0; r < count; ++r)
+		{
+			const int outside = (rand() % 16 == 0);
+			int added;
+
+			random_rect(size, &rect);
+			if (outside) {
+				rect.xmin = size->w + (rand() % 8);
+				rect.xmax = rect.xmin + (rand() % 8);
+			}
+			added = dmg_tiles_add(dmg, &rect);
+			if (added != ((rect.xmin >= size->w || rect.ymin >= size->h
+						|| rect.xmin > rect.xmax) ? -1 : 0)) {
+				printf("%dx%d round %u: add(%d, %d, %d, %d) returned %d\n",
+						size->w, size->h, round, rect.xmin,
+						rect.ymin, rect.xmax, rect.ymax, added);
+				goto out;
+			}
+			if (added == 0)
+				mark_damage(size, &rect);
+		}
+		tiles = expected_tiles(size);
+		if (dmg_tiles_count(dmg) != tiles) {
+			printf("%dx%d round %u: %u dirty tiles, want %u\n", size->w,
+					size->h, round, dmg_tiles_count(dmg), tiles);
+			goto out;
+		}
+		spans = dmg_tiles_merge(dmg);
+		if (check_spans(size, dmg, spans, round))
+			goto out;
+		dmg_tiles_clear(dmg);
+		if (dmg_tiles_merge(dmg) != 0 || dmg_tiles_count(dmg) != 0) {
+			printf("%dx%d round %u: still dirty after clear\n",
+					size->w, size->h, round);
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	dmg_tiles_destroy(dmg);
+	return ret;
+}
+
+/* damage everything, filter, and copy out what is left */
+static uint32_t hash_pass(struct test_size *size, struct dmg_tiles *dmg,
+			  char *sprite)
+{
+	struct spr16_msgdata_sync all;
+	uint32_t spans;
+	uint32_t i;
+
+	all.xmin = 0;
+	all.ymin = 0;
+	all.xmax = size->w - 1;
+	all.ymax = size->h - 1;
+	dmg_tiles_add(dmg, &all);
+	dmg_tiles_hash_filter(dmg, sprite, size->w * 4, 4);
+	spans = dmg_tiles_merge(dmg);
+	for (i = 0; i < spans; ++i)
+	{
+		dmg_tiles_hash_store(dmg, sprite, size->w * 4, 4, dmg->hash_gen,
+				     &dmg->spans[i]);
+	}
+	i = dmg_tiles_count(dmg);
+	dmg_tiles_clear(dmg);
+	return i;
+}
+
+static int test_hash(struct test_size *size)
+{
+	const uint32_t tiles = ((size->w + DMG_TILE_SIZE - 1) / DMG_TILE_SIZE)
+			     * ((size->h + DMG_TILE_SIZE - 1) / DMG_TILE_SIZE);
+	struct dmg_tiles *dmg;
+	uint32_t *pixels;
+	uint32_t i, got;
+	int ret = -1;
+
+	dmg = dmg_tiles_create(size->w, size->h);
+	pixels = calloc((uint32_t)size->w * size->h, sizeof(uint32_t));
+	if (dmg == NULL || pixels == NULL || dmg_tiles_enable_hash(dmg)) {
+		printf("hash setup failed\n");
+		goto out;
+	}
+	for (i = 0; i < (uint32_t)size->w * size->h; ++i)
+	{
+		pixels[i] = rand();
+	}
+	if ((got = hash_pass(size, dmg, (char *)pixels)) != tiles
+			|| (got = hash_pass(size, dmg, (char *)pixels)) != 0) {
+		printf("%dx%d hash: %u tiles copied\n", size->w, size->h, got);
+		goto out;
+	}
+	for (i = 0; i < 64; ++i)
+	{
+		const uint32_t x = rand() % size->w;
+		const uint32_t y = rand() % size->h;
+		uint32_t *p = &pixels[(y * size->w) + x];
+
+		if (i % 2 && x + 8 < size->w && (x % DMG_TILE_SIZE) + 8 < DMG_TILE_SIZE) {
+			/* cancels out in a sum over 16 byte blocks */
+			p[0] += 1;
+			p[4] -= 2;
+			p[8] += 1;
+		}
+		else {
+			p[0] ^= 1U << (rand() % 32);
+		}
+		if ((got = hash_pass(size, dmg, (char *)pixels)) != 1) {
+			printf("%dx%d hash: change at (%u, %u) copied %u tiles\n",
+					size->w, size->h, x, y, got);
+			goto out;
+		}
+	}
+	/* stored before a reset, does not count after it */
+	dmg_tiles_hash_reset(dmg);
+	if ((got = hash_pass(size, dmg, (char *)pixels)) != tiles) {
+		printf("%dx%d hash: %u tiles copied after reset\n",
+				size->w, size->h, got);
+		goto out;
+	}
+	ret = 0;
+out:
+	dmg_tiles_destroy(dmg);
+	free(pixels);
+	return ret;
+}
+
+int main()
+{
+	uint32_t most = 0;
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < sizeof(g_sizes) / sizeof(g_sizes[0]); ++i)
+	{
+		if ((uint32_t)g_sizes[i].w * g_sizes[i].h > most)
+			most = (uint32_t)g_sizes[i].w * g_sizes[i].h;
+	}
+	g_damage = malloc(most);
+	g_want = malloc(most);
+	g_got = malloc(most);
+	if (g_damage == NULL || g_want == NULL || g_got == NULL)
+		return EXIT_FAILURE;
+
+	srand(1);
+	for (i = 0; i < sizeof(g_sizes) / sizeof(g_sizes[0]); ++i)
+	{
+		if (test_merge(&g_sizes[i]) || test_hash(&g_sizes[i]))
+			ret = -1;
+		else
+			printf("%5dx%-5d ok\n", g_sizes[i].w, g_sizes[i].h);
+	}
+	free(g_damage);
+	free(g_want);
+	free(g_got);
+	printf("dmg test %s\n", ret ? "FAILED" : "passed");
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -21,6 +21,7 @@
 #include <memory.h>
 #include <unistd.h>
 #include <time.h>
+#include <stdlib.h>
 #include "../spr16.h"
 #include "game.h"
 
@@ -44,8 +45,9 @@ int main(int argc, char *argv[])
 	int r;
 
 	if (argc < 2) {
-		printf("usage: program <server-name>\n");
+		printf("usage: program <server-name> [scale]\n");
 		printf("e.g: landit tty1\n");
+		printf("scale is a whole number, the server upscales with bilinear filtering\n");
 		return -1;
 	}
 
@@ -57,6 +59,10 @@ int main(int argc, char *argv[])
 		return -1;
 	if (spr16_client_init())
 		return -1;
+	if (argc > 2 && spr16_client_set_scale(atoi(argv[2]), SPR16_FILTER_BILINEAR)) {
+		printf("bad scale %s\n", argv[2]);
+		return -1;
+	}
 	spr16_client_set_servinfo_handler(handle_servinfo);
 	spr16_client_set_input_handler(game_input);
 
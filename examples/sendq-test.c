@@ -0,0 +1,327 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * server send queue test. input frames are committed to a client that only
+ * reads every few frames, through a small socket buffer or the message rings.
+ * each frame is a run of relative updates and a key carrying the frame
+ * number, the client has to see every key once and in order, whole, with
+ * exactly one frame worth of relative motion in front of it.
+ *
+ * a unix socket almost never takes part of a write, so in the short write
+ * pass write() is cut off partway through and the next call gets EAGAIN,
+ * as if the socket filled up in the middle of a message.
+ *
+ * sendq_test, exits non-zero on failure
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "../spr16.h"
+#include "../platform/linux/sendq.h"
+#define STRERR strerror(errno)
+
+#define TEST_FRAMES 5000
+#define TEST_RELS   (SENDQ_FRAME - 1) /* relative updates in front of each key */
+#define TEST_SNDBUF 4096
+#define TEST_READ   24 /* frames between client reads, more than the rings hold */
+#define TEST_STALLS 100000 /* flushes without progress before giving up */
+
+enum {
+	TEST_SOCKET = 0,
+	TEST_SHORT_WRITES,
+	TEST_MSGRING
+};
+
+struct reader {
+	struct spr16_rxbuf *rxbuf;
+	struct spr16_msgring *msgring;
+	int fd;
+	uint32_t frame;  /* next key expected */
+	int32_t rels;    /* relative motion since the last key */
+};
+
+static int g_short_writes;
+static unsigned long g_writes;
+
+/* overrides libc for the sendq's writes */
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	if (g_short_writes) {
+		++g_writes;
+		if (g_writes % 4 == 1 && count > 1) {
+			count = 1 + (g_writes * 13) % (count - 1);
+		}
+		else if (g_writes % 4 == 2) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	return syscall(SYS_write, fd, buf, count);
+}
+
+static int check_msgs(struct reader *rd, char *msgs, uint32_t len)
+{
+	uint32_t pos = 0;
+
+	while (pos < len)
+	{
+		struct spr16_msghdr *hdr = (struct spr16_msghdr *)(msgs + pos);
+		struct spr16_msgdata_input *input;
+
+		input = (struct spr16_msgdata_input *)(msgs + pos + sizeof(*hdr));
+		if (hdr->type != SPRITEMSG_INPUT
+				|| len - pos < sizeof(*hdr) + sizeof(*input)) {
+			printf("frame %u: bad message type %d\n", rd->frame, hdr->type);
+			return -1;
+		}
+		if (input->type == SPR16_INPUT_AXIS_RELATIVE
+				&& input->code == 0 && input->id == 1
+				&& input->val > 0) {
+			rd->rels += input->val;
+		}
+		else if (input->type == SPR16_INPUT_KEY && input->id == 1) {
+			if (input->val != (int32_t)rd->frame
+					|| input->ext != ~input->val
+					|| input->code != (rd->frame & 0xffff)) {
+				printf("frame %u: got key %d/%d\n", rd->frame,
+						input->val, input->ext);
+				return -1;
+			}
+			if (rd->rels != TEST_RELS) {
+				printf("frame %u: relative motion %d, want %d\n",
+						rd->frame, rd->rels, TEST_RELS);
+				return -1;
+			}
+			rd->rels = 0;
+			++rd->frame;
+		}
+		else {
+			printf("frame %u: torn message type(%d) code(%d) id(%d)\n",
+					rd->frame, input->type, input->code, input->id);
+			return -1;
+		}
+		pos += sizeof(*hdr) + get_msghdr_typelen(hdr);
+	}
+	return 0;
+}
+
+/* read everything the server got out so far */
+static int reader_drain(struct reader *rd)
+{
+	char buf[SPR16_MAXVARMSGLEN * 2];
+	char *msgs;
+	uint32_t len;
+	int r;
+
+	while (1)
+	{
+		if (rd->msgring) {
+			r = spr16_msgring_read(rd->msgring, buf, sizeof(buf));
+			if (r == -1) {
+				printf("msgring read: %s\n", STRERR);
+				return -1;
+			}
+			if (r == 0)
+				return 0;
+			msgs = buf;
+			len = r;
+		}
+		else {
+			msgs = spr16_rxbuf_read(rd->rxbuf, rd->fd, &len);
+			if (msgs == NULL && errno == EAGAIN)
+				return 0;
+			if (msgs == NULL) {
+				printf("rxbuf read: %s\n", STRERR);
+				return -1;
+			}
+		}
+		if (check_msgs(rd, msgs, len))
+			return -1;
+	}
+}
+
+static int stage_frame(struct sendq *q, uint32_t frame)
+{
+	struct spr16_msghdr hdr;
+	struct spr16_msgdata_input input;
+	unsigned int i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memset(&input, 0, sizeof(input));
+	hdr.type = SPRITEMSG_INPUT;
+	input.id = 1;
+	input.type = SPR16_INPUT_AXIS_RELATIVE;
+	input.val = 1;
+	for (i = 0; i < TEST_RELS; ++i)
+	{
+		if (sendq_stage(q, &hdr, &input, sizeof(input)))
+			return -1;
+	}
+	input.type = SPR16_INPUT_KEY;
+	input.code = frame & 0xffff;
+	input.val  = frame;
+	input.ext  = ~input.val;
+	return sendq_stage(q, &hdr, &input, sizeof(input));
+}
+
+static struct spr16_msgring *create_msgrings(struct spr16_msgring **client)
+{
+	struct spr16_msgring *server;
+	int fds[SPR16_MSGRING_FDS];
+	unsigned int i;
+	int memfd;
+
+	memfd = syscall(SYS_memfd_create, "sendq-test", 0);
+	if (memfd == -1 || ftruncate(memfd, spr16_msgring_size()) == -1) {
+		printf("memfd: %s\n", STRERR);
+		return NULL;
+	}
+	server = spr16_msgring_create(memfd);
+	if (server == NULL) {
+		close(memfd);
+		return NULL;
+	}
+	for (i = 0; i < SPR16_MSGRING_FDS; ++i)
+	{
+		fds[i] = dup(spr16_msgring_fds(server)[i]);
+	}
+	*client = spr16_msgring_open(fds);
+	if (*client == NULL) {
+		spr16_msgring_destroy(server);
+		return NULL;
+	}
+	return server;
+}
+
+static int run_test(int mode)
+{
+	const char *names[] = { "socket", "short writes", "msgring" };
+	struct reader rd;
+	struct sendq *q;
+	struct spr16_msgring *server = NULL;
+	uint32_t partial = 0;
+	uint32_t queued = 0;
+	uint32_t frame;
+	unsigned int stalls = 0;
+	int sndbuf = TEST_SNDBUF;
+	int sv[2];
+	int ret = -1;
+
+	memset(&rd, 0, sizeof(rd));
+	q = sendq_create(SENDQ_MSGS);
+	rd.rxbuf = spr16_rxbuf_create();
+	if (q == NULL || rd.rxbuf == NULL)
+		goto out;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		printf("socketpair: %s\n", STRERR);
+		goto out;
+	}
+	rd.fd = sv[1];
+	if (setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf))
+			|| fcntl(sv[0], F_SETFL, O_NONBLOCK)
+			|| fcntl(sv[1], F_SETFL, O_NONBLOCK)) {
+		printf("socket setup: %s\n", STRERR);
+		goto out_close;
+	}
+	if (mode == TEST_MSGRING) {
+		server = create_msgrings(&rd.msgring);
+		if (server == NULL || spr16_msgring_attach(sv[0], server))
+			goto out_close;
+	}
+	g_short_writes = (mode == TEST_SHORT_WRITES);
+	g_writes = 0;
+
+	for (frame = 0; frame < TEST_FRAMES; ++frame)
+	{
+		if (stage_frame(q, frame) || sendq_commit(q, sv[0])) {
+			printf("frame %u: %s\n", frame, STRERR);
+			goto out_close;
+		}
+		if (q->count)
+			++queued;
+		if (q->sent)
+			++partial;
+		/* the client only gets around to reading every few frames */
+		if (frame % TEST_READ == TEST_READ - 1) {
+			if (reader_drain(&rd) || sendq_flush(q, sv[0]) == -1)
+				goto out_close;
+			if (q->sent)
+				++partial;
+		}
+	}
+	while (q->count)
+	{
+		uint32_t last = rd.frame;
+		if (reader_drain(&rd) || sendq_flush(q, sv[0]) == -1)
+			goto out_close;
+		if (q->sent)
+			++partial;
+		stalls = (rd.frame == last) ? stalls + 1 : 0;
+		if (stalls > TEST_STALLS) {
+			printf("sendq stopped making progress, %u left\n", q->count);
+			goto out_close;
+		}
+	}
+	if (reader_drain(&rd))
+		goto out_close;
+
+	printf("%-12s frames %u, queued %u, partial %u, merged %u\n",
+			names[mode], rd.frame, queued, partial, q->merged);
+	if (rd.frame != TEST_FRAMES || rd.rels != 0) {
+		printf("client saw %u frames, want %u\n", rd.frame, TEST_FRAMES);
+		goto out_close;
+	}
+	if (queued == 0 || (mode == TEST_SHORT_WRITES && partial == 0)) {
+		printf("the socket never filled up, nothing was tested\n");
+		goto out_close;
+	}
+	ret = 0;
+
+out_close:
+	g_short_writes = 0;
+	if (server) {
+		spr16_msgring_detach(sv[0]);
+		spr16_msgring_destroy(server);
+	}
+	spr16_msgring_destroy(rd.msgring);
+	close(sv[0]);
+	close(sv[1]);
+out:
+	sendq_destroy(q);
+	spr16_rxbuf_destroy(rd.rxbuf);
+	return ret;
+}
+
+int main()
+{
+	int ret = 0;
+
+	if (run_test(TEST_SOCKET))
+		ret = -1;
+	if (run_test(TEST_SHORT_WRITES))
+		ret = -1;
+	if (run_test(TEST_MSGRING))
+		ret = -1;
+	printf("sendq test %s\n", ret ? "FAILED" : "passed");
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,258 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * simd path test. every pixel operation is run twice on random rects, once
+ * as it runs on this cpu and once with the cpu flags masked off so only the
+ * plain C paths are left, both destinations have to match byte for byte.
+ * odd x, widths and pitches push the kernels through their head and tail
+ * handling, and the whole destination is compared so writes past the
+ * rect are caught too.
+ *
+ * simd_test, exits non-zero on failure
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../spr16.h"
+#include "../platform/blit.h"
+
+#define TEST_ROUNDS 4000
+#define TEST_BYTES  (512 * 1024) /* each buffer */
+#define TEST_GUARD  64           /* bytes checked past the scratch */
+
+static char *g_src;
+static char *g_fill;  /* destinations start out as this */
+static char *g_dest[2]; /* cpu flags, masked off */
+static char *g_scratch;
+static uint32_t g_palette[SPR16_PALETTE_COUNT];
+
+static void reset()
+{
+	memcpy(g_dest[0], g_fill, TEST_BYTES);
+	memcpy(g_dest[1], g_fill, TEST_BYTES);
+}
+
+/* pass 0 is with every cpu flag, pass 1 is plain C */
+static char *pass_begin(unsigned int pass)
+{
+	blit_cpu_mask(pass ? 0 : 0xffffffff);
+	return g_dest[pass];
+}
+
+static int compare(const char *what, unsigned int round, unsigned int pitch)
+{
+	unsigned int i;
+
+	blit_cpu_mask(0xffffffff);
+	if (memcmp(g_dest[0], g_dest[1], TEST_BYTES) == 0)
+		return 0;
+	for (i = 0; i < TEST_BYTES && g_dest[0][i] == g_dest[1][i]; ++i)
+	{
+	}
+	printf("%s round %u: row %u byte %u, simd %02x plain %02x\n", what,
+			round, i / pitch, i % pitch, (uint8_t)g_dest[0][i],
+			(uint8_t)g_dest[1][i]);
+	return -1;
+}
+
+static int test_blend(unsigned int round)
+{
+	const unsigned int x = rand() % 8;
+	const unsigned int w = 1 + (rand() % 67);
+	const unsigned int h = 1 + (rand() % 9);
+	const unsigned int dest_pitch = (x + w + (rand() % 5)) * 4;
+	const unsigned int src_pitch = (x + w + (rand() % 5)) * 4;
+	unsigned int pass;
+
+	reset();
+	for (pass = 0; pass < 2; ++pass)
+	{
+		char *dest = pass_begin(pass);
+		blit_blend_rect(dest + (x * 4), g_src + (x * 4), dest_pitch,
+				src_pitch, w, h);
+	}
+	if (compare("blend", round, dest_pitch)) {
+		printf("x %u, %ux%u, pitch %u/%u\n", x, w, h, dest_pitch, src_pitch);
+		return -1;
+	}
+	return 0;
+}
+
+/* tall enough for every row phase of a cache line */
+static int test_convert(unsigned int round)
+{
+	const uint16_t format = (rand() % 2) ? SPR16_FORMAT_RGB565
+					     : SPR16_FORMAT_INDEX8;
+	const unsigned int weight = (format == SPR16_FORMAT_RGB565) ? 2 : 1;
+	const unsigned int x = rand() % 18;
+	const unsigned int w = 1 + (rand() % 100);
+	const unsigned int h = 1 + (rand() % 40);
+	const unsigned int dest_pitch = (x + w + (rand() % 17)) * 4;
+	const unsigned int src_pitch = (x + w + (rand() % 17)) * weight;
+	unsigned int pass;
+
+	reset();
+	for (pass = 0; pass < 2; ++pass)
+	{
+		char *dest = pass_begin(pass);
+		blit_convert_rect(dest + (x * 4), g_src + (x * weight), dest_pitch,
+				  src_pitch, w, h, format, g_palette);
+	}
+	if (compare(format == SPR16_FORMAT_RGB565 ? "rgb565" : "index8",
+				round, dest_pitch)) {
+		printf("x %u, %ux%u, pitch %u/%u\n", x, w, h, dest_pitch, src_pitch);
+		return -1;
+	}
+	return 0;
+}
+
+/* any x and y, chroma is shared by 2x2 luma pixels */
+static int test_yuv(unsigned int round)
+{
+	const int nv12 = rand() % 2;
+	const unsigned int lw = 1 + (rand() % 90);
+	const unsigned int lh = 1 + (rand() % 24);
+	const unsigned int x = rand() % lw;
+	const unsigned int y = rand() % lh;
+	const unsigned int w = 1 + (rand() % (lw - x));
+	const unsigned int h = 1 + (rand() % (lh - y));
+	const unsigned int luma_stride = lw + (rand() % 9);
+	const unsigned int chroma_stride = (nv12 ? (lw + 1) & ~1U : (lw + 1) / 2)
+					 + (rand() % 9);
+	const unsigned int dest_pitch = (w + (rand() % 9)) * 4;
+	char *cb = g_src + (luma_stride * lh);
+	char *cr = cb + (chroma_stride * ((lh + 1) / 2));
+	unsigned int pass;
+
+	reset();
+	for (pass = 0; pass < 2; ++pass)
+	{
+		char *dest = pass_begin(pass);
+		blit_convert_yuv_rect(dest, dest_pitch, g_src, luma_stride,
+				      cb, nv12 ? NULL : cr, chroma_stride,
+				      x, y, w, h);
+	}
+	if (compare(nv12 ? "nv12" : "i420", round, dest_pitch)) {
+		printf("%ux%u at %u,%u of %ux%u, stride %u/%u\n", w, h, x, y,
+				lw, lh, luma_stride, chroma_stride);
+		return -1;
+	}
+	return 0;
+}
+
+/* every scale, random part of the scaled image. scratch ends right at
+ * the guard so anything written past 4 * width + 8 pixels shows up */
+static int test_scale(unsigned int round)
+{
+	const unsigned int scale = 1 + (round % SPR16_SCALE_MAX);
+	const unsigned int filter = (round / SPR16_SCALE_MAX) % 2;
+	const unsigned int sw = 1 + (rand() % 40);
+	const unsigned int sh = 1 + (rand() % 20);
+	const unsigned int x = rand() % (sw * scale);
+	const unsigned int y = rand() % (sh * scale);
+	const unsigned int w = 1 + (rand() % ((sw * scale) - x));
+	const unsigned int h = 1 + (rand() % ((sh * scale) - y));
+	const unsigned int src_pitch = (sw + (rand() % 5)) * 4;
+	const unsigned int dest_pitch = (w + (rand() % 5)) * 4;
+	const unsigned int scratch = ((w * 4) + 8) * 4;
+	unsigned int pass, i;
+
+	reset();
+	for (pass = 0; pass < 2; ++pass)
+	{
+		char *dest = pass_begin(pass);
+		char *buf = g_scratch + TEST_BYTES - scratch;
+		struct blit_kernel *kernel = pass ? blit_kernel_find("memcpy")
+						  : blit_kernel_get();
+
+		memset(g_scratch + TEST_BYTES, 0x5a, TEST_GUARD);
+		blit_scale_rect(kernel, dest, dest_pitch, g_src, src_pitch, sw, sh,
+				scale, filter, x, y, w, h, buf);
+		for (i = 0; i < TEST_GUARD; ++i)
+		{
+			if (g_scratch[TEST_BYTES + i] != 0x5a) {
+				printf("scale %u round %u: scratch overrun\n", scale, round);
+				return -1;
+			}
+		}
+	}
+	if (compare(filter == SPR16_FILTER_BILINEAR ? "bilinear" : "nearest",
+				round, dest_pitch)) {
+		printf("scale %u, %ux%u at %u,%u of %ux%u\n", scale, w, h, x, y,
+				sw, sh);
+		return -1;
+	}
+	return 0;
+}
+
+static int (*g_tests[])(unsigned int round) = {
+	test_blend,
+	test_convert,
+	test_yuv,
+	test_scale
+};
+
+int main()
+{
+	unsigned int t, i;
+	int ret = 0;
+
+	g_src = malloc(TEST_BYTES);
+	g_fill = malloc(TEST_BYTES);
+	g_dest[0] = malloc(TEST_BYTES);
+	g_dest[1] = malloc(TEST_BYTES);
+	g_scratch = malloc(TEST_BYTES + TEST_GUARD);
+	if (!g_src || !g_fill || !g_dest[0] || !g_dest[1] || !g_scratch)
+		return EXIT_FAILURE;
+	srand(1);
+	for (i = 0; i < TEST_BYTES; ++i)
+	{
+		g_src[i] = rand();
+		g_fill[i] = rand();
+	}
+	/* opaque and clear pixels take their own paths through blend */
+	for (i = 3; i < TEST_BYTES; i += 4 * (1 + (rand() % 3)))
+	{
+		g_src[i] = (rand() % 2) ? 0xff : 0x00;
+	}
+	for (i = 0; i < SPR16_PALETTE_COUNT; ++i)
+	{
+		g_palette[i] = rand();
+	}
+	if (blit_kernel_select(NULL))
+		return EXIT_FAILURE;
+	if (!(blit_cpu_flags() & BLIT_CPU_SSE2))
+		printf("no sse2, only the plain C paths are compared\n");
+
+	for (t = 0; t < sizeof(g_tests) / sizeof(g_tests[0]); ++t)
+	{
+		for (i = 0; i < TEST_ROUNDS; ++i)
+		{
+			if (g_tests[t](i)) {
+				ret = -1;
+				break;
+			}
+		}
+	}
+	free(g_src);
+	free(g_fill);
+	free(g_dest[0]);
+	free(g_dest[1]);
+	free(g_scratch);
+	printf("simd test %s\n", ret ? "FAILED" : "passed");
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -87,6 +87,34 @@ int update()
 	return 0;
 }
 
+/* the display paces movement, bars travel the same distance per vblank
+ * even if we were too late for some of them */
+int handle_present(struct spr16_msgdata_present *present)
+{
+	static uint32_t last_sequence;
+	static uint32_t last_dropped;
+	uint32_t frames = 1;
+
+	if (last_sequence)
+		frames = present->sequence - last_sequence;
+	if (frames > 60)
+		frames = 60;
+	if (frames > 1 || present->dropped != last_dropped) {
+		printf("missed %d vblanks, server dropped %d total "
+				"(wait %dus, copy %dus)\n",
+				frames - 1, present->dropped,
+				present->wait_us, present->copy_us);
+	}
+	last_sequence = present->sequence;
+	last_dropped  = present->dropped;
+	while (frames--)
+	{
+		if (update())
+			return -1;
+	}
+	return 0;
+}
+
 int draw()
 {
 	const unsigned int bars = 9;
@@ -113,8 +141,8 @@ int draw()
 		}
 
 	}
-	if (spr16_client_sync(0, 0, g_screen->width,
-				g_screen->height, SPRITESYNC_FLAG_VBLANK)) {
+	if (spr16_client_sync(0, 0, g_screen->width - 1,
+				g_screen->height - 1, SPRITESYNC_FLAG_VBLANK)) {
 		if (errno != EAGAIN) {
 			return -1;
 		}
@@ -173,6 +201,7 @@ int main(int argc, char *argv[])
 		return -1;
 	spr16_client_set_servinfo_handler(handle_servinfo);
 	spr16_client_set_input_handler(handle_input);
+	spr16_client_set_present_handler(handle_present);
 
 	r = spr16_client_connect(argv[1]);
 	if (r == -1) {
@@ -192,16 +221,14 @@ int main(int argc, char *argv[])
 
 	while (1)
 	{
-		r = spr16_client_update(0);
+		/* sleep until the last frame is on screen */
+		r = spr16_client_update(spr16_client_waiting_for_vsync() ? -1 : 0);
 		if (r == -1) {
 			printf("spr16 update error\n");
 			return -1;
 		}
-		if (update())
+		if (draw())
 			return -1;
-
-		draw();
-		usleep(2000);
 	}
 	spr16_client_shutdown();
 
@@ -34,15 +34,20 @@
 #include "spr16.h"
 #include "screen.h"
 #include "platform/fdpoll-handler.h"
+#include "platform/blit.h"
+#include "platform/blitpool.h"
 #include "platform/linux/platform.h"
 #include "platform/linux/vt.h"
 #include "platform/linux/fb.h"
+#include "platform/linux/compositor.h"
+#include "platform/linux/drm.h"
 #define STRERR strerror(errno)
 
 sig_atomic_t g_initialized;
 sig_atomic_t g_running;
 struct server_options g_srv_opts;
-struct drm_kms *g_card0;
+struct drm_kms *g_card0; /* NULL when headless */
+int g_has_vt;
 
 void exit_func()
 {
@@ -52,7 +57,8 @@ void exit_func()
 				SPR16_SOCKPATH, g_srv_opts.socket_name);
 		unlink(sockpath);
 	}
-	vt_shutdown();
+	if (g_has_vt)
+		vt_shutdown();
 }
 
 /* reset on fatal signals, sigkill screws us up still :( */
@@ -91,33 +97,43 @@ static void sig_setup()
 	sa.sa_handler = SIG_IGN; sigaction(SIGPIPE, &sa, NULL);
 }
 
-int server_main(struct fdpoll_handler *fdpoll, struct drm_kms *card)
+int server_main(struct fdpoll_handler *fdpoll, struct output *output)
 {
 	struct server_context *ctx;
-	struct spr16_framebuffer fb;
-	memset(&fb, 0, sizeof(struct spr16_framebuffer));
-	fb.width  = card->sfb->width;
-	fb.height = card->sfb->height;
-	fb.bpp    = card->sfb->bpp;
-	fb.addr   = card->sfb->addr;
-	fb.size   = card->sfb->size;
 
-	/*K_XLATE, or K_MEDIUMRAW for keycodes, RAW is 8 bits*/
-	if (vt_init(0, K_XLATE))
+	if (blit_kernel_select(g_srv_opts.blit_kernel)) {
+		printf("blit_kernel_select failed\n");
 		return -1;
-	if (atexit(exit_func))
+	}
+	if (blit_pool_create(g_srv_opts.blit_threads)) {
+		printf("blit_pool_create failed\n");
+		return -1;
+	}
+	if (compositor_create(g_srv_opts.compositor_thread)) {
+		printf("compositor_create failed\n");
+		blit_pool_destroy();
 		return -1;
+	}
+
+	/*K_XLATE, or K_MEDIUMRAW for keycodes, RAW is 8 bits*/
+	if (g_card0) {
+		if (vt_init(0, K_XLATE))
+			goto err_compositor;
+		g_has_vt = 1;
+	}
+	if (atexit(exit_func))
+		goto err_compositor;
 	sig_setup();
 
-	ctx = spr16_server_init(g_srv_opts.socket_name, fdpoll, &fb);
+	ctx = spr16_server_init(g_srv_opts.socket_name, fdpoll, output);
 	if (ctx == NULL) {
 		printf("server init failed\n");
-		return -1;
+		goto err_compositor;
 	}
 	g_initialized = 1;
 	/* for vblank handler, and future pageflipping */
-	if (fdpoll_handler_add(fdpoll, card->card_fd, FDPOLLIN, fb_drm_fd_callback, ctx)){
-		printf("fdpoll_handler_add(%d) failed\n", card->card_fd);
+	if (fdpoll_handler_add(fdpoll, output->fd, FDPOLLIN, output->fd_callback, ctx)){
+		printf("fdpoll_handler_add(%d) failed\n", output->fd);
 		goto err;
 	}
 
@@ -130,10 +146,15 @@ int server_main(struct fdpoll_handler *fdpoll, struct drm_kms *card)
 	}
 
 	spr16_server_shutdown(ctx);
+	compositor_destroy();
+	blit_pool_destroy();
 	return 0;
 
 err:
 	spr16_server_shutdown(ctx);
+err_compositor:
+	compositor_destroy();
+	blit_pool_destroy();
 	return -1;
 }
 
@@ -171,6 +192,12 @@ int read_environ(struct server_options *srv_opts)
 	uint16_t req_width     = 0;
 	uint16_t req_height    = 0;
 	uint16_t req_refresh   = 60;
+	int blit_threads       = -1;
+	int tile_hash          = 0;
+	int frame_sched        = 1;
+	int compositor_thread  = 1;
+	int msg_rings          = 1;
+	uint32_t req_pitch     = 0;
 
 	estr = getenv("SPR16_VSCROLL_AMOUNT");
 	if (estr != NULL) {
@@ -238,6 +265,83 @@ int read_environ(struct server_options *srv_opts)
 		tap_delay = tap_delay * 1000;
 	}
 
+	estr = getenv("SPR16_BLIT_KERNEL");
+	if (estr != NULL) {
+		if (strlen(estr) >= sizeof(srv_opts->blit_kernel)) {
+			printf("erroneous environ SPR16_BLIT_KERNEL\n");
+			return -1;
+		}
+		snprintf(srv_opts->blit_kernel, sizeof(srv_opts->blit_kernel), "%s", estr);
+	}
+
+	estr = getenv("SPR16_BLIT_THREADS");
+	if (estr != NULL) {
+		errno = 0;
+		blit_threads = strtol(estr, &err, 10);
+		if (err == NULL || *err || errno || blit_threads < 0) {
+			printf("erroneous environ SPR16_BLIT_THREADS\n");
+				return -1;
+		}
+	}
+
+	estr = getenv("SPR16_TILE_HASH");
+	if (estr != NULL) {
+		errno = 0;
+		tile_hash = strtol(estr, &err, 10);
+		if (err == NULL || *err || errno) {
+			printf("erroneous environ SPR16_TILE_HASH\n");
+				return -1;
+		}
+	}
+
+	estr = getenv("SPR16_FRAME_SCHED");
+	if (estr != NULL) {
+		errno = 0;
+		frame_sched = strtol(estr, &err, 10);
+		if (err == NULL || *err || errno) {
+			printf("erroneous environ SPR16_FRAME_SCHED\n");
+				return -1;
+		}
+	}
+
+	estr = getenv("SPR16_COMPOSITOR_THREAD");
+	if (estr != NULL) {
+		errno = 0;
+		compositor_thread = strtol(estr, &err, 10);
+		if (err == NULL || *err || errno) {
+			printf("erroneous environ SPR16_COMPOSITOR_THREAD\n");
+				return -1;
+		}
+	}
+
+	estr = getenv("SPR16_MSG_RINGS");
+	if (estr != NULL) {
+		errno = 0;
+		msg_rings = strtol(estr, &err, 10);
+		if (err == NULL || *err || errno) {
+			printf("erroneous environ SPR16_MSG_RINGS\n");
+				return -1;
+		}
+	}
+
+	estr = getenv("SPR16_OUTPUT");
+	if (estr != NULL) {
+		if (strcmp(estr, "drm") && strcmp(estr, "headless")) {
+			printf("erroneous environ SPR16_OUTPUT\n");
+			return -1;
+		}
+		snprintf(srv_opts->output, sizeof(srv_opts->output), "%s", estr);
+	}
+	estr = getenv("SPR16_SCREEN_PITCH");
+	if (estr != NULL) {
+		errno = 0;
+		req_pitch = strtoul(estr, &err, 10);
+		if (err == NULL || *err || errno) {
+			printf("erroneous environ SPR16_SCREEN_PITCH\n");
+				return -1;
+		}
+	}
+
 	estr = getenv("SPR16_SOCKET");
 	if (estr == NULL)
 		estr = SPR16_DEFAULT_SOCKET;
@@ -250,6 +354,12 @@ int read_environ(struct server_options *srv_opts)
 	srv_opts->request_width   = req_width;
 	srv_opts->request_height  = req_height;
 	srv_opts->request_refresh = req_refresh;
+	srv_opts->blit_threads    = blit_threads;
+	srv_opts->tile_hash       = tile_hash;
+	srv_opts->frame_sched     = frame_sched;
+	srv_opts->compositor_thread = compositor_thread;
+	srv_opts->msg_rings       = msg_rings;
+	srv_opts->request_pitch   = req_pitch;
 	return 0;
 }
 
@@ -271,6 +381,16 @@ static void print_usage()
 	printf("    SPR16_POINTER_ACCEL       pointer acceleration\n");
 	printf("    SPR16_TRACKPAD            surface acts as trackpad\n");
 	printf("    SPR16_TAP_DELAY           millisecond delay for tap to click\n");
+	printf("    SPR16_BLIT_KERNEL         force copy kernel: avx512, avx2, sse2,\n");
+	printf("                              sse2-512, erms, memcpy\n");
+	printf("    SPR16_BLIT_THREADS        extra copy threads, 0 to disable\n");
+	printf("    SPR16_TILE_HASH           1 to skip copying unchanged tiles\n");
+	printf("    SPR16_FRAME_SCHED         0 to copy vblank syncs on the vblank event\n");
+	printf("                              instead of just before it\n");
+	printf("    SPR16_COMPOSITOR_THREAD   0 to copy on the event loop thread\n");
+	printf("    SPR16_MSG_RINGS           0 to keep client messages on the socket\n");
+	printf("    SPR16_OUTPUT              drm (default), or headless memfd output\n");
+	printf("    SPR16_SCREEN_PITCH        headless bytes per row, 0 for packed\n");
 	printf("\n");
 }
 
@@ -350,6 +470,7 @@ err_gid:
 int main(int argc, char *argv[])
 {
 	struct fdpoll_handler *fdpoll;
+	struct output *output;
 	int ret = -1;
 
 	g_running = 1;
@@ -374,17 +495,36 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	/* card0 must be set before any SIGUSR1/2's might be sent! */
-	g_card0 = drm_mode_create("card0", g_srv_opts.inactive_vt,
-					   g_srv_opts.request_width,
-					   g_srv_opts.request_height,
-					   g_srv_opts.request_refresh);
-	if (g_card0 == NULL) {
-		printf("drm_mode_create failed\n");
-		return -1;
+	if (strncmp(g_srv_opts.output, "headless", sizeof(g_srv_opts.output)) == 0) {
+		output = output_headless_create(
+				g_srv_opts.request_width  ? g_srv_opts.request_width  : 1920,
+				g_srv_opts.request_height ? g_srv_opts.request_height : 1080,
+				g_srv_opts.request_pitch,
+				g_srv_opts.request_refresh);
+		if (output == NULL) {
+			printf("output_headless_create failed\n");
+			return -1;
+		}
+	}
+	else {
+		/* card0 must be set before any SIGUSR1/2's might be sent! */
+		g_card0 = drm_mode_create("card0", g_srv_opts.inactive_vt,
+						   g_srv_opts.request_width,
+						   g_srv_opts.request_height,
+						   g_srv_opts.request_refresh);
+		if (g_card0 == NULL) {
+			printf("drm_mode_create failed\n");
+			return -1;
+		}
+		output = output_drm_create(g_card0);
+		if (output == NULL) {
+			printf("output_drm_create failed\n");
+			return -1;
+		}
 	}
 
-	ret = server_main(fdpoll, g_card0);
-	drm_kms_destroy(g_card0);
+	ret = server_main(fdpoll, output);
+	output->destroy(output);
+	g_card0 = NULL;
 	return ret;
 }
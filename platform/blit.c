@@ -0,0 +1,797 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * non-temporal stores are preferred over rep movsb, the destination is
+ * usually write-combined scanout memory and we never read it back.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "../spr16.h"
+#include "blit.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+	#define BLIT_X86
+#endif
+
+#ifdef BLIT_X86
+extern void x86_sse2_xmmcpy_512(char *dest, char *src, unsigned int count);
+extern void x86_sse2_xmmcpy_1024(char *dest, char *src, unsigned int count);
+extern void x86_avx2_ymmcpy_1024(char *dest, char *src, unsigned int count);
+extern void x86_avx512_zmmcpy_1024(char *dest, char *src, unsigned int count);
+extern void x86_erms_movsb(char *dest, char *src, unsigned int count);
+extern void x86_sse2_xmmblit_512(char *dest, char *src, unsigned int dest_pitch,
+				 unsigned int src_pitch, unsigned int count,
+				 unsigned int height);
+extern void x86_sse2_xmmblit_1024(char *dest, char *src, unsigned int dest_pitch,
+				  unsigned int src_pitch, unsigned int count,
+				  unsigned int height);
+extern void x86_avx2_ymmblit_1024(char *dest, char *src, unsigned int dest_pitch,
+				  unsigned int src_pitch, unsigned int count,
+				  unsigned int height);
+extern void x86_avx512_zmmblit_1024(char *dest, char *src, unsigned int dest_pitch,
+				    unsigned int src_pitch, unsigned int count,
+				    unsigned int height);
+extern void x86_erms_blit(char *dest, char *src, unsigned int dest_pitch,
+			  unsigned int src_pitch, unsigned int count,
+			  unsigned int height);
+extern void x86_sse42_crc32c(uint32_t state[2], char *src, unsigned int src_pitch,
+			     unsigned int count, unsigned int height);
+extern void x86_sse2_blend_over(char *dest, char *src, unsigned int count);
+extern void x86_sse2_rgb565_xrgb(char *dest, char *src, unsigned int dest_pitch,
+				 unsigned int src_pitch, unsigned int count,
+				 unsigned int height);
+extern void x86_sse2_yuv_xrgb(char *dest, char *luma, char *cbcr, unsigned int count);
+extern void x86_sse2_yuv420_xrgb(char *dest, char *luma, char *cb, char *cr,
+				 unsigned int count);
+extern void x86_sse2_scale2_xrgb(char *dest, char *src, unsigned int count);
+extern void x86_sse2_splat_xrgb(char *dest, char *src, unsigned long step,
+				unsigned int count);
+extern void x86_sse2_zip_xrgb(char *dest, char *src, char *src2, unsigned int count);
+extern void x86_sse2_lerp_xrgb(char *dest, char *a, char *b, unsigned int weight,
+			       unsigned int count);
+extern void x86_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t out[4]);
+extern uint32_t x86_xgetbv(uint32_t xcr);
+#endif
+
+static void generic_memcpy(char *dest, char *src, unsigned int count)
+{
+	memcpy(dest, src, count);
+}
+
+static void generic_blit(char *dest, char *src,
+			 unsigned int dest_pitch, unsigned int src_pitch,
+			 unsigned int count, unsigned int height)
+{
+	while (height--)
+	{
+		memcpy(dest, src, count);
+		dest += dest_pitch;
+		src  += src_pitch;
+	}
+}
+
+static struct blit_kernel g_kernels[] = {
+#ifdef BLIT_X86
+	{ "avx512",   x86_avx512_zmmcpy_1024, x86_avx512_zmmblit_1024,
+		128, 64, BLIT_CPU_AVX512 },
+	{ "avx2",     x86_avx2_ymmcpy_1024,   x86_avx2_ymmblit_1024,
+		128, 32, BLIT_CPU_AVX2   },
+	{ "sse2",     x86_sse2_xmmcpy_1024,   x86_sse2_xmmblit_1024,
+		128, 16, BLIT_CPU_SSE2   },
+	{ "sse2-512", x86_sse2_xmmcpy_512,    x86_sse2_xmmblit_512,
+		 64, 16, BLIT_CPU_SSE2   },
+	{ "erms",     x86_erms_movsb,         x86_erms_blit,
+		  1,  1, BLIT_CPU_ERMS   },
+#endif
+	{ "memcpy",   generic_memcpy,         generic_blit,
+		  1,  1, 0               }
+};
+#define KERNEL_COUNT (sizeof(g_kernels) / sizeof(struct blit_kernel))
+
+static struct blit_kernel *g_kernel = &g_kernels[KERNEL_COUNT-1];
+static uint32_t g_cpu_flags;
+static uint32_t g_cpu_mask = 0xffffffff;
+static int g_cpu_probed;
+
+#ifdef BLIT_X86
+/* xcr0 state bits the os must save for us */
+#define XCR0_AVX    0x06 /* sse, avx */
+#define XCR0_AVX512 0xe6 /* sse, avx, opmask, zmm hi256, hi16 zmm */
+
+static uint32_t x86_probe()
+{
+	uint32_t regs[4]; /* eax, ebx, ecx, edx */
+	uint32_t max_leaf;
+	uint32_t xcr0 = 0;
+	uint32_t flags = 0;
+
+	x86_cpuid(0, 0, regs);
+	max_leaf = regs[0];
+	if (max_leaf < 1)
+		return 0;
+
+	x86_cpuid(1, 0, regs);
+	if (regs[3] & (1 << 26))
+		flags |= BLIT_CPU_SSE2;
+	if (regs[2] & (1 << 20))
+		flags |= BLIT_CPU_SSE42;
+	if (regs[2] & (1 << 27)) /* osxsave */
+		xcr0 = x86_xgetbv(0);
+	if (max_leaf < 7)
+		return flags;
+
+	x86_cpuid(7, 0, regs);
+	if ((regs[1] & (1 << 5)) && (xcr0 & XCR0_AVX) == XCR0_AVX)
+		flags |= BLIT_CPU_AVX2;
+	if ((regs[1] & (1 << 16)) && (xcr0 & XCR0_AVX512) == XCR0_AVX512)
+		flags |= BLIT_CPU_AVX512;
+	if (regs[1] & (1 << 9))
+		flags |= BLIT_CPU_ERMS;
+	return flags;
+}
+#endif
+
+uint32_t blit_cpu_flags()
+{
+	if (!g_cpu_probed) {
+#ifdef BLIT_X86
+		g_cpu_flags = x86_probe();
+#endif
+		g_cpu_probed = 1;
+	}
+	return g_cpu_flags & g_cpu_mask;
+}
+
+void blit_cpu_mask(uint32_t mask)
+{
+	g_cpu_mask = mask;
+}
+
+int blit_kernel_usable(struct blit_kernel *kernel)
+{
+	return (kernel->cpu_flags & blit_cpu_flags()) == kernel->cpu_flags;
+}
+
+struct blit_kernel *blit_kernel_find(char *name)
+{
+	unsigned int i;
+	for (i = 0; i < KERNEL_COUNT; ++i)
+	{
+		if (strncmp(g_kernels[i].name, name, sizeof(g_kernels[i].name)) == 0)
+			return &g_kernels[i];
+	}
+	return NULL;
+}
+
+int blit_kernel_select(char *force)
+{
+	unsigned int i;
+
+	if (force && force[0]) {
+		struct blit_kernel *kernel = blit_kernel_find(force);
+		if (kernel == NULL) {
+			printf("unknown blit kernel: %s\n", force);
+			return -1;
+		}
+		if (!blit_kernel_usable(kernel)) {
+			printf("blit kernel %s is not usable on this system\n", force);
+			return -1;
+		}
+		g_kernel = kernel;
+	}
+	else {
+		for (i = 0; i < KERNEL_COUNT; ++i)
+		{
+			if (blit_kernel_usable(&g_kernels[i])) {
+				g_kernel = &g_kernels[i];
+				break;
+			}
+		}
+	}
+	printf("blit kernel: %s (cpu flags 0x%x)\n", g_kernel->name, blit_cpu_flags());
+	return 0;
+}
+
+struct blit_kernel *blit_kernel_get()
+{
+	return g_kernel;
+}
+
+unsigned int blit_kernel_count()
+{
+	return KERNEL_COUNT;
+}
+
+struct blit_kernel *blit_kernel_at(unsigned int idx)
+{
+	if (idx >= KERNEL_COUNT)
+		return NULL;
+	return &g_kernels[idx];
+}
+
+/* the first usable kernel without a non-temporal body, erms or memcpy */
+static struct blit_kernel *blit_kernel_plain()
+{
+	unsigned int i;
+	for (i = 0; i < KERNEL_COUNT; ++i)
+	{
+		if (g_kernels[i].align == 1 && blit_kernel_usable(&g_kernels[i]))
+			return &g_kernels[i];
+	}
+	return &g_kernels[KERNEL_COUNT-1];
+}
+
+void blit_rect(struct blit_kernel *kernel, char *dest, char *src,
+	       unsigned int dest_pitch, unsigned int src_pitch,
+	       unsigned int width, unsigned int height)
+{
+	const uintptr_t mask = BLIT_LINE - 1;
+	unsigned int low, period, phase;
+
+	if (!width || !height)
+		return;
+	if (kernel->align == 1) {
+		kernel->rect(dest, src, dest_pitch, src_pitch,
+			     width / kernel->unit, height);
+		return;
+	}
+	/* too small, or no row can hold a whole unit on line boundaries */
+	if (width * height < BLIT_NT_MIN_BYTES || width < kernel->unit) {
+		kernel = blit_kernel_plain();
+		kernel->rect(dest, src, dest_pitch, src_pitch, width, height);
+		return;
+	}
+
+	/*
+	 * rows that are period apart start at the same offset into a line, so
+	 * each phase is one call to the rect kernel with the body starting on
+	 * the first whole line of the row. a fence per phase instead of per row,
+	 * only one if the pitch is a multiple of the line
+	 */
+	low = (dest_pitch | BLIT_LINE) & (~(dest_pitch | BLIT_LINE) + 1);
+	period = BLIT_LINE / low;
+	for (phase = 0; phase < period && phase < height; ++phase)
+	{
+		char *d = dest + (phase * dest_pitch);
+		char *s = src  + (phase * src_pitch);
+		const unsigned int rows = ((height - phase) + period - 1) / period;
+		unsigned int head = (BLIT_LINE - ((uintptr_t)d & mask)) & mask;
+		unsigned int body;
+
+		if (head > width)
+			head = width;
+		body = (width - head) - ((width - head) % kernel->unit);
+		if (body == 0) {
+			blit_kernel_plain()->rect(d, s, dest_pitch * period,
+						  src_pitch * period, width, rows);
+			continue;
+		}
+		if (head)
+			generic_blit(d, s, dest_pitch * period, src_pitch * period,
+				     head, rows);
+		kernel->rect(d + head, s + head, dest_pitch * period,
+			     src_pitch * period, body / kernel->unit, rows);
+		if (head + body < width)
+			generic_blit(d + head + body, s + head + body,
+				     dest_pitch * period, src_pitch * period,
+				     width - head - body, rows);
+	}
+}
+
+/* crc32c (castagnoli, reflected), a nibble at a time */
+static const uint32_t g_crc32c_nibble[16] = {
+	0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1,
+	0x417b1dbc, 0x5125dad3, 0x61c69362, 0x7198540d,
+	0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9,
+	0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75
+};
+
+static uint32_t generic_crc32c(uint32_t crc, char *src, unsigned int bytes)
+{
+	unsigned int i;
+	for (i = 0; i < bytes; ++i)
+	{
+		crc ^= (uint8_t)src[i];
+		crc = (crc >> 4) ^ g_crc32c_nibble[crc & 0x0f];
+		crc = (crc >> 4) ^ g_crc32c_nibble[crc & 0x0f];
+	}
+	return crc;
+}
+
+/* same chains as x86_sse42_crc32c, first 8 bytes of each 16 byte block go
+ * into state[0] and the second 8 into state[1] */
+static void generic_hash(uint32_t state[2], char *src, unsigned int src_pitch,
+			 unsigned int count, unsigned int height)
+{
+	unsigned int i;
+	while (height--)
+	{
+		for (i = 0; i < count; ++i)
+		{
+			state[0] = generic_crc32c(state[0], src + (i * 16), 8);
+			state[1] = generic_crc32c(state[1], src + (i * 16) + 8, 8);
+		}
+		src += src_pitch;
+	}
+}
+
+uint32_t blit_hash_rect(char *src, unsigned int src_pitch,
+			unsigned int width, unsigned int height)
+{
+	uint32_t state[2] = { 0xffffffff, 0xffffffff };
+	const unsigned int body = width - (width % 16);
+	uint32_t hash = 2166136261U;
+	unsigned int i;
+
+#ifdef BLIT_X86
+	if (blit_cpu_flags() & BLIT_CPU_SSE42)
+		x86_sse42_crc32c(state, src, src_pitch, body / 16, height);
+	else
+#endif
+		generic_hash(state, src, src_pitch, body / 16, height);
+
+	/* ragged right edge goes into the first chain */
+	if (body < width) {
+		for (i = 0; i < height; ++i)
+		{
+			state[0] = generic_crc32c(state[0], src + body, width - body);
+			src += src_pitch;
+		}
+	}
+
+	/* fnv-1a over the chains */
+	for (i = 0; i < 2; ++i)
+	{
+		hash = (hash ^ state[i]) * 16777619U;
+	}
+	return hash;
+}
+
+/* same math as x86_sse2_blend_over, one pixel at a time */
+static void generic_blend_over(char *dest, char *src, unsigned int pixels)
+{
+	unsigned int i, c;
+	for (i = 0; i < pixels; ++i)
+	{
+		uint8_t *d = (uint8_t *)dest + (i * 4);
+		uint8_t *s = (uint8_t *)src + (i * 4);
+		const uint32_t ia = 255 - s[3];
+		for (c = 0; c < 4; ++c)
+		{
+			uint32_t t = (d[c] * ia) + 128;
+			t = ((t + (t >> 8)) >> 8) + s[c];
+			d[c] = (t > 255) ? 255 : t;
+		}
+	}
+}
+
+void blit_blend_rect(char *dest, char *src,
+		     unsigned int dest_pitch, unsigned int src_pitch,
+		     unsigned int width, unsigned int height)
+{
+	unsigned int body = 0;
+
+	while (height--)
+	{
+#ifdef BLIT_X86
+		if (blit_cpu_flags() & BLIT_CPU_SSE2) {
+			body = width - (width % 4);
+			if (body)
+				x86_sse2_blend_over(dest, src, body / 4);
+		}
+#endif
+		if (body < width)
+			generic_blend_over(dest + (body * 4), src + (body * 4),
+					   width - body);
+		dest += dest_pitch;
+		src  += src_pitch;
+	}
+}
+
+/* same math as x86_sse2_rgb565_xrgb */
+static void generic_rgb565(char *dest, char *src, unsigned int pixels)
+{
+	uint32_t *d = (uint32_t *)dest;
+	uint16_t *s = (uint16_t *)src;
+	unsigned int i;
+	for (i = 0; i < pixels; ++i)
+	{
+		const uint32_t r = (s[i] >> 11) & 0x1f;
+		const uint32_t g = (s[i] >> 5)  & 0x3f;
+		const uint32_t b =  s[i]        & 0x1f;
+		d[i] = 0xff000000 | (((r << 3) | (r >> 2)) << 16)
+				  | (((g << 2) | (g >> 4)) << 8)
+				  |  ((b << 3) | (b >> 2));
+	}
+}
+
+/* no gather before avx2, and even there a table lookup is as fast */
+static void generic_index8(char *dest, char *src, uint32_t *palette,
+			   unsigned int pixels)
+{
+	uint32_t *d = (uint32_t *)dest;
+	uint8_t *s = (uint8_t *)src;
+	unsigned int i;
+	for (i = 0; i < pixels; ++i)
+	{
+		d[i] = palette[s[i]];
+	}
+}
+
+void blit_convert_rect(char *dest, char *src,
+		       unsigned int dest_pitch, unsigned int src_pitch,
+		       unsigned int width, unsigned int height,
+		       uint16_t format, uint32_t *palette)
+{
+	unsigned int row;
+
+	if (format == SPR16_FORMAT_INDEX8) {
+		for (row = 0; row < height; ++row)
+		{
+			generic_index8(dest + (row * dest_pitch),
+				       src + (row * src_pitch), palette, width);
+		}
+		return;
+	}
+#ifdef BLIT_X86
+	/*
+	 * plain stores until dest is on a line, the stream stores only write
+	 * whole lines of 16 pixels. rows are grouped by phase like blit_rect so
+	 * the kernel fences once per phase, not once per row
+	 */
+	if ((blit_cpu_flags() & BLIT_CPU_SSE2) && width >= 16) {
+		const uintptr_t mask = BLIT_LINE - 1;
+		const unsigned int low = (dest_pitch | BLIT_LINE)
+				       & (~(dest_pitch | BLIT_LINE) + 1);
+		const unsigned int period = BLIT_LINE / low;
+		unsigned int phase;
+
+		for (phase = 0; phase < period && phase < height; ++phase)
+		{
+			char *d = dest + (phase * dest_pitch);
+			char *s = src  + (phase * src_pitch);
+			const unsigned int rows = ((height - phase) + period - 1) / period;
+			unsigned int head = ((BLIT_LINE - ((uintptr_t)d & mask)) & mask) / 4;
+			unsigned int body;
+
+			if (head > width)
+				head = width;
+			body = (width - head) - ((width - head) % 16);
+			if (body)
+				x86_sse2_rgb565_xrgb(d + (head * 4), s + (head * 2),
+						     dest_pitch * period,
+						     src_pitch * period, body / 8, rows);
+			for (row = 0; row < rows; ++row)
+			{
+				char *rd = d + (row * period * dest_pitch);
+				char *rs = s + (row * period * src_pitch);
+				if (head)
+					generic_rgb565(rd, rs, head);
+				if (head + body < width)
+					generic_rgb565(rd + ((head + body) * 4),
+						       rs + ((head + body) * 2),
+						       width - head - body);
+			}
+		}
+		return;
+	}
+#endif
+	for (row = 0; row < height; ++row)
+	{
+		generic_rgb565(dest + (row * dest_pitch), src + (row * src_pitch),
+			       width);
+	}
+}
+
+/* same math as x86_sse2_yuv_xrgb */
+static uint8_t yuv_clamp(int32_t c)
+{
+	if (c > 32767)
+		c = 32767;
+	else if (c < -32768)
+		c = -32768;
+	c >>= 6;
+	return (c < 0) ? 0 : ((c > 255) ? 255 : c);
+}
+
+/* cb and cr are indexed by chroma column times step */
+static void generic_yuv(char *dest, uint8_t *luma, uint8_t *cb, uint8_t *cr,
+			unsigned int step, unsigned int x, unsigned int pixels)
+{
+	uint32_t *d = (uint32_t *)dest;
+	unsigned int i;
+	for (i = 0; i < pixels; ++i)
+	{
+		const unsigned int c = ((x + i) / 2) * step;
+		const int32_t y = ((luma[i] - 16) * 75) + 32;
+		const int32_t u = cb[c] - 128;
+		const int32_t v = cr[c] - 128;
+		d[i] = 0xff000000 | (yuv_clamp(y + (102 * v)) << 16)
+				  | (yuv_clamp(y - (25 * u) - (52 * v)) << 8)
+				  |  yuv_clamp(y + (129 * u));
+	}
+}
+
+void blit_convert_yuv_rect(char *dest, unsigned int dest_pitch,
+			   char *luma, unsigned int luma_stride,
+			   char *cb, char *cr, unsigned int chroma_stride,
+			   unsigned int x, unsigned int y,
+			   unsigned int width, unsigned int height)
+{
+	const unsigned int step = cr ? 1 : 2;
+	unsigned int row;
+
+	for (row = 0; row < height; ++row)
+	{
+		uint8_t *l = (uint8_t *)luma + ((y + row) * luma_stride) + x;
+		uint8_t *u = (uint8_t *)cb + (((y + row) / 2) * chroma_stride);
+		uint8_t *v = cr ? (uint8_t *)cr + (((y + row) / 2) * chroma_stride)
+				: u + 1;
+		char *d = dest + (row * dest_pitch);
+		unsigned int px = x;
+		unsigned int left = width;
+
+		/* kernel starts on a pixel pair */
+		if ((px & 1) && left) {
+			generic_yuv(d, l, u, v, step, px, 1);
+			++px;
+			++l;
+			d += 4;
+			--left;
+		}
+#ifdef BLIT_X86
+		if ((blit_cpu_flags() & BLIT_CPU_SSE2) && left >= 8) {
+			const unsigned int count = left - (left % 8);
+			if (cr)
+				x86_sse2_yuv420_xrgb(d, (char *)l, (char *)u + (px / 2),
+						     (char *)v + (px / 2), count / 8);
+			else
+				x86_sse2_yuv_xrgb(d, (char *)l, (char *)u + px, count / 8);
+			px   += count;
+			l    += count;
+			d    += count * 4;
+			left -= count;
+		}
+#endif
+		if (left)
+			generic_yuv(d, l, u, v, step, px, left);
+	}
+}
+
+/* runs of scale copies of each source pixel, x is in scaled pixels.
+ * out needs 8 pixels of slack */
+static void scale_nearest_row(uint32_t *out, uint32_t *src, unsigned int scale,
+			      unsigned int x, unsigned int width)
+{
+	unsigned int i = 0;
+#ifdef BLIT_X86
+	if (blit_cpu_flags() & BLIT_CPU_SSE2) {
+		unsigned int count;
+		/* kernels start on a run */
+		while (i < width && (x + i) % scale)
+		{
+			out[i] = src[(x + i) / scale];
+			++i;
+		}
+		count = (width - i) / scale;
+		if (scale == 2 && count >= 4) {
+			count -= count % 4;
+			x86_sse2_scale2_xrgb((char *)(out + i),
+					     (char *)(src + ((x + i) / 2)), count / 4);
+		}
+		else if (count) {
+			x86_sse2_splat_xrgb((char *)(out + i),
+					    (char *)(src + ((x + i) / scale)),
+					    scale * 4, count);
+		}
+		i += count * scale;
+	}
+#endif
+	while (i < width)
+	{
+		const uint32_t pixel = src[(x + i) / scale];
+		unsigned int run = scale - ((x + i) % scale);
+		while (run-- && i < width)
+		{
+			out[i++] = pixel;
+		}
+	}
+}
+
+/* same math as x86_sse2_lerp_xrgb, red and blue then alpha and green */
+static uint32_t lerp_pixel(uint32_t a, uint32_t b, uint32_t weight)
+{
+	const uint32_t inv = 256 - weight;
+	const uint32_t rb = ((a & 0x00ff00ff) * inv) + ((b & 0x00ff00ff) * weight);
+	const uint32_t ag = (((a >> 8) & 0x00ff00ff) * inv)
+			  + (((b >> 8) & 0x00ff00ff) * weight);
+	return ((rb >> 8) & 0x00ff00ff) | (ag & 0xff00ff00);
+}
+
+static void lerp_row(uint32_t *out, uint32_t *a, uint32_t *b,
+		     uint32_t weight, unsigned int pixels)
+{
+	unsigned int i = 0;
+#ifdef BLIT_X86
+	if (blit_cpu_flags() & BLIT_CPU_SSE2) {
+		i = pixels - (pixels % 4);
+		if (i)
+			x86_sse2_lerp_xrgb((char *)out, (char *)a, (char *)b,
+					   weight, i / 4);
+	}
+#endif
+	for (; i < pixels; ++i)
+	{
+		out[i] = lerp_pixel(a[i], b[i], weight);
+	}
+}
+
+/* source position of scaled pixel i in 8 bit fixed point, pixel centers
+ * line up and the edges clamp */
+static uint32_t scale_pos(unsigned int i, unsigned int scale, unsigned int len)
+{
+	const int32_t pos = (int32_t)((((2 * i) + 1) * 128) / scale) - 128;
+	if (pos < 0)
+		return 0;
+	if (pos > (int32_t)((len - 1) * 256))
+		return (len - 1) * 256;
+	return pos;
+}
+
+static uint32_t bilinear_pixel(uint32_t *src, unsigned int i,
+			       unsigned int scale, unsigned int len)
+{
+	const uint32_t pos = scale_pos(i, scale, len);
+	if (pos & 255)
+		return lerp_pixel(src[pos >> 8], src[(pos >> 8) + 1], pos & 255);
+	return src[pos >> 8];
+}
+
+/*
+ * horizontal pass of one source row. away from the edges scaled pixel
+ * j * scale + k always sits at the same fraction between source pixels j - 1
+ * + (k's offset) and the next, so each phase k is one constant weight lerp
+ * over the row, then the phases are interleaved. tmp holds width pixels
+ */
+static void bilinear_row(uint32_t *out, uint32_t *src, unsigned int src_width,
+			 unsigned int scale, unsigned int x, unsigned int width,
+			 uint32_t *tmp)
+{
+	/* blocks of scale pixels that need no clamping, source 1 to width-2 */
+	unsigned int first = (x + scale - 1) / scale;
+	unsigned int end = (x + width) / scale;
+	unsigned int i, k;
+
+	if (first < 1)
+		first = 1;
+	if (end > src_width - 1)
+		end = src_width - 1;
+	if (end <= first || scale == 1) {
+		for (i = 0; i < width; ++i)
+		{
+			out[i] = bilinear_pixel(src, x + i, scale, src_width);
+		}
+		return;
+	}
+
+	for (i = 0; i < (first * scale) - x; ++i)
+	{
+		out[i] = bilinear_pixel(src, x + i, scale, src_width);
+	}
+	for (k = 0; k < scale; ++k)
+	{
+		/* fraction of the first block, can be behind it */
+		const int32_t pos = (int32_t)((((2 * k) + 1) * 128) / scale) - 128;
+		uint32_t *a = src + first + ((pos < 0) ? -1 : 0);
+		uint32_t *phase = tmp + (k * (end - first));
+		lerp_row(phase, a, a + 1, (pos < 0) ? pos + 256 : pos, end - first);
+	}
+#ifdef BLIT_X86
+	if (scale == 2 && (blit_cpu_flags() & BLIT_CPU_SSE2)) {
+		const unsigned int count = (end - first) - ((end - first) % 4);
+		x86_sse2_zip_xrgb((char *)(out + i), (char *)tmp,
+				  (char *)(tmp + (end - first)), count / 4);
+		for (k = count; k < end - first; ++k)
+		{
+			out[i + (k * 2)]     = tmp[k];
+			out[i + (k * 2) + 1] = tmp[(end - first) + k];
+		}
+	}
+	else
+#endif
+	{
+		for (k = 0; k < scale; ++k)
+		{
+			uint32_t *phase = tmp + (k * (end - first));
+			uint32_t *dst = out + i + k;
+			unsigned int j;
+			for (j = 0; j < end - first; ++j)
+			{
+				dst[j * scale] = phase[j];
+			}
+		}
+	}
+	for (i = (end * scale) - x; i < width; ++i)
+	{
+		out[i] = bilinear_pixel(src, x + i, scale, src_width);
+	}
+}
+
+void blit_scale_rect(struct blit_kernel *kernel, char *dest, unsigned int dest_pitch,
+		     char *src, unsigned int src_pitch,
+		     unsigned int src_width, unsigned int src_height,
+		     unsigned int scale, unsigned int filter,
+		     unsigned int x, unsigned int y,
+		     unsigned int width, unsigned int height, char *scratch)
+{
+	uint32_t *out = (uint32_t *)scratch;
+	uint32_t *rows[2];
+	uint32_t cached[2] = { 0xffffffff, 0xffffffff };
+	unsigned int row;
+
+	if (!width || !height || !scale)
+		return;
+
+	if (filter != SPR16_FILTER_BILINEAR) {
+		/* every source row is written scale times from one expanded row */
+		for (row = 0; row < height; )
+		{
+			unsigned int count = scale - ((y + row) % scale);
+			if (count > height - row)
+				count = height - row;
+			scale_nearest_row(out, (uint32_t *)(src + (((y + row) / scale)
+							* src_pitch)), scale, x, width);
+			blit_rect(kernel, dest + (row * dest_pitch), (char *)out,
+				  dest_pitch, 0, width * 4, count);
+			row += count;
+		}
+		return;
+	}
+
+	/* source rows are expanded once, output rows blend the 2 they sit
+	 * between. out, 2 expanded rows, then tmp for bilinear_row */
+	rows[0] = out + width;
+	rows[1] = rows[0] + width;
+	for (row = 0; row < height; ++row)
+	{
+		const uint32_t v = scale_pos(y + row, scale, src_height);
+		const unsigned int used = (v & 255) ? 2 : 1;
+		uint32_t need[2];
+		unsigned int n, slot;
+		need[0] = v >> 8;
+		need[1] = need[0] + 1;
+		for (n = 0; n < used; ++n)
+		{
+			if (cached[0] == need[n] || cached[1] == need[n])
+				continue;
+			/* keep the other row this output needs */
+			slot = (used == 2 && cached[0] == need[!n]) ? 1 : 0;
+			bilinear_row(rows[slot], (uint32_t *)(src + (need[n] * src_pitch)),
+				     src_width, scale, x, width, rows[1] + width);
+			cached[slot] = need[n];
+		}
+		slot = (cached[0] == need[0]) ? 0 : 1;
+		if (v & 255) {
+			lerp_row(out, rows[slot], rows[!slot], v & 255, width);
+			blit_rect(kernel, dest + (row * dest_pitch), (char *)out,
+				  dest_pitch, 0, width * 4, 1);
+		}
+		else {
+			blit_rect(kernel, dest + (row * dest_pitch), (char *)rows[slot],
+				  dest_pitch, 0, width * 4, 1);
+		}
+	}
+}
@@ -0,0 +1,108 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * copy kernel registry, the cpu is probed once and the fastest kernel it
+ * supports is picked. kernels are listed fastest first, SPR16_BLIT_KERNEL=<name>
+ * can force one for A/B testing. blit_rect handles any width, pitch, or
+ * destination alignment. non-temporal stores only ever fill whole cache lines,
+ * a line that is partly written with plain stores as well gets read back and
+ * flushed twice, so row edges are plain stores and rows too short to hold a
+ * whole line aligned unit go to erms or memcpy, as do copies smaller than
+ * BLIT_NT_MIN_BYTES.
+ */
+
+#ifndef BLIT_H__
+#define BLIT_H__
+
+#include <stdint.h>
+
+#define BLIT_CPU_SSE2   0x0001
+#define BLIT_CPU_AVX2   0x0002
+#define BLIT_CPU_AVX512 0x0004
+#define BLIT_CPU_ERMS   0x0008
+#define BLIT_CPU_SSE42  0x0010
+
+#define BLIT_LINE 64 /* cache line, non-temporal units are a multiple of it */
+/* smaller copies use plain stores, the data is cheap to keep in cache and
+ * the fence after the stream stores costs more than the copy */
+#ifndef BLIT_NT_MIN_BYTES
+	#define BLIT_NT_MIN_BYTES (64 * 1024)
+#endif
+
+/* copies count * unit bytes */
+typedef void (*blit_row_fn)(char *dest, char *src, unsigned int count);
+/* copies height rows of count * unit bytes, all rows in one call */
+typedef void (*blit_rect_fn)(char *dest, char *src,
+			     unsigned int dest_pitch, unsigned int src_pitch,
+			     unsigned int count, unsigned int height);
+
+struct blit_kernel {
+	char name[16];
+	blit_row_fn row;
+	blit_rect_fn rect;
+	uint32_t unit;      /* bytes per count */
+	uint32_t align;     /* store width of the body, 1 for plain stores */
+	uint32_t cpu_flags; /* required BLIT_CPU_* flags */
+};
+
+uint32_t blit_cpu_flags();
+/* hides cpu flags not in mask, 0 runs everything through the plain C
+ * paths. for tests, the selected kernel is not changed */
+void blit_cpu_mask(uint32_t mask);
+/* force may be NULL */
+int blit_kernel_select(char *force);
+struct blit_kernel *blit_kernel_get();
+int blit_kernel_usable(struct blit_kernel *kernel);
+struct blit_kernel *blit_kernel_find(char *name);
+unsigned int blit_kernel_count();
+struct blit_kernel *blit_kernel_at(unsigned int idx);
+/* copies height rows of width bytes */
+void blit_rect(struct blit_kernel *kernel, char *dest, char *src,
+	       unsigned int dest_pitch, unsigned int src_pitch,
+	       unsigned int width, unsigned int height);
+/* premultiplied argb8888 src over dest, width is in pixels. dest is read
+ * so it should be normal cached memory, not scanout */
+void blit_blend_rect(char *dest, char *src,
+		     unsigned int dest_pitch, unsigned int src_pitch,
+		     unsigned int width, unsigned int height);
+/* expands a SPR16_FORMAT_* sprite to xrgb8888, width is in pixels. palette
+ * is only used for INDEX8. dest pitch and address must be 4 byte aligned */
+void blit_convert_rect(char *dest, char *src,
+		       unsigned int dest_pitch, unsigned int src_pitch,
+		       unsigned int width, unsigned int height,
+		       uint16_t format, uint32_t *palette);
+/* 4:2:0 planes to xrgb8888, bt.601 limited range. luma, cb and cr point at
+ * the plane origins and x, y is where the rect starts so chroma lines up.
+ * for nv12 cb is the interleaved plane and cr is NULL */
+void blit_convert_yuv_rect(char *dest, unsigned int dest_pitch,
+			   char *luma, unsigned int luma_stride,
+			   char *cb, char *cr, unsigned int chroma_stride,
+			   unsigned int x, unsigned int y,
+			   unsigned int width, unsigned int height);
+/* scales an xrgb8888 sprite up by a whole number, x, y, width and height
+ * select the part of the scaled image written to dest. SPR16_FILTER_BILINEAR
+ * lines up pixel centers and clamps at the edges. scratch holds
+ * 4 * width + 8 pixels */
+void blit_scale_rect(struct blit_kernel *kernel, char *dest, unsigned int dest_pitch,
+		     char *src, unsigned int src_pitch,
+		     unsigned int src_width, unsigned int src_height,
+		     unsigned int scale, unsigned int filter,
+		     unsigned int x, unsigned int y,
+		     unsigned int width, unsigned int height, char *scratch);
+/* content hash of height rows of width bytes, used to skip unchanged tiles */
+uint32_t blit_hash_rect(char *src, unsigned int src_pitch,
+			unsigned int width, unsigned int height);
+
+#endif
@@ -0,0 +1,183 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include "blitpool.h"
+
+struct blit_job {
+	struct blit_kernel *kernel;
+	char *dest;
+	char *src;
+	unsigned int dest_pitch;
+	unsigned int src_pitch;
+	unsigned int width;
+	unsigned int height;
+	unsigned int bands;
+	unsigned int next_band; /* next band to be claimed */
+	unsigned int done;      /* bands written */
+};
+
+static pthread_t g_threads[BLIT_POOL_MAX_THREADS];
+static unsigned int g_thread_count;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_done_cond = PTHREAD_COND_INITIALIZER;
+static struct blit_job g_job;
+static unsigned int g_generation;
+static int g_quit;
+
+/* call with g_lock held, drops it while copying */
+static void copy_bands()
+{
+	while (g_job.next_band < g_job.bands)
+	{
+		const unsigned int band = g_job.next_band++;
+		const unsigned int rows = g_job.height / g_job.bands;
+		const unsigned int extra = g_job.height % g_job.bands;
+		/* first 'extra' bands get one more row */
+		const unsigned int y = (band * rows) + (band < extra ? band : extra);
+		const unsigned int h = rows + (band < extra ? 1 : 0);
+		struct blit_job job = g_job;
+
+		pthread_mutex_unlock(&g_lock);
+		blit_rect(job.kernel, job.dest + (y * job.dest_pitch),
+			  job.src  + (y * job.src_pitch),
+			  job.dest_pitch, job.src_pitch, job.width, h);
+		pthread_mutex_lock(&g_lock);
+
+		if (++g_job.done == g_job.bands)
+			pthread_cond_signal(&g_done_cond);
+	}
+}
+
+static void *blit_thread(void *v)
+{
+	unsigned int generation = 0;
+	sigset_t sigs;
+	(void)v;
+
+	/* vt switching and shutdown signals belong to the main thread */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	pthread_mutex_lock(&g_lock);
+	while (1)
+	{
+		while (!g_quit && generation == g_generation)
+		{
+			pthread_cond_wait(&g_work_cond, &g_lock);
+		}
+		if (g_quit)
+			break;
+		generation = g_generation;
+		copy_bands();
+	}
+	pthread_mutex_unlock(&g_lock);
+	return NULL;
+}
+
+int blit_pool_create(int threads)
+{
+	int i;
+
+	if (threads < 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cpus > 1) ? cpus - 1 : 0;
+	}
+	if (threads > BLIT_POOL_MAX_THREADS)
+		threads = BLIT_POOL_MAX_THREADS;
+
+	g_quit = 0;
+	g_thread_count = 0;
+	for (i = 0; i < threads; ++i)
+	{
+		int r = pthread_create(&g_threads[i], NULL, blit_thread, NULL);
+		if (r) {
+			printf("pthread_create: %s\n", strerror(r));
+			blit_pool_destroy();
+			return -1;
+		}
+		++g_thread_count;
+	}
+	printf("blit threads: %d\n", g_thread_count);
+	return 0;
+}
+
+void blit_pool_destroy()
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&g_lock);
+	g_quit = 1;
+	pthread_cond_broadcast(&g_work_cond);
+	pthread_mutex_unlock(&g_lock);
+	for (i = 0; i < g_thread_count; ++i)
+	{
+		pthread_join(g_threads[i], NULL);
+	}
+	g_thread_count = 0;
+}
+
+unsigned int blit_pool_threads()
+{
+	return g_thread_count;
+}
+
+void blit_pool_rect(struct blit_kernel *kernel, char *dest, char *src,
+		    unsigned int dest_pitch, unsigned int src_pitch,
+		    unsigned int width, unsigned int height)
+{
+	const unsigned int bytes = width * height;
+	unsigned int bands;
+
+	if (g_thread_count == 0 || bytes < BLIT_POOL_MIN_BYTES) {
+		blit_rect(kernel, dest, src, dest_pitch, src_pitch, width, height);
+		return;
+	}
+
+	bands = bytes / BLIT_POOL_MIN_BAND;
+	if (bands > g_thread_count + 1)
+		bands = g_thread_count + 1;
+	if (bands > height)
+		bands = height;
+
+	pthread_mutex_lock(&g_lock);
+	g_job.kernel     = kernel;
+	g_job.dest       = dest;
+	g_job.src        = src;
+	g_job.dest_pitch = dest_pitch;
+	g_job.src_pitch  = src_pitch;
+	g_job.width      = width;
+	g_job.height     = height;
+	g_job.bands      = bands;
+	g_job.next_band  = 0;
+	g_job.done       = 0;
+	++g_generation;
+	pthread_cond_broadcast(&g_work_cond);
+
+	copy_bands();
+	while (g_job.done < g_job.bands)
+	{
+		pthread_cond_wait(&g_done_cond, &g_lock);
+	}
+	pthread_mutex_unlock(&g_lock);
+}
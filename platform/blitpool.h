@@ -0,0 +1,44 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * fixed pool of copy threads for large damage rects. the rect is split into
+ * row bands, the calling thread takes a band too and returns only after every
+ * band has been written, so callers can ack the client right after.
+ * rects smaller than BLIT_POOL_MIN_BYTES are copied inline, waking threads
+ * costs more than the copy.
+ */
+
+#ifndef BLITPOOL_H__
+#define BLITPOOL_H__
+
+#include "blit.h"
+
+#define BLIT_POOL_MAX_THREADS 16
+#ifndef BLIT_POOL_MIN_BYTES
+	#define BLIT_POOL_MIN_BYTES (256 * 1024)
+#endif
+/* don't split into bands smaller than this */
+#define BLIT_POOL_MIN_BAND  (64 * 1024)
+
+/* threads is in addition to the caller, -1 picks one per online cpu - 1 */
+int  blit_pool_create(int threads);
+void blit_pool_destroy();
+unsigned int blit_pool_threads();
+/* width is in bytes, see blit_rect */
+void blit_pool_rect(struct blit_kernel *kernel, char *dest, char *src,
+		    unsigned int dest_pitch, unsigned int src_pitch,
+		    unsigned int width, unsigned int height);
+
+#endif
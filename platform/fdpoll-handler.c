@@ -186,6 +186,27 @@ int fdpoll_handler_remove(struct fdpoll_handler *self, int fd)
 	return 0;
 }
 
+/* change the events an fd is polled for, e.g. FDPOLLOUT while output is backed up */
+int fdpoll_handler_modify(struct fdpoll_handler *self, int fd, uint32_t fdpoll_flags)
+{
+	struct epoll_event ev;
+	struct fdpoll_node *node;
+
+	node = fdpoll_handler_find_node(self, fd);
+	if (node == NULL) {
+		errno = ESRCH;
+		return -1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = fdpoll_flags;
+	ev.data.ptr = node;
+	if (epoll_ctl(self->fdpoll_fd, EPOLL_CTL_MOD, fd, &ev)) {
+		fprintf(stderr, "epoll_ctl(mod): %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
 int fdpoll_handler_poll(struct fdpoll_handler *self, int timeout)
 {
 	struct epoll_event events[MAX_FDPOLL_HANDLER];
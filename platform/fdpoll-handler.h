@@ -66,6 +66,7 @@ struct fdpoll_handler *fdpoll_handler_create(unsigned int max, int cloexec);
 int fdpoll_handler_add(struct fdpoll_handler *self, int fd, uint32_t poll_flags,
 			fdpoll_handler_cb cb, void *user_data);
 int fdpoll_handler_remove(struct fdpoll_handler *self, int fd);
+int fdpoll_handler_modify(struct fdpoll_handler *self, int fd, uint32_t poll_flags);
 int fdpoll_handler_poll(struct fdpoll_handler *self, int timeout);
 
 /*  example callback
@@ -32,6 +32,7 @@
 input_handler g_input_func;
 input_surface_handler g_input_surface_func;
 servinfo_handler g_servinfo_func;
+present_handler g_present_func;
 
 /* TODO we probably want a client context */
 struct spr16 g_sprite;
@@ -43,6 +44,8 @@ struct epoll_event g_events[MAX_EPOLL];
 struct epoll_event g_ev;
 int g_epoll_fd;
 int g_handshaking;
+struct spr16_msgring *g_msgring; /* NULL if the server did not grant one */
+struct spr16_rxbuf *g_rxbuf;
 
 struct spr16_msgdata_servinfo *spr16_client_get_servinfo()
 {
@@ -58,10 +61,13 @@ int spr16_client_init()
 	g_input_func = NULL;
 	g_input_surface_func = NULL;
 	g_servinfo_func = NULL;
+	g_present_func = NULL;
 	g_epoll_fd = -1;
 	g_socket = -1;
 	g_handshaking = 1;
 	g_wait_vsync = 0;
+	g_msgring = NULL;
+	g_rxbuf = NULL;
 	memset(&g_servinfo, 0, sizeof(g_servinfo));
 	memset(&g_sprite, 0, sizeof(g_sprite));
 
@@ -96,9 +102,16 @@ int spr16_client_connect(char *name)
 		return -1;
 	}
 
+	g_rxbuf = spr16_rxbuf_create();
+	if (g_rxbuf == NULL) {
+		close(g_socket);
+		return -1;
+	}
 	g_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
 	if (g_epoll_fd == -1) {
 		fprintf(stderr, "epoll_create1: %s\n", STRERR);
+		spr16_rxbuf_destroy(g_rxbuf);
+		g_rxbuf = NULL;
 		close(g_socket);
 		return -1;
 	}
@@ -112,6 +125,8 @@ int spr16_client_connect(char *name)
 	}
 	return g_socket;
 failure:
+	spr16_rxbuf_destroy(g_rxbuf);
+	g_rxbuf = NULL;
 	close(g_epoll_fd);
 	close(g_socket);
 	return -1;
@@ -121,22 +136,37 @@ int spr16_client_handshake_start(char *name, uint16_t width, uint16_t height, ui
 {
 	struct spr16_msghdr hdr;
 	struct spr16_msgdata_register_sprite data;
-	uint16_t bpp = 32;
+	uint16_t bpp = spr16_format_bpp(g_sprite.format);
+	char *estr;
 	memset(&hdr, 0, sizeof(hdr));
 	memset(&data, 0, sizeof(data));
 
 	/* send register */
-	if (width > g_servinfo.width || height > g_servinfo.height) {
+	if (SPR16_SCALED(&g_sprite, width) > g_servinfo.width
+			|| SPR16_SCALED(&g_sprite, height) > g_servinfo.height) {
 		fprintf(stderr, "sprite size(%d, %d) -- server max(%d, %d)\n",
-				width,height,g_servinfo.width,g_servinfo.height);
+				SPR16_SCALED(&g_sprite, width),
+				SPR16_SCALED(&g_sprite, height),
+				g_servinfo.width,g_servinfo.height);
 		return -1;
 	}
 	hdr.type = SPRITEMSG_REGISTER_SPRITE;
 	data.flags = flags;
+	data.x = g_sprite.x;
+	data.y = g_sprite.y;
+	data.z = g_sprite.z;
 	data.width = width;
 	data.height = height;
 	data.bpp = bpp;
+	data.format = g_sprite.format;
+	data.scale = g_sprite.scale;
+	data.filter = g_sprite.filter;
 	snprintf(data.name, SPR16_MAXNAME, "%s", name);
+	hdr.bits = SPRITEREG_FLAG_EXTENDED;
+	/* SPR16_MSG_RINGS=0 keeps everything on the socket */
+	estr = getenv("SPR16_MSG_RINGS");
+	if (estr == NULL || strcmp(estr, "0"))
+		hdr.bits |= SPRITEREG_FLAG_MSGRINGS;
 	if (spr16_write_msg(g_socket, &hdr, &data, sizeof(data))) {
 		return -1;
 	}
@@ -147,6 +177,35 @@ int spr16_client_handshake_start(char *name, uint16_t width, uint16_t height, ui
 	return 0;
 }
 
+int spr16_client_set_position(int16_t x, int16_t y, int16_t z)
+{
+	g_sprite.x = x;
+	g_sprite.y = y;
+	g_sprite.z = z;
+	return 0;
+}
+
+int spr16_client_set_format(uint16_t format)
+{
+	if (!spr16_format_bpp(format)) {
+		errno = EINVAL;
+		return -1;
+	}
+	g_sprite.format = format;
+	return 0;
+}
+
+int spr16_client_set_scale(uint8_t scale, uint8_t filter)
+{
+	if (!scale || scale > SPR16_SCALE_MAX || filter > SPR16_FILTER_BILINEAR) {
+		errno = EINVAL;
+		return -1;
+	}
+	g_sprite.scale = scale;
+	g_sprite.filter = filter;
+	return 0;
+}
+
 int spr16_client_servinfo(struct spr16_msgdata_servinfo *sinfo)
 {
 	/* this info is static, msg is expected only once */
@@ -166,11 +225,19 @@ int spr16_client_waiting_for_vsync()
 	return g_wait_vsync;
 }
 
+int spr16_client_present(struct spr16_msgdata_present *msg)
+{
+	g_wait_vsync = 0;
+	if (!g_present_func)
+		return 0;
+	return g_present_func(msg);
+}
+
 /* it is assumed for now to be a full screen memory region */
 int spr16_open_shmem(int fd)
 {
 	char *addr;
-	size_t size = (g_sprite.bpp/8) * g_sprite.width * g_sprite.height;
+	size_t size = spr16_sprite_size(g_sprite.format, g_sprite.width, g_sprite.height);
 	addr = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
 	if (addr == MAP_FAILED || addr == NULL) {
 		printf("mmap error: %s\n", strerror(errno));
@@ -182,19 +249,45 @@ int spr16_open_shmem(int fd)
 	return 0;
 }
 
+/* server sends rings with the sprite if we asked and it agreed */
+static int open_msgring(int *fds)
+{
+	struct epoll_event ev;
+
+	g_msgring = spr16_msgring_open(fds);
+	if (g_msgring == NULL)
+		return -1;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = spr16_msgring_bell(g_msgring);
+	if (epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev)) {
+		fprintf(stderr, "epoll_ctl(add): %s\n", STRERR);
+		goto failure;
+	}
+	if (spr16_msgring_attach(g_socket, g_msgring))
+		goto failure;
+	return 0;
+failure:
+	spr16_msgring_destroy(g_msgring);
+	g_msgring = NULL;
+	return -1;
+}
+
 static int recv_fd()
 {
 	char *msgbuf;
 	uint32_t msglen;
 	int r;
-	int fd = -1;
+	int fds[SPR16_MAXFDS];
+	unsigned int count = 0;
+	unsigned int i;
 	int c = 5000;
 
 	/* clear pending messages */
 	do {
-		msgbuf = spr16_read_msgs(g_socket, &msglen);
+		msgbuf = spr16_rxbuf_read(g_rxbuf, g_socket, &msglen);
 
-	} while(msgbuf || (msgbuf == NULL && errno == EINTR));
+	} while(msgbuf);
 
 	if (errno != EAGAIN) {
 		printf("problem clearing pending messages: %s\n", strerror(errno));
@@ -207,7 +300,7 @@ static int recv_fd()
 
 	while (--c > 0)
 	{
-		r = afunix_recv_fd(g_socket, &fd);
+		r = afunix_recv_fds(g_socket, fds, SPR16_MAXFDS, &count);
 		if (r == -1 && (errno == EINTR || errno == EAGAIN)) {
 			usleep(1000);
 			continue;
@@ -225,12 +318,29 @@ static int recv_fd()
 		spr16_send_nack(g_socket, SPRITENACK_FD);
 		return -1;
 	}
+	if (count != 1 && count != 1 + SPR16_MSGRING_FDS) {
+		for (i = 0; i < count; ++i)
+		{
+			close(fds[i]);
+		}
+		spr16_send_nack(g_socket, SPRITENACK_FD);
+		return -1;
+	}
 
-	if (spr16_open_shmem(fd)) {
+	if (spr16_open_shmem(fds[0])) {
 		fprintf(stderr, "open_shmem failed\n");
+		for (i = 1; i < count; ++i)
+		{
+			close(fds[i]);
+		}
 		spr16_send_nack(g_socket, SPRITENACK_SHMEM);
 		return -1;
 	}
+	/* server is already writing to the ring */
+	if (count > 1 && open_msgring(&fds[1])) {
+		fprintf(stderr, "open_msgring failed\n");
+		return -1;
+	}
 	if (spr16_send_ack(g_socket, SPRITEACK_ESTABLISHED))
 		return -1;
 	g_handshaking = 0;
@@ -248,6 +358,7 @@ static int handle_ack(struct spr16_msgdata_ack *ack)
 	case SPRITEACK_ESTABLISHED:
 		break;
 	case SPRITEACK_SYNC_VSYNC:
+	case SPRITEACK_SYNC_PAGEFLIP:
 		g_wait_vsync = 0;
 		break;
 	default:
@@ -276,6 +387,10 @@ static int handle_nack(struct spr16_msgdata_ack *nack)
 	case SPRITENACK_BPP:
 		fprintf(stderr, "nack: bad bpp\n");
 		break;
+	case SPRITENACK_SYNC:
+		fprintf(stderr, "nack: sync failed\n");
+		g_wait_vsync = 0;
+		break;
 	default:
 		fprintf(stderr, "unhandled nack: %d\n", nack->info);
 		errno = EPROTO;
@@ -311,7 +426,48 @@ int spr16_client_sync(uint16_t xmin, uint16_t ymin,
 	if (spr16_write_msg(g_socket, &hdr, &data, sizeof(data))) {
 		return -1;
 	}
-	if (flags & SPRITESYNC_FLAG_VBLANK)
+	if (flags & (SPRITESYNC_FLAG_VBLANK|SPRITESYNC_FLAG_PAGE_FLIP))
+		g_wait_vsync = 1;
+	return 0;
+}
+
+/* a few full messages, longer lists take one write per buffer */
+static char g_syncbuf[SPR16_MAXVARMSGLEN * 4];
+int spr16_client_sync_rects(struct spr16_msgdata_sync *rects, uint32_t count,
+			    uint16_t flags)
+{
+	uint32_t pos = 0;
+	if (g_handshaking) {
+		return 0;
+	}
+	if (!count || (flags & ~SPRITESYNC_FLAG_MASK)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (count)
+	{
+		struct spr16_msghdr hdr;
+		uint32_t n = (count > SPR16_MAXSYNCRECTS) ? SPR16_MAXSYNCRECTS : count;
+		uint32_t len = n * sizeof(struct spr16_msgdata_sync);
+
+		if (pos + sizeof(hdr) + len > sizeof(g_syncbuf)) {
+			if (spr16_write_msgs(g_socket, g_syncbuf, pos))
+				return -1;
+			pos = 0;
+		}
+		/* only the last one syncs, the rest are just damage */
+		hdr.type = SPRITEMSG_SYNC_RECTS;
+		hdr.bits = SPRITESYNC_RECTS_BITS((count == n) ? flags : 0, n);
+		memcpy(&g_syncbuf[pos], &hdr, sizeof(hdr));
+		memcpy(&g_syncbuf[pos + sizeof(hdr)], rects, len);
+		pos   += sizeof(hdr) + len;
+		rects += n;
+		count -= n;
+	}
+	if (spr16_write_msgs(g_socket, g_syncbuf, pos))
+		return -1;
+	if (flags & (SPRITESYNC_FLAG_VBLANK|SPRITESYNC_FLAG_PAGE_FLIP))
 		g_wait_vsync = 1;
 	return 0;
 }
@@ -337,6 +493,13 @@ int spr16_client_shutdown()
 {
 	memset(&g_servinfo, 0, sizeof(g_servinfo));
 	memset(&g_sprite, 0, sizeof(g_sprite));
+	if (g_msgring) {
+		spr16_msgring_detach(g_socket);
+		spr16_msgring_destroy(g_msgring);
+		g_msgring = NULL;
+	}
+	spr16_rxbuf_destroy(g_rxbuf);
+	g_rxbuf = NULL;
 	close(g_epoll_fd);
 	close(g_socket);
 	g_socket = -1;
@@ -392,6 +555,12 @@ int spr16_client_set_servinfo_handler(servinfo_handler func)
 	return 0;
 }
 
+int spr16_client_set_present_handler(present_handler func)
+{
+	g_present_func = func;
+	return 0;
+}
+
 int spr16_dispatch_client_msgs(char *msgbuf, uint32_t buflen)
 {
 	struct spr16_msghdr *msghdr;
@@ -406,7 +575,7 @@ int spr16_dispatch_client_msgs(char *msgbuf, uint32_t buflen)
 		msghdr  = (struct spr16_msghdr *)msgpos;
 		msgdata = msgpos+sizeof(struct spr16_msghdr);
 		typelen = get_msghdr_typelen(msghdr);
-		if (typelen > SPR16_MAXMSGLEN - sizeof(struct spr16_msghdr)
+		if (typelen > SPR16_MAXVARMSGLEN - sizeof(struct spr16_msghdr)
 				|| msgdata+typelen > msgbuf+buflen) {
 			errno = EPROTO;
 			return -1;
@@ -440,6 +609,13 @@ int spr16_dispatch_client_msgs(char *msgbuf, uint32_t buflen)
 				return -1;
 			}
 			break;
+		case SPRITEMSG_PRESENT:
+			if (spr16_client_present(
+					(struct spr16_msgdata_present *)msgdata)) {
+				fprintf(stderr, "present failed\n");
+				return -1;
+			}
+			break;
 		default:
 			errno = EPROTO;
 			return -1;
@@ -450,6 +626,26 @@ int spr16_dispatch_client_msgs(char *msgbuf, uint32_t buflen)
 	return 0;
 }
 
+static int read_msgring()
+{
+	char msgbuf[SPR16_MAXVARMSGLEN * 2];
+	int msglen;
+
+	spr16_msgring_wake(g_msgring);
+	while ((msglen = spr16_msgring_read(g_msgring, msgbuf, sizeof(msgbuf))) > 0)
+	{
+		if (spr16_dispatch_client_msgs(msgbuf, msglen)) {
+			fprintf(stderr, "dispatch_client_msgs: %s\n", STRERR);
+			return -1;
+		}
+	}
+	if (msglen == -1) {
+		fprintf(stderr, "msgring_read: %s\n", STRERR);
+		return -1;
+	}
+	return 0;
+}
+
 int spr16_client_update(const int poll_timeout)
 {
 	int i;
@@ -472,7 +668,9 @@ interrupted:
 	{
 		/* TODO use fdpoll */
 		if (g_events[i].data.fd == g_socket) {
-			msgbuf = spr16_read_msgs(g_socket, &msglen);
+			msgbuf = spr16_rxbuf_read(g_rxbuf, g_socket, &msglen);
+			if (msgbuf == NULL && errno == EAGAIN)
+				continue;
 			if (msgbuf == NULL) {
 				fprintf(stderr, "read_msgs: %s\n", STRERR);
 				return -1;
@@ -482,6 +680,10 @@ interrupted:
 				return -1;
 			}
 		}
+		else if (g_msgring && g_events[i].data.fd == spr16_msgring_bell(g_msgring)) {
+			if (read_msgring())
+				return -1;
+		}
 		else {
 			fprintf(stderr, "badf\n");
 			errno = EBADF;
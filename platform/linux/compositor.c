@@ -0,0 +1,518 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include "../spsc.h"
+#include "../blitpool.h"
+#include "../../dmg.h"
+#include "compositor.h"
+
+#define STRERR strerror(errno)
+
+enum {
+	COMP_BLIT = 1,
+	COMP_COPY,
+	COMP_BLEND,
+	COMP_FILL,
+	COMP_CONVERT,
+	COMP_CONVERT_YUV,
+	COMP_SCALE,
+	COMP_HASH,
+	COMP_FENCE,
+	COMP_QUIT
+};
+
+struct comp_op {
+	uint32_t type;
+	uint32_t fence;
+	char *dest;
+	char *src;
+	unsigned int dest_pitch;
+	unsigned int src_pitch;
+	unsigned int width;
+	unsigned int height;
+	uint32_t *palette;
+	uint16_t format;
+	/* yuv planes, src is luma and src_pitch it's stride */
+	char *cb;
+	char *cr;
+	unsigned int chroma_stride;
+	unsigned int x;
+	unsigned int y;
+	/* scaled sprites, x and y are in scaled pixels */
+	unsigned int src_width;
+	unsigned int src_height;
+	uint16_t scale;
+	uint16_t filter;
+	/* tile hashes, src and src_pitch are the sprite */
+	struct dmg_tiles *tiles;
+	struct spr16_msgdata_sync span;
+	uint32_t gen;
+	uint16_t weight;
+};
+
+struct comp_done {
+	uint32_t fence;
+	uint64_t timestamp;
+};
+
+static struct spsc_ring *g_ops;  /* loop -> compositor */
+static struct spsc_ring *g_done; /* compositor -> loop */
+static pthread_t g_thread;
+static int g_threaded;
+static int g_kick_fd = -1; /* thread sleeps on this */
+static int g_done_fd = -1;
+static uint32_t g_fence;
+static uint32_t g_unkicked;
+static int g_exited;      /* thread gave up, set from the thread */
+static char *g_scratch; /* only touched by whoever runs ops */
+static size_t g_scratch_size;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void eventfd_signal(int fd)
+{
+	uint64_t val = 1;
+	while (write(fd, &val, sizeof(val)) == -1 && errno == EINTR)
+	{
+	}
+}
+
+static char *scratch(size_t size)
+{
+	char *buf;
+	if (size <= g_scratch_size)
+		return g_scratch;
+	buf = realloc(g_scratch, size);
+	if (buf == NULL) {
+		printf("compositor scratch(%lu) failed\n", (unsigned long)size);
+		return NULL;
+	}
+	g_scratch = buf;
+	g_scratch_size = size;
+	return g_scratch;
+}
+
+static void run_op(struct comp_op *op)
+{
+	struct comp_done *done;
+	unsigned int y;
+	char *buf;
+
+	switch (op->type)
+	{
+	case COMP_BLIT:
+		blit_pool_rect(blit_kernel_get(), op->dest, op->src, op->dest_pitch,
+			       op->src_pitch, op->width, op->height);
+		break;
+	case COMP_COPY:
+		for (y = 0; y < op->height; ++y)
+		{
+			memcpy(op->dest + (y * op->dest_pitch),
+			       op->src + (y * op->src_pitch), op->width);
+		}
+		break;
+	case COMP_BLEND:
+		blit_blend_rect(op->dest, op->src, op->dest_pitch,
+				op->src_pitch, op->width, op->height);
+		break;
+	case COMP_FILL:
+		for (y = 0; y < op->height; ++y)
+		{
+			memset(op->dest + (y * op->dest_pitch), 0, op->width);
+		}
+		break;
+	case COMP_CONVERT:
+		blit_convert_rect(op->dest, op->src, op->dest_pitch, op->src_pitch,
+				  op->width, op->height, op->format, op->palette);
+		break;
+	case COMP_CONVERT_YUV:
+		blit_convert_yuv_rect(op->dest, op->dest_pitch, op->src, op->src_pitch,
+				      op->cb, op->cr, op->chroma_stride,
+				      op->x, op->y, op->width, op->height);
+		break;
+	case COMP_SCALE:
+		buf = scratch(((op->width * 4) + 8) * sizeof(uint32_t));
+		if (buf == NULL)
+			break;
+		blit_scale_rect(blit_kernel_get(), op->dest, op->dest_pitch,
+				op->src, op->src_pitch, op->src_width, op->src_height,
+				op->scale, op->filter, op->x, op->y,
+				op->width, op->height, buf);
+		break;
+	case COMP_HASH:
+		dmg_tiles_hash_store(op->tiles, op->src, op->src_pitch, op->weight,
+				     op->gen, &op->span);
+		break;
+	case COMP_FENCE:
+		/* stream stores are weakly ordered, they have to land first */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		/* one done slot per op slot, this can't fill up */
+		done = spsc_ring_reserve(g_done);
+		if (done == NULL) {
+			printf("compositor done ring overflow\n");
+			break;
+		}
+		done->fence = op->fence;
+		done->timestamp = now_ns();
+		spsc_ring_commit(g_done);
+		eventfd_signal(g_done_fd);
+		break;
+	default:
+		break;
+	}
+}
+
+static void *compositor_thread(void *v)
+{
+	sigset_t sigs;
+	(void)v;
+
+	/* vt switching and shutdown signals belong to the main thread */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	while (1)
+	{
+		struct comp_op *op;
+		uint64_t count;
+
+		while ((op = spsc_ring_peek(g_ops)))
+		{
+			if (op->type == COMP_QUIT)
+				return NULL;
+			run_op(op);
+			spsc_ring_release(g_ops);
+		}
+		if (read(g_kick_fd, &count, sizeof(count)) == -1 && errno != EINTR) {
+			printf("compositor read: %s\n", STRERR);
+			__atomic_store_n(&g_exited, 1, __ATOMIC_RELEASE);
+			return NULL;
+		}
+	}
+}
+
+/* the thread is gone, run whatever it left behind and go inline from now on */
+static int compositor_exited()
+{
+	struct comp_op *op;
+
+	if (!__atomic_load_n(&g_exited, __ATOMIC_ACQUIRE))
+		return 0;
+	pthread_join(g_thread, NULL);
+	g_threaded = 0;
+	printf("compositor thread exited, running inline\n");
+	while ((op = spsc_ring_peek(g_ops)))
+	{
+		run_op(op);
+		spsc_ring_release(g_ops);
+	}
+	return 1;
+}
+
+static void queue_op(struct comp_op *op)
+{
+	struct comp_op *slot;
+
+	if (g_threaded)
+		compositor_exited();
+	if (!g_threaded) {
+		if (op->type != COMP_QUIT)
+			run_op(op);
+		return;
+	}
+	while ((slot = spsc_ring_reserve(g_ops)) == NULL)
+	{
+		struct timespec ts = { 0, 50000 };
+		if (compositor_exited()) {
+			queue_op(op);
+			return;
+		}
+		compositor_kick();
+		nanosleep(&ts, NULL);
+	}
+	memcpy(slot, op, sizeof(*slot));
+	spsc_ring_commit(g_ops);
+	++g_unkicked;
+}
+
+int compositor_create(int threaded)
+{
+	int r;
+
+	g_fence = 0;
+	g_unkicked = 0;
+	g_exited = 0;
+	g_ops  = malloc(spsc_ring_bytes(COMPOSITOR_RING, sizeof(struct comp_op)));
+	g_done = malloc(spsc_ring_bytes(COMPOSITOR_RING, sizeof(struct comp_done)));
+	if (g_ops == NULL || g_done == NULL)
+		goto err;
+	spsc_ring_init(g_ops, COMPOSITOR_RING, sizeof(struct comp_op));
+	spsc_ring_init(g_done, COMPOSITOR_RING, sizeof(struct comp_done));
+
+	g_done_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	g_kick_fd = eventfd(0, EFD_CLOEXEC);
+	if (g_done_fd == -1 || g_kick_fd == -1) {
+		printf("eventfd: %s\n", STRERR);
+		goto err;
+	}
+
+	g_threaded = 0;
+	if (threaded) {
+		r = pthread_create(&g_thread, NULL, compositor_thread, NULL);
+		if (r) {
+			printf("pthread_create: %s\n", strerror(r));
+			goto err;
+		}
+		g_threaded = 1;
+	}
+	printf("compositor thread: %s\n", g_threaded ? "yes" : "no");
+	return 0;
+err:
+	compositor_destroy();
+	return -1;
+}
+
+void compositor_destroy()
+{
+	if (g_threaded) {
+		struct comp_op op;
+		memset(&op, 0, sizeof(op));
+		op.type = COMP_QUIT;
+		queue_op(&op);
+		/* already joined if it had exited */
+		if (g_threaded) {
+			compositor_kick();
+			pthread_join(g_thread, NULL);
+			g_threaded = 0;
+		}
+	}
+	if (g_kick_fd != -1)
+		close(g_kick_fd);
+	if (g_done_fd != -1)
+		close(g_done_fd);
+	g_kick_fd = -1;
+	g_done_fd = -1;
+	free(g_ops);
+	free(g_done);
+	free(g_scratch);
+	g_ops = NULL;
+	g_done = NULL;
+	g_scratch = NULL;
+	g_scratch_size = 0;
+}
+
+int compositor_fd()
+{
+	return g_done_fd;
+}
+
+static void queue_rect(uint32_t type, char *dest, char *src,
+		       unsigned int dest_pitch, unsigned int src_pitch,
+		       unsigned int width, unsigned int height)
+{
+	struct comp_op op;
+	if (!width || !height)
+		return;
+	memset(&op, 0, sizeof(op));
+	op.type = type;
+	op.dest = dest;
+	op.src = src;
+	op.dest_pitch = dest_pitch;
+	op.src_pitch = src_pitch;
+	op.width = width;
+	op.height = height;
+	queue_op(&op);
+}
+
+void compositor_blit(char *dest, char *src,
+		     unsigned int dest_pitch, unsigned int src_pitch,
+		     unsigned int width, unsigned int height)
+{
+	queue_rect(COMP_BLIT, dest, src, dest_pitch, src_pitch, width, height);
+}
+
+void compositor_copy(char *dest, char *src,
+		     unsigned int dest_pitch, unsigned int src_pitch,
+		     unsigned int width, unsigned int height)
+{
+	queue_rect(COMP_COPY, dest, src, dest_pitch, src_pitch, width, height);
+}
+
+void compositor_blend(char *dest, char *src,
+		      unsigned int dest_pitch, unsigned int src_pitch,
+		      unsigned int width, unsigned int height)
+{
+	queue_rect(COMP_BLEND, dest, src, dest_pitch, src_pitch, width, height);
+}
+
+void compositor_convert(char *dest, char *src,
+			unsigned int dest_pitch, unsigned int src_pitch,
+			unsigned int width, unsigned int height,
+			uint16_t format, uint32_t *palette)
+{
+	struct comp_op op;
+	if (!width || !height)
+		return;
+	memset(&op, 0, sizeof(op));
+	op.type = COMP_CONVERT;
+	op.dest = dest;
+	op.src = src;
+	op.dest_pitch = dest_pitch;
+	op.src_pitch = src_pitch;
+	op.width = width;
+	op.height = height;
+	op.format = format;
+	op.palette = palette;
+	queue_op(&op);
+}
+
+void compositor_convert_yuv(char *dest, unsigned int dest_pitch,
+			    char *luma, unsigned int luma_stride,
+			    char *cb, char *cr, unsigned int chroma_stride,
+			    unsigned int x, unsigned int y,
+			    unsigned int width, unsigned int height)
+{
+	struct comp_op op;
+	if (!width || !height)
+		return;
+	memset(&op, 0, sizeof(op));
+	op.type = COMP_CONVERT_YUV;
+	op.dest = dest;
+	op.src = luma;
+	op.dest_pitch = dest_pitch;
+	op.src_pitch = luma_stride;
+	op.width = width;
+	op.height = height;
+	op.cb = cb;
+	op.cr = cr;
+	op.chroma_stride = chroma_stride;
+	op.x = x;
+	op.y = y;
+	queue_op(&op);
+}
+
+void compositor_scale(char *dest, unsigned int dest_pitch,
+		      char *src, unsigned int src_pitch,
+		      unsigned int src_width, unsigned int src_height,
+		      unsigned int scale, unsigned int filter,
+		      unsigned int x, unsigned int y,
+		      unsigned int width, unsigned int height)
+{
+	struct comp_op op;
+	if (!width || !height)
+		return;
+	memset(&op, 0, sizeof(op));
+	op.type = COMP_SCALE;
+	op.dest = dest;
+	op.src = src;
+	op.dest_pitch = dest_pitch;
+	op.src_pitch = src_pitch;
+	op.width = width;
+	op.height = height;
+	op.src_width = src_width;
+	op.src_height = src_height;
+	op.scale = scale;
+	op.filter = filter;
+	op.x = x;
+	op.y = y;
+	queue_op(&op);
+}
+
+void compositor_fill(char *dest, unsigned int dest_pitch,
+		     unsigned int width, unsigned int height)
+{
+	queue_rect(COMP_FILL, dest, NULL, dest_pitch, 0, width, height);
+}
+
+void compositor_hash_tiles(struct dmg_tiles *tiles, char *src,
+			   unsigned int src_pitch, unsigned int weight,
+			   struct spr16_msgdata_sync *span)
+{
+	struct comp_op op;
+	if (tiles->hash == NULL)
+		return;
+	memset(&op, 0, sizeof(op));
+	op.type = COMP_HASH;
+	op.tiles = tiles;
+	op.src = src;
+	op.src_pitch = src_pitch;
+	op.weight = weight;
+	op.gen = tiles->hash_gen;
+	op.span = *span;
+	queue_op(&op);
+}
+
+void compositor_kick()
+{
+	if (!g_unkicked)
+		return;
+	g_unkicked = 0;
+	eventfd_signal(g_kick_fd);
+}
+
+uint32_t compositor_fence()
+{
+	struct comp_op op;
+
+	memset(&op, 0, sizeof(op));
+	if (++g_fence == 0)
+		++g_fence;
+	op.type = COMP_FENCE;
+	op.fence = g_fence;
+	queue_op(&op);
+	compositor_kick();
+	return g_fence;
+}
+
+int compositor_done(uint32_t *fence, uint64_t *timestamp)
+{
+	struct comp_done *done = spsc_ring_peek(g_done);
+	if (done == NULL)
+		return 0;
+	*fence = done->fence;
+	*timestamp = done->timestamp;
+	spsc_ring_release(g_done);
+	return 1;
+}
+
+void compositor_wait()
+{
+	if (!g_threaded)
+		return;
+	compositor_kick();
+	while (spsc_ring_used(g_ops))
+	{
+		struct timespec ts = { 0, 50000 };
+		if (compositor_exited())
+			return;
+		nanosleep(&ts, NULL);
+	}
+}
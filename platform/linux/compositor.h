@@ -0,0 +1,96 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * compositor thread, every pixel written to scanout goes through here so big
+ * copies never hold up input or client messages on the event loop. the loop
+ * still decides what gets copied where, and queues plain pixel operations on
+ * a lock-free ring. they run strictly in order, a fence marks the end of a
+ * frame and comes back through compositor_fd when everything before it has
+ * been written, that is when acks and page flips can go out.
+ *
+ * memory referenced by queued operations has to stay mapped until they have
+ * run, use compositor_wait before unmapping a sprite or a scanout buffer.
+ * with threaded = 0 operations run immediately on the caller's thread, fences
+ * are still delivered through compositor_fd.
+ */
+
+#ifndef LINUX_COMPOSITOR_H__
+#define LINUX_COMPOSITOR_H__
+
+#include <stdint.h>
+
+struct dmg_tiles;
+struct spr16_msgdata_sync;
+
+#define COMPOSITOR_RING 4096 /* queued operations */
+
+int  compositor_create(int threaded);
+void compositor_destroy();
+/* readable when fences have completed, collect them with compositor_done */
+int  compositor_fd();
+
+/* width is in bytes, through the blit pool to write-combined scanout */
+void compositor_blit(char *dest, char *src,
+		     unsigned int dest_pitch, unsigned int src_pitch,
+		     unsigned int width, unsigned int height);
+/* width is in bytes, plain copy into cached memory */
+void compositor_copy(char *dest, char *src,
+		     unsigned int dest_pitch, unsigned int src_pitch,
+		     unsigned int width, unsigned int height);
+/* width is in pixels, see blit_blend_rect */
+void compositor_blend(char *dest, char *src,
+		      unsigned int dest_pitch, unsigned int src_pitch,
+		      unsigned int width, unsigned int height);
+/* width is in pixels, see blit_convert_rect */
+void compositor_convert(char *dest, char *src,
+			unsigned int dest_pitch, unsigned int src_pitch,
+			unsigned int width, unsigned int height,
+			uint16_t format, uint32_t *palette);
+/* width is in pixels, see blit_convert_yuv_rect */
+void compositor_convert_yuv(char *dest, unsigned int dest_pitch,
+			    char *luma, unsigned int luma_stride,
+			    char *cb, char *cr, unsigned int chroma_stride,
+			    unsigned int x, unsigned int y,
+			    unsigned int width, unsigned int height);
+/* width is in scaled pixels, see blit_scale_rect */
+void compositor_scale(char *dest, unsigned int dest_pitch,
+		      char *src, unsigned int src_pitch,
+		      unsigned int src_width, unsigned int src_height,
+		      unsigned int scale, unsigned int filter,
+		      unsigned int x, unsigned int y,
+		      unsigned int width, unsigned int height);
+/* width is in bytes, zero fill */
+void compositor_fill(char *dest, unsigned int dest_pitch,
+		     unsigned int width, unsigned int height);
+/* stores the hashes of whole tiles in span, queue it right before the
+ * copy so they describe what was copied, see dmg_tiles_hash_store */
+void compositor_hash_tiles(struct dmg_tiles *tiles, char *src,
+			   unsigned int src_pitch, unsigned int weight,
+			   struct spr16_msgdata_sync *span);
+
+/* wake the thread for everything queued so far */
+void compositor_kick();
+/* kicks, and returns an id that compositor_done reports after every
+ * operation queued before it has run. ids start at 1 and wrap */
+uint32_t compositor_fence();
+/* 1 and the oldest completed fence, with CLOCK_MONOTONIC ns it completed at.
+ * 0 when there are no more */
+int  compositor_done(uint32_t *fence, uint64_t *timestamp);
+/* nonzero if fence a completed no later than b */
+#define COMPOSITOR_FENCE_BEFORE(a, b) ((int32_t)((a) - (b)) <= 0)
+/* block until every queued operation has run */
+void compositor_wait();
+
+#endif
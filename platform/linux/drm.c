@@ -31,6 +31,7 @@
 #include <sys/ioctl.h>
 #include <drm/drm.h>
 #include <drm/drm_mode.h>
+#include <drm/drm_fourcc.h>
 
 #define STRERR strerror(errno)
 
@@ -559,9 +560,235 @@ static int card_drop_master(int card_fd)
 	return 0;
 }
 
+/* returns value of the named property, or -1 */
+static int64_t get_object_prop(int card_fd, uint32_t obj_id,
+			       uint32_t obj_type, const char *name)
+{
+	struct drm_mode_obj_get_properties props;
+	uint32_t *ids = NULL;
+	uint64_t *values = NULL;
+	int64_t ret = -1;
+	uint32_t i;
+
+	memset(&props, 0, sizeof(props));
+	props.obj_id = obj_id;
+	props.obj_type = obj_type;
+	if (ioctl(card_fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &props) == -1)
+		return -1;
+	if (props.count_props == 0)
+		return -1;
+	ids = calloc(props.count_props, sizeof(uint32_t));
+	values = calloc(props.count_props, sizeof(uint64_t));
+	if (!ids || !values)
+		goto out;
+	props.props_ptr = drm_from_ptr(ids);
+	props.prop_values_ptr = drm_from_ptr(values);
+	if (ioctl(card_fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &props) == -1)
+		goto out;
+
+	for (i = 0; i < props.count_props; ++i)
+	{
+		struct drm_mode_get_property prop;
+		memset(&prop, 0, sizeof(prop));
+		prop.prop_id = ids[i];
+		if (ioctl(card_fd, DRM_IOCTL_MODE_GETPROPERTY, &prop) == -1)
+			continue;
+		if (strncmp(prop.name, name, DRM_DISPLAY_MODE_LEN) == 0) {
+			ret = (int64_t)values[i];
+			break;
+		}
+	}
+out:
+	free(ids);
+	free(values);
+	return ret;
+}
+
+static int plane_has_format(int card_fd, struct drm_mode_get_plane *plane,
+			    uint32_t format)
+{
+	uint32_t *formats;
+	uint32_t i;
+	int ret = 0;
+
+	if (plane->count_format_types == 0)
+		return 0;
+	formats = calloc(plane->count_format_types, sizeof(uint32_t));
+	if (formats == NULL)
+		return 0;
+	plane->format_type_ptr = drm_from_ptr(formats);
+	if (ioctl(card_fd, DRM_IOCTL_MODE_GETPLANE, plane) == 0) {
+		for (i = 0; i < plane->count_format_types; ++i)
+		{
+			if (formats[i] == format) {
+				ret = 1;
+				break;
+			}
+		}
+	}
+	plane->format_type_ptr = 0;
+	free(formats);
+	return ret;
+}
+
+/* find XRGB8888 overlay planes usable on our crtc, not fatal if none */
+static void drm_kms_load_planes(struct drm_kms *self)
+{
+	struct drm_set_client_cap cap;
+	struct drm_mode_get_plane_res res;
+	uint32_t *ids = NULL;
+	uint32_t crtc_bit = 0;
+	uint32_t i;
+
+	/* primary and cursor planes are hidden without this */
+	memset(&cap, 0, sizeof(cap));
+	cap.capability = DRM_CLIENT_CAP_UNIVERSAL_PLANES;
+	cap.value = 1;
+	if (ioctl(self->card_fd, DRM_IOCTL_SET_CLIENT_CAP, &cap) == -1) {
+		printf("no universal planes, overlays disabled\n");
+		return;
+	}
+
+	for (i = 0; i < self->res->count_crtcs; ++i)
+	{
+		if (drm_get_id(self->res->crtc_id_ptr, i) == self->display.crtc.crtc_id)
+			crtc_bit = 1 << i;
+	}
+
+	memset(&res, 0, sizeof(res));
+	if (ioctl(self->card_fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &res) == -1
+			|| res.count_planes == 0)
+		return;
+	ids = calloc(res.count_planes, sizeof(uint32_t));
+	if (ids == NULL)
+		return;
+	res.plane_id_ptr = drm_from_ptr(ids);
+	if (ioctl(self->card_fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &res) == -1) {
+		free(ids);
+		return;
+	}
+
+	for (i = 0; i < res.count_planes && self->plane_count < DRM_MAX_PLANES; ++i)
+	{
+		struct drm_mode_get_plane plane;
+		memset(&plane, 0, sizeof(plane));
+		plane.plane_id = ids[i];
+		if (ioctl(self->card_fd, DRM_IOCTL_MODE_GETPLANE, &plane) == -1)
+			continue;
+		if (!(plane.possible_crtcs & crtc_bit))
+			continue;
+		if (get_object_prop(self->card_fd, ids[i], DRM_MODE_OBJECT_PLANE,
+					"type") != DRM_PLANE_TYPE_OVERLAY)
+			continue;
+		if (!plane_has_format(self->card_fd, &plane, DRM_FORMAT_XRGB8888))
+			continue;
+		memset(&self->planes[self->plane_count], 0, sizeof(struct drm_plane));
+		self->planes[self->plane_count].plane_id = ids[i];
+		++self->plane_count;
+	}
+	free(ids);
+	printf("%d overlay planes available\n", self->plane_count);
+}
+
+static void gem_close(int card_fd, uint32_t handle)
+{
+	struct drm_gem_close gclose;
+	memset(&gclose, 0, sizeof(gclose));
+	gclose.handle = handle;
+	if (ioctl(card_fd, DRM_IOCTL_GEM_CLOSE, &gclose) == -1)
+		printf("ioctl(DRM_IOCTL_GEM_CLOSE): %s\n", STRERR);
+}
+
+/* fb_id 0 turns the plane off */
+static int plane_show(struct drm_kms *self, struct drm_plane *plane, uint32_t fb_id)
+{
+	struct drm_mode_set_plane set;
+
+	/* src is 16.16 fixed point */
+	memset(&set, 0, sizeof(set));
+	set.plane_id = plane->plane_id;
+	if (fb_id) {
+		set.crtc_id  = self->display.crtc.crtc_id;
+		set.fb_id    = fb_id;
+		set.crtc_x   = plane->x;
+		set.crtc_y   = plane->y;
+		set.crtc_w   = plane->width;
+		set.crtc_h   = plane->height;
+		set.src_w    = plane->width << 16;
+		set.src_h    = plane->height << 16;
+	}
+	if (ioctl(self->card_fd, DRM_IOCTL_MODE_SETPLANE, &set) == -1) {
+		printf("ioctl(DRM_IOCTL_MODE_SETPLANE): %s\n", STRERR);
+		return -1;
+	}
+	return 0;
+}
+
+int drm_kms_plane_set(struct drm_kms *self,
+		      uint32_t idx,
+		      int dmabuf_fd,
+		      int32_t x,
+		      int32_t y,
+		      uint32_t width,
+		      uint32_t height,
+		      uint32_t pitch)
+{
+	struct drm_plane *plane;
+	struct drm_mode_fb_cmd2 cmd;
+	uint32_t gem;
+
+	if (idx >= self->plane_count || self->planes[idx].fb_id)
+		return -1;
+	plane = &self->planes[idx];
+	if (drm_prime_import_fd(self->card_fd, dmabuf_fd, &gem))
+		return -1;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.width  = width;
+	cmd.height = height;
+	cmd.pixel_format = DRM_FORMAT_XRGB8888;
+	cmd.handles[0] = gem;
+	cmd.pitches[0] = pitch;
+	if (ioctl(self->card_fd, DRM_IOCTL_MODE_ADDFB2, &cmd) == -1) {
+		printf("ioctl(DRM_IOCTL_MODE_ADDFB2): %s\n", STRERR);
+		gem_close(self->card_fd, gem);
+		return -1;
+	}
+
+	plane->x = x;
+	plane->y = y;
+	plane->width  = width;
+	plane->height = height;
+	if (plane_show(self, plane, cmd.fb_id)) {
+		ioctl(self->card_fd, DRM_IOCTL_MODE_RMFB, &cmd.fb_id);
+		gem_close(self->card_fd, gem);
+		return -1;
+	}
+	plane->fb_id = cmd.fb_id;
+	plane->gem   = gem;
+	return 0;
+}
+
+void drm_kms_plane_clear(struct drm_kms *self, uint32_t idx)
+{
+	struct drm_plane *plane;
+
+	if (idx >= self->plane_count || !self->planes[idx].fb_id)
+		return;
+	plane = &self->planes[idx];
+	plane_show(self, plane, 0);
+	if (ioctl(self->card_fd, DRM_IOCTL_MODE_RMFB, &plane->fb_id) == -1)
+		printf("ioctl(DRM_IOCTL_MODE_RMFB): %s\n", STRERR);
+	gem_close(self->card_fd, plane->gem);
+	plane->fb_id = 0;
+	plane->gem   = 0;
+	plane->owner = NULL;
+}
+
 /* TODO multiple states needed for managing multiple cards */
 int drm_acquire_signal(struct drm_kms *self)
 {
+	uint32_t i;
 	if (card_set_master(self->card_fd)) {
 		printf("set master(acquire signal)\n");
 		return -1;
@@ -573,6 +800,11 @@ int drm_acquire_signal(struct drm_kms *self)
 		printf("unable to reconnect drm buffer\n");
 		return -1;
 	}
+	for (i = 0; i < self->plane_count; ++i)
+	{
+		if (self->planes[i].fb_id)
+			plane_show(self, &self->planes[i], self->planes[i].fb_id);
+	}
 	spr16_server_activate();
 
 	return 0;
@@ -580,7 +812,14 @@ int drm_acquire_signal(struct drm_kms *self)
 
 int drm_release_signal(struct drm_kms *self)
 {
+	uint32_t i;
 	spr16_server_deactivate();
+	/* whoever gets the vt next expects overlays off, fb's are kept */
+	for (i = 0; i < self->plane_count; ++i)
+	{
+		if (self->planes[i].fb_id)
+			plane_show(self, &self->planes[i], 0);
+	}
 	if (card_drop_master(self->card_fd)) {
 		printf("-- drop master sig2 --\n");
 		return -1;
@@ -600,8 +839,15 @@ static int drm_display_destroy(struct drm_display *display)
 
 int drm_kms_destroy(struct drm_kms *self)
 {
+	uint32_t i;
+	for (i = 0; i < self->plane_count; ++i)
+	{
+		drm_kms_plane_clear(self, i);
+	}
 	if (self->sfb)
 		destroy_sfb(self->card_fd, self->sfb);
+	if (self->back)
+		destroy_sfb(self->card_fd, self->back);
 	if (self->res)
 		free_mode_card_res(self->res);
 	drm_display_destroy(&self->display);
@@ -612,6 +858,40 @@ int drm_kms_destroy(struct drm_kms *self)
 	return 0;
 }
 
+int drm_kms_page_flip(struct drm_kms *self)
+{
+	struct drm_mode_crtc_page_flip flip;
+	int r;
+
+	if (!self->back || self->flip_pending)
+		return -1;
+
+	memset(&flip, 0, sizeof(flip));
+	flip.crtc_id = self->display.crtc.crtc_id;
+	flip.fb_id   = self->back->fb_id;
+	flip.flags   = DRM_MODE_PAGE_FLIP_EVENT;
+	do {
+		r = ioctl(self->card_fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip);
+	} while (r == -1 && errno == EINTR);
+	if (r) {
+		printf("ioctl(DRM_IOCTL_MODE_PAGE_FLIP): %s\n", STRERR);
+		return -1;
+	}
+	self->flip_pending = 1;
+	return 0;
+}
+
+void drm_kms_flip_complete(struct drm_kms *self)
+{
+	struct drm_buffer *tmp;
+	if (!self->flip_pending)
+		return;
+	tmp = self->sfb;
+	self->sfb = self->back;
+	self->back = tmp;
+	self->flip_pending = 0;
+}
+
 /* returns the closest <= match preference on width
  * refresh is matched to closest value */
 static int get_mode_idx(struct drm_mode_modeinfo *modes,
@@ -630,22 +910,19 @@ static int get_mode_idx(struct drm_mode_modeinfo *modes,
 	{
 		if (modes[i].hdisplay > width || modes[i].vdisplay > height)
 			continue;
-		/* must divide evenly by 16 */
-		if (modes[i].hdisplay % 16 == 0) {
-			if (pick < 0) {
-				pick = i;
-				continue;
-			}
-			if (modes[i].hdisplay > modes[pick].hdisplay)
-				pick = i;
-			else if (modes[i].vdisplay > modes[pick].vdisplay)
+		if (pick < 0) {
+			pick = i;
+			continue;
+		}
+		if (modes[i].hdisplay > modes[pick].hdisplay)
+			pick = i;
+		else if (modes[i].vdisplay > modes[pick].vdisplay)
+			pick = i;
+		else if (modes[i].hdisplay == modes[pick].hdisplay
+				&& modes[i].vdisplay == modes[pick].vdisplay) {
+			if (abs(refresh - modes[i].vrefresh)
+				  < abs(refresh - modes[pick].vrefresh)) {
 				pick = i;
-			else if (modes[i].hdisplay == modes[pick].hdisplay
-					&& modes[i].vdisplay == modes[pick].vdisplay) {
-				if (abs(refresh - modes[i].vrefresh)
-					  < abs(refresh - modes[pick].vrefresh)) {
-					pick = i;
-				}
 			}
 		}
 	}
@@ -751,10 +1028,22 @@ struct drm_kms *drm_mode_create(char *devname,
 		printf("alloc_sfb failed\n");
 		goto free_err;
 	}
+	/* not fatal, SPRITESYNC_FLAG_PAGE_FLIP falls back to vblank copies */
+	self->back = alloc_sfb(card_fd, cur_mode->hdisplay, cur_mode->vdisplay, 24, 32);
+	if (!self->back)
+		printf("no back buffer, page flipping disabled\n");
+	else if (self->back->pitch != self->sfb->pitch) {
+		printf("back buffer pitch mismatch, page flipping disabled\n");
+		destroy_sfb(card_fd, self->back);
+		self->back = NULL;
+	}
 
-	if (!no_connect && drm_kms_connect_sfb(self)) {
-		printf("drm_kms_connect_sfb failed\n");
-		goto free_err;
+	if (!no_connect) {
+		if (drm_kms_connect_sfb(self)) {
+			printf("drm_kms_connect_sfb failed\n");
+			goto free_err;
+		}
+		drm_kms_load_planes(self);
 	}
 	return self;
 
@@ -49,12 +49,30 @@ struct drm_display
 	uint32_t conn_id;
 };
 
+/* overlay plane on our crtc, fb_id is 0 while the plane is unused */
+struct drm_plane
+{
+	uint32_t plane_id;
+	uint32_t fb_id;
+	uint32_t gem;
+	int32_t  x;
+	int32_t  y;
+	uint32_t width;
+	uint32_t height;
+	void *owner;
+};
+
+#define DRM_MAX_PLANES 8
 struct drm_kms
 {
 	struct drm_display display;
-	struct drm_buffer *sfb;
+	struct drm_plane planes[DRM_MAX_PLANES];
+	uint32_t plane_count;
+	struct drm_buffer *sfb;  /* scanout */
+	struct drm_buffer *back; /* NULL if page flipping is unavailable */
 	struct drm_mode_card_res *res;
 	int card_fd;
+	int flip_pending;
 };
 
 
@@ -68,6 +86,20 @@ int drm_kms_destroy(struct drm_kms *self);
 int drm_acquire_signal(struct drm_kms *self);
 int drm_release_signal(struct drm_kms *self);
 int drm_kms_print_modes(char *devpath);
+/* queue back buffer for scanout, DRM_EVENT_FLIP_COMPLETE when it's done */
+int drm_kms_page_flip(struct drm_kms *self);
+/* call on DRM_EVENT_FLIP_COMPLETE, swaps sfb and back */
+void drm_kms_flip_complete(struct drm_kms *self);
+/* import a dma-buf as XRGB8888 and show it on plane idx at x, y */
+int drm_kms_plane_set(struct drm_kms *self,
+		      uint32_t idx,
+		      int dmabuf_fd,
+		      int32_t x,
+		      int32_t y,
+		      uint32_t width,
+		      uint32_t height,
+		      uint32_t pitch);
+void drm_kms_plane_clear(struct drm_kms *self, uint32_t idx);
 int drm_prime_import_fd(int card_fd, int prime_fd, uint32_t *out_gem_handle);
 int drm_prime_export_fd(int card_fd, struct drm_buffer *buffer, int *out_prime_fd);
 char *drm_gem_mmap_handle(int card_fd, size_t length, off_t map_offset);
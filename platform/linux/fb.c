@@ -12,260 +12,989 @@
  * received a copy of the GNU General Public License version 3
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  *
- *
- * TODO support resolutions not divisible by PIXL_ALIGN
  */
 
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <memory.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include "../../screen.h"
+#include "../../dmg.h"
+#include "../blit.h"
+#include "compositor.h"
 #include "fb.h"
 
-extern void x86_sse2_xmmcpy_128(char *dest, char *src, unsigned int count);
-extern void x86_sse2_xmmcpy_512(char *dest, char *src, unsigned int count);
-extern void x86_sse2_xmmcpy_1024(char *dest, char *src, unsigned int count);
-extern void x86_slocpy_512(void *dest, void *src, unsigned int count);
-#include <time.h>
-
-static struct timespec bench_begin()
+/* visible pieces of the rect being copied */
+static struct spr16_msgdata_sync g_visible[SCREEN_MAX_VISIBLE];
+/* pieces of each sprite in a composed band */
+static struct spr16_msgdata_sync g_pieces[SCREEN_MAX_VISIBLE];
+/* composed rows are blended in cached memory, then copied out. one band
+ * at a time, the compositor runs them in order so it is never shared */
+static char *g_compose;
+#define COMPOSE_ROWS 32
+/* bytes queued for scanout since last reset, feeds the frame scheduler */
+static uint64_t g_copied;
+
+/* sx, sy is in sprite coordinates, planes are never offset by the caller */
+static void convert_yuv(struct client *cl, char *dest, uint32_t dest_pitch,
+			uint32_t sx, uint32_t sy, uint32_t w, uint32_t h)
 {
-	struct timespec ret;
-	clock_gettime(CLOCK_MONOTONIC_RAW, &ret);
-	return ret;
+	uint32_t luma_stride;
+	uint32_t chroma_stride;
+	char *luma = spr16_sprite_plane(&cl->sprite, 0, &luma_stride);
+	char *cb   = spr16_sprite_plane(&cl->sprite, 1, &chroma_stride);
+	char *cr   = spr16_sprite_plane(&cl->sprite, 2, &chroma_stride);
+	if (luma == NULL || cb == NULL)
+		return;
+	compositor_convert_yuv(dest, dest_pitch, luma, luma_stride,
+			       cb, cr, chroma_stride, sx, sy, w, h);
 }
 
-unsigned long usecs_elapsed(struct timespec tlast, struct timespec tcur)
+static void compose_sprite(struct screen *scrn,
+			   struct client *cl,
+			   struct spr16_msgdata_sync *band,
+			   char *buf,
+			   uint32_t buf_pitch)
 {
-	struct timespec elapsed;
-	unsigned long usec;
-	elapsed.tv_sec = tcur.tv_sec - tlast.tv_sec;
-	if (!elapsed.tv_sec) {
-		elapsed.tv_nsec = tcur.tv_nsec - tlast.tv_nsec;
-		usec = elapsed.tv_nsec / 1000;
-	}
-	else {
-		usec = ((1000000000 - tlast.tv_nsec) + tcur.tv_nsec) / 1000;
-		usec += (elapsed.tv_sec-1) * 1000000;
+	struct spr16_msgdata_sync clip = *band;
+	const uint32_t weight = cl->sprite.bpp/8;
+	const uint32_t stride = cl->sprite.width * weight;
+	uint32_t count;
+	uint32_t i;
+
+	if (!screen_clip_to_sprite(cl, &clip))
+		return;
+	count = screen_visible_rects(scrn, cl, &clip, g_pieces);
+	for (i = 0; i < count; ++i)
+	{
+		const uint32_t w = g_pieces[i].xmax - g_pieces[i].xmin + 1;
+		const uint32_t h = g_pieces[i].ymax - g_pieces[i].ymin + 1;
+		char *dst = buf + ((g_pieces[i].ymin - band->ymin) * buf_pitch)
+				+ ((g_pieces[i].xmin - band->xmin) * 4);
+		char *src = cl->sprite.shmem.addr
+				+ ((g_pieces[i].ymin - cl->sprite.y) * stride)
+				+ ((g_pieces[i].xmin - cl->sprite.x) * weight);
+		if (cl->sprite.flags & SPRITE_FLAG_TRANSLUCENT)
+			compositor_blend(dst, src, buf_pitch, stride, w, h);
+		else if (cl->sprite.scale > 1)
+			compositor_scale(dst, buf_pitch, cl->sprite.shmem.addr, stride,
+					 cl->sprite.width, cl->sprite.height,
+					 cl->sprite.scale, cl->sprite.filter,
+					 g_pieces[i].xmin - cl->sprite.x,
+					 g_pieces[i].ymin - cl->sprite.y, w, h);
+		else if (SPR16_FORMAT_IS_YUV(cl->sprite.format))
+			convert_yuv(cl, dst, buf_pitch,
+				    g_pieces[i].xmin - cl->sprite.x,
+				    g_pieces[i].ymin - cl->sprite.y, w, h);
+		else if (cl->sprite.format != SPR16_FORMAT_XRGB8888)
+			compositor_convert(dst, src, buf_pitch, stride, w, h,
+					   cl->sprite.format,
+					   spr16_sprite_palette(&cl->sprite));
+		else
+			compositor_copy(dst, src, buf_pitch, stride, w * 4, h);
 	}
-	return usec;
 }
-static void bench_end(struct timespec start)
+
+/* redraw rect from every sprite on the main screen, opaque sprites are
+ * copied in, then translucent sprites are blended bottom to top */
+static int compose_rect(struct server_context *ctx,
+			char *target,
+			struct spr16_msgdata_sync *rect)
 {
-	struct timespec end;
-	clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-	printf("benched usecs: %lu\n", usecs_elapsed(start, end));
+	struct spr16_framebuffer *fb = ctx->fb;
+	struct client *translucent[SCREEN_MAX_SPRITES];
+	struct spr16_msgdata_sync band;
+	struct client *cl;
+	const uint32_t buf_pitch = (rect->xmax - rect->xmin + 1) * 4;
+	uint32_t count = 0;
+
+	if (g_compose == NULL) {
+		printf("no compose buffer\n");
+		return -1;
+	}
+	for (cl = ctx->main_screen->clients; cl; cl = cl->next)
+	{
+		if ((cl->sprite.flags & SPRITE_FLAG_TRANSLUCENT) && count < SCREEN_MAX_SPRITES)
+			translucent[count++] = cl;
+	}
+
+	band = *rect;
+	while (band.ymin <= rect->ymax)
+	{
+		uint32_t i;
+		band.ymax = band.ymin + COMPOSE_ROWS - 1;
+		if (band.ymax > rect->ymax)
+			band.ymax = rect->ymax;
+
+		compositor_fill(g_compose, buf_pitch, buf_pitch,
+				band.ymax - band.ymin + 1);
+		for (cl = ctx->main_screen->clients; cl; cl = cl->next)
+		{
+			if (!(cl->sprite.flags & SPRITE_FLAG_TRANSLUCENT))
+				compose_sprite(ctx->main_screen, cl, &band,
+					       g_compose, buf_pitch);
+		}
+		for (i = count; i > 0; --i)
+		{
+			compose_sprite(ctx->main_screen, translucent[i-1], &band,
+				       g_compose, buf_pitch);
+		}
+		compositor_blit(target + (band.ymin * fb->pitch) + (band.xmin * 4),
+				g_compose, fb->pitch, buf_pitch, buf_pitch,
+				band.ymax - band.ymin + 1);
+		if (band.ymax == rect->ymax)
+			break;
+		band.ymin = band.ymax + 1;
+	}
+	return 0;
 }
 
 static int copy_to_fb(struct server_context *ctx,
 		      struct client *cl,
+		      char *target,
 		      struct spr16_msgdata_sync dmg)
 {
 
 	struct spr16_framebuffer *fb = ctx->fb;
+	struct spr16_msgdata_sync rect;
 	/* TODO < 8bpp support */
-	const uint32_t grid_size = PIXL_ALIGN * (fb->bpp/8);
 	const uint32_t weight = fb->bpp/8;
-	const uint32_t pitch = ctx->card0->sfb->pitch;
+	const uint32_t sweight = cl->sprite.bpp/8;
+	const uint32_t pitch = fb->pitch;
+	const uint32_t stride = cl->sprite.width * sweight;
+	int32_t xmin, ymin, xmax, ymax;
 	uint32_t count;
-	uint16_t x = dmg.xmin;
-	uint16_t y = dmg.ymin;
-	uint16_t x_extent;
-	uint16_t height;
-	uint16_t width;
-	uint16_t i;
-	struct timespec bench_timer;
-
-
-	height = (dmg.ymax - dmg.ymin) + 1;
-	/* quantize regions on grid for optimized copy */
-	x = (dmg.xmin - (dmg.xmin % PIXL_ALIGN));
-	x_extent = dmg.xmax + 1;
-	if (x_extent % PIXL_ALIGN) /* can we clean up this branching? */
-		x_extent  = (dmg.xmax + (PIXL_ALIGN - (dmg.xmax % PIXL_ALIGN)));
-	if (x_extent > ctx->fb->width)
-		x_extent = ctx->fb->width;
-
-	width = x_extent - x;
-
-	/* convert to bytes */
-	width *= weight;
-	x *= weight;
-
-	count = width / grid_size;
-
-	if (width % grid_size) {
-		printf("drm copy align: %d\n", width % grid_size);
-		return -1;
+	uint32_t i;
+
+	/* quantize regions on grid, the ragged right edge of odd sized
+	 * sprites and screens is copied by blit_rect's tail handling */
+	xmin = dmg.xmin - (dmg.xmin % PIXL_ALIGN);
+	xmax = dmg.xmax;
+	if ((xmax + 1) % PIXL_ALIGN) /* can we clean up this branching? */
+		xmax += PIXL_ALIGN - ((xmax + 1) % PIXL_ALIGN);
+	if (xmax >= cl->sprite.width)
+		xmax = cl->sprite.width - 1;
+
+	ymin = dmg.ymin;
+	ymax = dmg.ymax;
+	if (cl->sprite.scale > 1) {
+		/* filtered pixels blend in their neighbours too */
+		if (cl->sprite.filter == SPR16_FILTER_BILINEAR) {
+			if (xmin > 0)
+				--xmin;
+			if (ymin > 0)
+				--ymin;
+			if (xmax + 1 < cl->sprite.width)
+				++xmax;
+			if (ymax + 1 < cl->sprite.height)
+				++ymax;
+		}
+		xmin *= cl->sprite.scale;
+		ymin *= cl->sprite.scale;
+		xmax = ((xmax + 1) * cl->sprite.scale) - 1;
+		ymax = ((ymax + 1) * cl->sprite.scale) - 1;
 	}
 
-	(void) bench_begin;
-	(void) bench_end;
-	(void) bench_timer;
-	/*bench_timer = bench_begin();*/
-	for (i = 0; i < height; ++i)
+	/* to screen coordinates, clipped to framebuffer */
+	xmin += cl->sprite.x;
+	xmax += cl->sprite.x;
+	ymin += cl->sprite.y;
+	ymax += cl->sprite.y;
+	if (xmin < 0)
+		xmin = 0;
+	if (ymin < 0)
+		ymin = 0;
+	if (xmax >= fb->width)
+		xmax = fb->width - 1;
+	if (ymax >= fb->height)
+		ymax = fb->height - 1;
+	if (xmax < xmin || ymax < ymin)
+		return 0;
+
+	rect.xmin = xmin;
+	rect.ymin = ymin;
+	rect.xmax = xmax;
+	rect.ymax = ymax;
+	count = screen_visible_rects(ctx->main_screen, cl, &rect, g_visible);
+	for (i = 0; i < count; ++i)
 	{
-		const uint32_t svoff = ((y + i) * pitch) + x;
-		const uint32_t cloff = (((y + i) * cl->sprite.width) * weight) + x;
-		uint16_t z;
-		(void)z;
-#if PIXL_ALIGN == 32
-		x86_sse2_xmmcpy_1024(fb->addr + svoff,
-				    cl->sprite.shmem.addr + cloff,
-				    count);
-#else
-		for (z = 0; z < count; ++z) {
-			memcpy((fb->addr + svoff) + (z * grid_size),
-				(cl->sprite.shmem.addr + cloff)	+ (z * grid_size),
-				grid_size);
+		const uint32_t x = g_visible[i].xmin;
+		const uint32_t y = g_visible[i].ymin;
+		const uint32_t sx = x - cl->sprite.x;
+		const uint32_t sy = y - cl->sprite.y;
+		g_copied += (uint64_t)(g_visible[i].xmax - x + 1) * weight
+				* (g_visible[i].ymax - y + 1);
+		if ((cl->sprite.flags & SPRITE_FLAG_TRANSLUCENT)
+				|| screen_sprite_above(ctx->main_screen, cl, &g_visible[i],
+						       SPRITE_FLAG_TRANSLUCENT)) {
+			if (compose_rect(ctx, target, &g_visible[i]))
+				return -1;
+			continue;
+		}
+		if (cl->sprite.scale > 1) {
+			compositor_scale(target + (y * pitch) + (x * weight), pitch,
+					 cl->sprite.shmem.addr, stride,
+					 cl->sprite.width, cl->sprite.height,
+					 cl->sprite.scale, cl->sprite.filter, sx, sy,
+					 g_visible[i].xmax - x + 1,
+					 g_visible[i].ymax - y + 1);
+			continue;
+		}
+		if (SPR16_FORMAT_IS_YUV(cl->sprite.format)) {
+			convert_yuv(cl, target + (y * pitch) + (x * weight), pitch,
+				    sx, sy, g_visible[i].xmax - x + 1,
+				    g_visible[i].ymax - y + 1);
+			continue;
+		}
+		if (cl->sprite.format != SPR16_FORMAT_XRGB8888) {
+			/* expanded on the way out, never stored smaller */
+			compositor_convert(target + (y * pitch) + (x * weight),
+					   cl->sprite.shmem.addr + (sy * stride)
+					   + (sx * sweight),
+					   pitch, stride,
+					   g_visible[i].xmax - x + 1,
+					   g_visible[i].ymax - y + 1,
+					   cl->sprite.format,
+					   spr16_sprite_palette(&cl->sprite));
+			continue;
+		}
+		compositor_blit(target + (y * pitch) + (x * weight),
+				cl->sprite.shmem.addr + (sy * stride) + (sx * weight),
+				pitch, stride,
+				(g_visible[i].xmax - x + 1) * weight,
+				g_visible[i].ymax - y + 1);
+	}
+	/*printf("sync(%d, %d, %d, %d)\n", xmin, ymin, xmax, ymax);*/
+	return 0;
+}
 
+static int copy_tiles(struct server_context *ctx,
+		      struct client *cl,
+		      char *target,
+		      struct dmg_tiles *tiles)
+{
+	uint32_t count;
+	uint32_t i;
+
+	count = dmg_tiles_merge(tiles);
+	for (i = 0; i < count; ++i)
+	{
+		compositor_hash_tiles(cl->dmg, cl->sprite.shmem.addr,
+				      cl->sprite.width * (cl->sprite.bpp/8),
+				      cl->sprite.bpp/8, &tiles->spans[i]);
+		if (copy_to_fb(ctx, cl, target, tiles->spans[i])) {
+			dmg_tiles_hash_reset(cl->dmg);
+			return -1;
 		}
-#endif
-		/*printf("sync(%d, %d, %d, %d) y=%d\n", x, y, width, height, i);*/
-		/*x86_slocpy_512(fb->addr + svoff,
-				    cl->sprite.shmem.addr + cloff,
-				    count);*/
-	}
-	/*usleep(30000);
-	bench_end(bench_timer);*/
+	}
+	dmg_tiles_clear(tiles);
 	return 0;
 }
 
-int sync_dmg_to_fb(struct server_context *ctx, struct client *cl)
+/* buf is 0/1 scanout buffer index, single buffered outputs only have front.
+ * with two buffers, new damage is also remembered for the other buffer
+ * and each buffer gets what it missed since it was last drawn (buffer age)
+ */
+static int sync_dmg_to_buffer(struct server_context *ctx,
+			      struct client *cl,
+			      unsigned int buf)
 {
-	int i;
+	struct output *output = ctx->output;
+	char *target = (buf == output->front) ? output->fb.addr : output->back;
+	uint32_t count;
+	uint32_t i;
 
 	if (cl->sprite.flags & SPRITE_FLAG_DIRECT_SHM) {
 		/* no memcpy needed if client has a direct map */
+		dmg_tiles_clear(cl->dmg);
+		return 0;
+	}
+	if (ctx->main_screen == NULL || cl->on_plane == 1
+			|| !screen_find_client(ctx->main_screen, cl->socket)) {
+		/* not on screen, gets a full sync when it's screen is switched to.
+		 * sprites on a plane are scanned out from their own memory */
+		dmg_tiles_clear(cl->dmg);
 		return 0;
 	}
 
 	/* maybe prefetch cl sprite here or something fancy like that? */
-	for (i = 0; i < cl->dmg_count; ++i)
+	if (cl->sprite.format == SPR16_FORMAT_INDEX8 && cl->dmg->hash) {
+		/* new colors, same indexes */
+		const uint32_t size = SPR16_PALETTE_COUNT * sizeof(uint32_t);
+		const uint32_t hash = blit_hash_rect((char *)spr16_sprite_palette(&cl->sprite),
+						     size, size, 1);
+		if (hash != cl->palette_hash) {
+			dmg_tiles_hash_reset(cl->dmg);
+			cl->palette_hash = hash;
+		}
+	}
+	dmg_tiles_hash_filter(cl->dmg, cl->sprite.shmem.addr,
+			      cl->sprite.width * (cl->sprite.bpp/8), cl->sprite.bpp/8);
+	if (cl->age[0] == NULL)
+		return copy_tiles(ctx, cl, target, cl->dmg);
+
+	count = dmg_tiles_merge(cl->dmg);
+	for (i = 0; i < count; ++i)
 	{
-		if (copy_to_fb(ctx, cl, cl->dmg[i])) {
-			return -1;
+		dmg_tiles_add(cl->age[0], &cl->dmg->spans[i]);
+		dmg_tiles_add(cl->age[1], &cl->dmg->spans[i]);
+	}
+	dmg_tiles_clear(cl->dmg);
+	return copy_tiles(ctx, cl, target, cl->age[buf]);
+}
+
+int sync_dmg_to_fb(struct server_context *ctx, struct client *cl)
+{
+	int ret = sync_dmg_to_buffer(ctx, cl, ctx->output->front);
+	compositor_kick();
+	return ret;
+}
+
+/* queue copy to scanout buffer, the fence completing it is set by caller */
+static int frame_copy(struct server_context *ctx,
+		      struct client *cl,
+		      unsigned int buf)
+{
+	const uint64_t now = frame_sched_now();
+
+	cl->present.wait_us = 0;
+	if (cl->sync_time && now > cl->sync_time)
+		cl->present.wait_us = (now - cl->sync_time) / 1000;
+	cl->present.copy_us = 0;
+	cl->copy_time = now;
+	return sync_dmg_to_buffer(ctx, cl, buf);
+}
+
+static void frame_stamp(struct client *cl, uint64_t timestamp, uint32_t sequence)
+{
+	cl->present.sequence = sequence;
+	cl->present.tv_sec   = timestamp / FRAME_SCHED_NSEC;
+	cl->present.tv_nsec  = timestamp % FRAME_SCHED_NSEC;
+	cl->stamped = 1;
+}
+
+static void frame_present(struct server_context *ctx, struct client *cl, uint32_t flags)
+{
+	struct spr16_msghdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.type = SPRITEMSG_PRESENT;
+	cl->present.flags = flags;
+	cl->sync_time = 0;
+	cl->stamped = 0;
+	spr16_server_send(ctx, cl, &hdr, &cl->present, sizeof(cl->present));
+}
+
+/* copies that were done by this vblank went out on it */
+static void frame_stamp_shown(struct output_frame *frame,
+			      uint64_t timestamp,
+			      uint32_t sequence)
+{
+	uint32_t i;
+	for (i = 0; i < frame->shown_count; ++i)
+	{
+		if (!frame->shown[i]->stamped && !frame->shown[i]->fence)
+			frame_stamp(frame->shown[i], timestamp, sequence);
+	}
+}
+
+/* present clients that are copied and know which vblank they went out on */
+static void frame_present_shown(struct server_context *ctx)
+{
+	struct output_frame *frame = &ctx->output->frame;
+	uint32_t i = 0;
+	while (i < frame->shown_count)
+	{
+		struct client *cl = frame->shown[i];
+		if (!cl->stamped || cl->fence) {
+			++i;
+			continue;
 		}
+		cl->vsync_wait = 0;
+		frame_present(ctx, cl, SPRITESYNC_FLAG_VBLANK);
+		frame->shown[i] = frame->shown[--frame->shown_count];
 	}
-	memset(cl->dmg, 0, sizeof(cl->dmg));
-	cl->dmg_count = 0;
+}
+
+static int frame_request_vblank(struct output *output)
+{
+	if (output->frame.vblank_armed)
+		return 0;
+	if (output->vblank(output))
+		return -1;
+	output->frame.vblank_armed = 1;
 	return 0;
 }
 
-int fb_drm_fd_callback(int fd, int event_flags, void *user_data)
+/* clients still copying when the last vblank passed need the next one */
+static void frame_stamp_later(struct server_context *ctx)
+{
+	struct output_frame *frame = &ctx->output->frame;
+	uint64_t now;
+	uint32_t i;
+
+	for (i = 0; i < frame->shown_count; ++i)
+	{
+		if (!frame->shown[i]->stamped)
+			break;
+	}
+	if (i == frame->shown_count || frame_request_vblank(ctx->output) == 0)
+		return;
+	/* no event is coming, present on the predicted vblank */
+	now = frame_sched_now();
+	for (i = 0; i < frame->shown_count; ++i)
+	{
+		if (!frame->shown[i]->stamped)
+			frame_stamp(frame->shown[i], now,
+				    frame_sched_sequence(&frame->sched, now));
+	}
+	frame_present_shown(ctx);
+}
+
+/* the copy never went out, tell the client so it stops waiting */
+static void frame_sync_failed(struct server_context *ctx, struct client *cl)
+{
+	struct spr16_msghdr hdr;
+	struct spr16_msgdata_ack data;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memset(&data, 0, sizeof(data));
+	hdr.type = SPRITEMSG_ACK;
+	data.info = SPRITENACK_SYNC;
+	cl->vsync_wait = 0;
+	cl->sync_time = 0;
+	spr16_server_send(ctx, cl, &hdr, &data, sizeof(data));
+}
+
+/* queue copies for every client in the frame, they stay in vsync_wait until
+ * shown. timestamp 0 leaves them for the next vblank to stamp, otherwise
+ * they are presented with timestamp and sequence once the copy is done.
+ * fence is 0 if nothing was queued */
+static int frame_flush(struct server_context *ctx,
+		       uint64_t timestamp,
+		       uint32_t sequence,
+		       uint32_t *fence)
+{
+	struct output_frame *frame = &ctx->output->frame;
+	const uint32_t first = frame->shown_count;
+	uint32_t count = frame->count;
+	uint32_t i;
+	int ret = 0;
+
+	frame->armed = FRAME_IDLE;
+	frame->count = 0;
+	frame->bytes = 0;
+	for (i = 0; i < count; ++i)
+	{
+		struct client *cl = frame->pending[i];
+		/* hidden screens wait until they are switched to */
+		if (ctx->main_screen == NULL
+				|| !screen_find_client(ctx->main_screen, cl->socket)) {
+			cl->vsync_wait = 0;
+			cl->sync_time = 0;
+			continue;
+		}
+		if (frame_copy(ctx, cl, ctx->output->front)) {
+			printf("frame copy(%d) failed\n", cl->socket);
+			frame_sync_failed(ctx, cl);
+			ret = -1;
+			continue;
+		}
+		frame->shown[frame->shown_count++] = cl;
+	}
+	*fence = 0;
+	if (first == frame->shown_count)
+		return ret;
+	*fence = compositor_fence();
+	for (i = first; i < frame->shown_count; ++i)
+	{
+		frame->shown[i]->fence = *fence;
+		if (timestamp)
+			frame_stamp(frame->shown[i], timestamp, sequence);
+	}
+	return ret;
+}
+
+static int frame_flush_now(struct server_context *ctx, uint64_t timestamp)
+{
+	struct output_frame *frame = &ctx->output->frame;
+	uint32_t fence;
+	return frame_flush(ctx, timestamp,
+			   frame_sched_sequence(&frame->sched, timestamp), &fence);
+}
+
+/* copy at the deadline if the vblank clock is known, otherwise on the event */
+static int frame_arm(struct server_context *ctx, uint64_t bytes)
+{
+	struct output *output = ctx->output;
+	struct output_frame *frame = &output->frame;
+	struct itimerspec its;
+	uint64_t deadline = 0;
+	uint64_t target = 0;
+
+	frame->bytes += bytes;
+	if (frame->timer_fd != -1)
+		deadline = frame_sched_deadline(&frame->sched, frame_sched_now(),
+						frame->bytes, &target);
+	if (deadline == 0) {
+		if (frame->armed)
+			return 0;
+		if (frame_request_vblank(output)) {
+			/* no event is coming, don't leave anyone waiting */
+			return frame_flush_now(ctx, frame_sched_now());
+		}
+		frame->armed = FRAME_VBLANK;
+		return 0;
+	}
+
+	/* more damage joined, move the timer up if it needs more time */
+	if (frame->armed == FRAME_VBLANK
+			|| (frame->armed == FRAME_DEADLINE && deadline >= frame->deadline))
+		return 0;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec  = deadline / FRAME_SCHED_NSEC;
+	its.it_value.tv_nsec = deadline % FRAME_SCHED_NSEC;
+	if (timerfd_settime(frame->timer_fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+		printf("timerfd_settime: %s\n", strerror(errno));
+		return frame_flush_now(ctx, frame_sched_now());
+	}
+	frame->armed = FRAME_DEADLINE;
+	frame->deadline = deadline;
+	frame->target = target;
+	/* timestamp of the vblank we aim for corrects the next prediction */
+	frame_request_vblank(output);
+	return 0;
+}
+
+/* put cl in the next frame, only the first client arms a vblank event */
+static int frame_add(struct server_context *ctx, struct client *cl)
+{
+	struct output_frame *frame = &ctx->output->frame;
+	uint64_t bytes = 0;
+
+	if (cl->vsync_wait)
+		return 0;
+	if (frame->count >= SPR16_MAXCLIENTS)
+		return -1;
+	frame->pending[frame->count++] = cl;
+	cl->vsync_wait = 1;
+	if (cl->dmg && cl->on_plane != 1)
+		bytes = (uint64_t)dmg_tiles_count(cl->dmg) * DMG_TILE_SIZE
+				* DMG_TILE_SIZE * (ctx->fb->bpp/8);
+	return frame_arm(ctx, bytes);
+}
+
+void fb_frame_remove(struct server_context *ctx, struct client *cl)
+{
+	struct output_frame *frame = &ctx->output->frame;
+	uint32_t i;
+
+	cl->fence = 0;
+	cl->stamped = 0;
+	if (!cl->vsync_wait)
+		return;
+	cl->vsync_wait = 0;
+	for (i = 0; i < frame->count; ++i)
+	{
+		if (frame->pending[i] == cl) {
+			frame->pending[i] = frame->pending[--frame->count];
+			return;
+		}
+	}
+	for (i = 0; i < frame->shown_count; ++i)
+	{
+		if (frame->shown[i] == cl) {
+			frame->shown[i] = frame->shown[--frame->shown_count];
+			return;
+		}
+	}
+}
+
+int fb_vblank(struct server_context *ctx, uint64_t timestamp, uint32_t sequence)
+{
+	struct output_frame *frame = &ctx->output->frame;
+	uint32_t fence;
+	int ret = 0;
+
+	frame->vblank_armed = 0;
+	frame_sched_vblank(&frame->sched, timestamp, sequence);
+	/* copied at the deadline, this is the vblank they made it to */
+	frame_stamp_shown(frame, timestamp, sequence);
+	if (frame->armed == FRAME_VBLANK)
+		ret = frame_flush(ctx, timestamp, sequence, &fence);
+	frame_present_shown(ctx);
+	frame_stamp_later(ctx);
+	return ret;
+}
+
+static int frame_timer_callback(int fd, int event_flags, void *user_data)
 {
-	/* kernel drm_file.c advises 4K buffer since read only returns 1 event */
-	char buf[4096];
-	struct drm_event *event;
-	int r;
-	unsigned int pos = 0;
-	int has_syncd = 0;
 	struct server_context *ctx = user_data;
+	struct output_frame *frame = &ctx->output->frame;
+	uint64_t expirations;
+	uint64_t start;
+	uint32_t fence;
+	int r;
 
 	if (event_flags & (FDPOLLHUP | FDPOLLERR)) {
-		printf("drm fd HUP/ERR\n");
+		printf("frame timerfd HUP/ERR\n");
 		return FDPOLL_HANDLER_REMOVE;
 	}
-
 	do {
-		r = read(fd, buf, sizeof(buf));
+		r = read(fd, &expirations, sizeof(expirations));
 	} while (r == -1 && errno == EINTR);
+	if (r == -1 && errno == EAGAIN)
+		return FDPOLL_HANDLER_OK;
+	if (r != sizeof(expirations)) {
+		printf("frame timerfd read: %s\n", strerror(errno));
+		return FDPOLL_HANDLER_REMOVE;
+	}
+	if (frame->armed != FRAME_DEADLINE)
+		return FDPOLL_HANDLER_OK;
+
+	g_copied = 0;
+	start = frame_sched_now();
+	if (frame_flush(ctx, 0, 0, &fence))
+		printf("frame flush failed\n");
+	/* timed from here until the compositor finishes the copy */
+	if (fence && !frame->sched_fence) {
+		frame->sched_fence  = fence;
+		frame->sched_start  = start;
+		frame->sched_bytes  = g_copied;
+		frame->sched_target = frame->target;
+	}
+	/* the event armed with the deadline may have been for an earlier vblank */
+	frame_stamp_later(ctx);
+	return FDPOLL_HANDLER_OK;
+}
 
-	if (r < 0) {
-		printf("drm_handle_events, read: %s\n", strerror(errno));
+static void frame_flip_submit(struct server_context *ctx, uint64_t timestamp);
+
+/* everything queued up to fence has been written to scanout */
+static void frame_fence_done(struct server_context *ctx,
+			     uint32_t fence,
+			     uint64_t timestamp)
+{
+	struct output_frame *frame = &ctx->output->frame;
+	uint32_t missed = 0;
+	uint32_t i;
+
+	if (frame->sched_fence && COMPOSITOR_FENCE_BEFORE(frame->sched_fence, fence)) {
+		if (frame_sched_done(&frame->sched, frame->sched_start, timestamp,
+				     frame->sched_bytes, frame->sched_target)) {
+			missed = frame->sched_fence;
+			/* power of two counts, so a slow machine doesn't spam */
+			if ((frame->sched.misses & (frame->sched.misses - 1)) == 0)
+				printf("frame scheduler missed %d of %d vblanks\n",
+						frame->sched.misses, frame->sched.frames);
+		}
+		frame->sched_fence = 0;
+	}
+	for (i = 0; i < frame->shown_count; ++i)
+	{
+		struct client *cl = frame->shown[i];
+		if (!cl->fence || !COMPOSITOR_FENCE_BEFORE(cl->fence, fence))
+			continue;
+		if (missed && cl->fence == missed)
+			++cl->present.dropped;
+		cl->present.copy_us = (timestamp - cl->copy_time) / 1000;
+		cl->fence = 0;
+	}
+	if (frame->flip_fence && COMPOSITOR_FENCE_BEFORE(frame->flip_fence, fence)) {
+		frame->flip_fence = 0;
+		frame_flip_submit(ctx, timestamp);
+	}
+}
+
+static int frame_fence_callback(int fd, int event_flags, void *user_data)
+{
+	struct server_context *ctx = user_data;
+	uint64_t count;
+	uint64_t timestamp;
+	uint32_t fence;
+	int r;
+
+	if (event_flags & (FDPOLLHUP | FDPOLLERR)) {
+		printf("compositor fd HUP/ERR\n");
 		return FDPOLL_HANDLER_REMOVE;
 	}
-	else if (r < (int)sizeof(struct drm_event)) {
-		printf("drm_handle_events, read size error");
+	do {
+		r = read(fd, &count, sizeof(count));
+	} while (r == -1 && errno == EINTR);
+	if (r == -1 && errno != EAGAIN) {
+		printf("compositor fd read: %s\n", strerror(errno));
 		return FDPOLL_HANDLER_REMOVE;
 	}
+	while (compositor_done(&fence, &timestamp))
+	{
+		frame_fence_done(ctx, fence, timestamp);
+	}
+	frame_present_shown(ctx);
+	frame_stamp_later(ctx);
+	return FDPOLL_HANDLER_OK;
+}
+
+int fb_frame_init(struct server_context *ctx, int deadline)
+{
+	struct output_frame *frame = &ctx->output->frame;
+
+	frame_sched_init(&frame->sched, ctx->output->refresh);
+	frame->timer_fd = -1;
+	g_compose = malloc(ctx->fb->width * 4 * COMPOSE_ROWS);
+	if (g_compose == NULL) {
+		printf("could not allocate compose buffer\n");
+		return -1;
+	}
+	if (fdpoll_handler_add(ctx->fdpoll, compositor_fd(), FDPOLLIN,
+				frame_fence_callback, ctx)) {
+		printf("fdpoll_handler_add(%d) failed\n", compositor_fd());
+		goto err;
+	}
+	if (!deadline)
+		return 0;
+	frame->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
+	if (frame->timer_fd == -1) {
+		printf("timerfd_create: %s\n", strerror(errno));
+		goto err_remove;
+	}
+	if (fdpoll_handler_add(ctx->fdpoll, frame->timer_fd, FDPOLLIN,
+				frame_timer_callback, ctx)) {
+		printf("fdpoll_handler_add(%d) failed\n", frame->timer_fd);
+		close(frame->timer_fd);
+		frame->timer_fd = -1;
+		goto err_remove;
+	}
+	return 0;
+err_remove:
+	fdpoll_handler_remove(ctx->fdpoll, compositor_fd());
+err:
+	free(g_compose);
+	g_compose = NULL;
+	return -1;
+}
+
+void fb_frame_shutdown(struct server_context *ctx)
+{
+	struct output_frame *frame = &ctx->output->frame;
+
+	/* the compose buffer may still be referenced by queued operations */
+	compositor_wait();
+	free(g_compose);
+	g_compose = NULL;
+	fdpoll_handler_remove(ctx->fdpoll, compositor_fd());
+	if (frame->timer_fd == -1)
+		return;
+	printf("frame scheduler: %d frames, %d missed, %d ps/byte\n",
+			frame->sched.frames, frame->sched.misses,
+			frame->sched.ps_per_byte);
+	fdpoll_handler_remove(ctx->fdpoll, frame->timer_fd);
+	close(frame->timer_fd);
+	frame->timer_fd = -1;
+}
+
+/* every sprite on screen goes into the back buffer, not just the ones that
+ * asked for the flip, or it would show up with that buffer's stale content.
+ * the flip itself is submitted when the compositor is done copying */
+static int fb_flip(struct server_context *ctx)
+{
+	struct output *output = ctx->output;
+	struct client *cl;
+	uint32_t fence;
+	int ret = 0;
+
+	for (cl = ctx->main_screen->clients; cl; cl = cl->next)
+	{
+		if (frame_copy(ctx, cl, output->front ^ 1))
+			ret = -1;
+		cl->flip_wait = cl->flip_queued;
+		cl->flip_queued = 0;
+	}
+	fence = compositor_fence();
+	for (cl = ctx->main_screen->clients; cl; cl = cl->next)
+	{
+		if (cl->flip_wait)
+			cl->fence = fence;
+	}
+	output->frame.flip_fence = fence;
+	return ret;
+}
 
-	while (pos < (unsigned int)r)
+static void frame_flip_submit(struct server_context *ctx, uint64_t timestamp)
+{
+	struct output *output = ctx->output;
+	struct client *cl;
+
+	if (ctx->main_screen == NULL)
+		return;
+	for (cl = ctx->main_screen->clients; cl; cl = cl->next)
 	{
-		if (pos > r - sizeof(struct drm_event)) {
-			printf("event size error\n");
-			return FDPOLL_HANDLER_REMOVE;
+		if (cl->flip_wait && cl->fence) {
+			cl->present.copy_us = (timestamp - cl->copy_time) / 1000;
+			cl->fence = 0;
 		}
-		event = (struct drm_event *)(buf+pos);
-		if (pos > r - event->length) {
-			printf("event length error\n");
-			return FDPOLL_HANDLER_REMOVE;
+	}
+	if (spr16_server_is_active() && output->flip(output) == 0)
+		return;
+	/* front still has it's own age damage, copy on next vblank. anyone
+	 * that queued behind this flip would wait on a flip that never comes */
+	for (cl = ctx->main_screen->clients; cl; cl = cl->next)
+	{
+		if ((cl->flip_wait || cl->flip_queued) && frame_add(ctx, cl))
+			printf("frame_add(%d) failed\n", cl->socket);
+		cl->flip_wait = 0;
+		cl->flip_queued = 0;
+	}
+}
+
+int fb_flip_complete(struct server_context *ctx, uint64_t timestamp, uint32_t sequence)
+{
+	struct client *cl;
+	int queued = 0;
+
+	frame_sched_vblank(&ctx->output->frame.sched, timestamp, sequence);
+	if (ctx->main_screen == NULL)
+		return 0;
+	for (cl = ctx->main_screen->clients; cl; cl = cl->next)
+	{
+		if (cl->flip_wait) {
+			cl->flip_wait = 0;
+			frame_stamp(cl, timestamp, sequence);
+			frame_present(ctx, cl, SPRITESYNC_FLAG_PAGE_FLIP);
 		}
+		queued |= cl->flip_queued;
+	}
+	if (queued && spr16_server_is_active())
+		return fb_flip(ctx);
+	return 0;
+}
 
-		switch (event->type)
+/* planes sit above the composited framebuffer, so only sprites that have
+ * nothing above them can go there. translucent sprites stay composited */
+static int plane_eligible(struct server_context *ctx, struct client *cl)
+{
+	struct spr16_msgdata_sync rect;
+
+	if (cl->on_plane == -1 || cl->sprite.bpp != 32 || cl->sprite.scale > 1
+			|| (cl->sprite.flags & (SPRITE_FLAG_DIRECT_SHM
+						|SPRITE_FLAG_TRANSLUCENT)))
+		return 0;
+	if (cl->sprite.x < 0 || cl->sprite.y < 0
+			|| cl->sprite.x + cl->sprite.width > ctx->fb->width
+			|| cl->sprite.y + cl->sprite.height > ctx->fb->height)
+		return 0;
+	rect.xmin = cl->sprite.x;
+	rect.ymin = cl->sprite.y;
+	rect.xmax = cl->sprite.x + cl->sprite.width - 1;
+	rect.ymax = cl->sprite.y + cl->sprite.height - 1;
+	return !screen_sprite_above(ctx->main_screen, cl, &rect, 0);
+}
+
+int fb_assign_planes(struct server_context *ctx)
+{
+	struct output *output = ctx->output;
+	struct screen *scrn;
+	struct client *cl;
+	int changed = 0;
+
+	for (scrn = ctx->main_screen; scrn; scrn = scrn->next)
+	{
+		for (cl = scrn->clients; cl; cl = cl->next)
 		{
-		case DRM_EVENT_VBLANK:
-			if (ctx == NULL) {
-				return FDPOLL_HANDLER_REMOVE;
-			}
-			if (!has_syncd && ctx->main_screen) {
-				struct client *cl;
-				cl = ctx->main_screen->clients;
-				if (cl && sync_dmg_to_fb(ctx, cl) == 0) {
-					spr16_send_ack(cl->socket, SPRITEACK_SYNC_VSYNC);
-					has_syncd = 1;
-				}
-			}
-			break;
+			if (cl->on_plane != 1)
+				continue;
+			if (scrn == ctx->main_screen && spr16_server_is_active()
+					&& plane_eligible(ctx, cl))
+				continue;
+			output->plane_detach(output, cl);
+			cl->on_plane = 0;
+			changed = 1;
+		}
+	}
+	if (ctx->main_screen == NULL || !spr16_server_is_active())
+		return changed;
 
-		case DRM_EVENT_FLIP_COMPLETE:
-				printf("DRM_EVENT_FLIP_COMPLETE\n");
-			/*g_waiting_for_flip = 0; DO NOT exit while waiting for a flip*/
+	for (cl = ctx->main_screen->clients; cl; cl = cl->next)
+	{
+		if (output->plane_attach == NULL)
 			break;
-
+		if (cl->on_plane || !plane_eligible(ctx, cl))
+			continue;
+		/* don't keep retrying a buffer the driver refused */
+		switch (output->plane_attach(output, cl))
+		{
+		case 0:
+			cl->on_plane = 1;
+			break;
+		case 1:
+			return changed;
 		default:
-			printf("unknown drm event received: %d\n", event->type);
+			cl->on_plane = -1;
 			break;
 		}
-		pos += event->length;
 	}
-	return FDPOLL_HANDLER_OK;
+	return changed;
 }
 
-/* note: page flipping will require drm master, which is dropped when vt is switched
- * also, there is a race condition, if flip is issued and the program exits screen
- * will lock up since it's still being referenced mid switch, or something...
- * */
-static int drm_vblank(struct drm_kms *self)
+/* fill framebuffer where no sprite on main screen covers it */
+void fb_clear_background(struct server_context *ctx)
 {
-	struct drm_wait_vblank_request vblank;
-	int retry;
-	memset(&vblank, 0, sizeof(vblank));
-	vblank.type = _DRM_VBLANK_RELATIVE | _DRM_VBLANK_EVENT;
-	vblank.sequence = 1;
-
-	for (retry = 5000; retry >= 0; --retry)
+	struct spr16_framebuffer *fb = ctx->fb;
+	struct spr16_msgdata_sync rect;
+	const uint32_t weight = fb->bpp/8;
+	uint32_t count;
+	uint32_t i;
+
+	if (ctx->main_screen == NULL || !spr16_server_is_active())
+		return;
+	rect.xmin = 0;
+	rect.ymin = 0;
+	rect.xmax = fb->width - 1;
+	rect.ymax = fb->height - 1;
+	count = screen_visible_rects(ctx->main_screen, NULL, &rect, g_visible);
+	for (i = 0; i < count; ++i)
 	{
-		int r = ioctl(self->card_fd, DRM_IOCTL_WAIT_VBLANK, &vblank);
-		if (r == 0)
-			break;
-		else if (r == -1 && errno == EINTR)
-			continue;
-
-		printf("ioctl(DRM_IOCTL_WAIT_VBLANK): %s\n", strerror(errno));
-		return 0;
-		/*return -1;*/
+		const uint32_t offset = (g_visible[i].ymin * fb->pitch)
+					+ (g_visible[i].xmin * weight);
+		const uint32_t width = (g_visible[i].xmax - g_visible[i].xmin + 1) * weight;
+		const uint32_t height = g_visible[i].ymax - g_visible[i].ymin + 1;
+		compositor_fill(fb->addr + offset, fb->pitch, width, height);
+		if (ctx->output->back)
+			compositor_fill(ctx->output->back + offset, fb->pitch, width, height);
 	}
-	return 0;
+	compositor_kick();
 }
 
 int fb_sync_client(struct server_context *ctx, struct client *cl)
 {
 
+	if ((cl->sync_flags & (SPRITESYNC_FLAG_VBLANK|SPRITESYNC_FLAG_PAGE_FLIP))
+			&& !cl->sync_time)
+		cl->sync_time = frame_sched_now();
+
 	if (cl->sync_flags & SPRITESYNC_FLAG_VBLANK) {
 		if (spr16_server_is_active()) {
-			return drm_vblank(ctx->card0);
+			return frame_add(ctx, cl);
 		}
 	}
 	else if (cl->sync_flags & SPRITESYNC_FLAG_PAGE_FLIP) {
-		printf("page flip not implemented\n");
-		return -1;
+		if (!spr16_server_is_active())
+			return 0;
+		if (ctx->output->flip == NULL || cl->age[0] == NULL)
+			return frame_add(ctx, cl);
+		cl->flip_queued = 1;
+		if (ctx->output->flip_pending || ctx->output->frame.flip_fence
+				|| ctx->main_screen == NULL
+				|| !screen_find_client(ctx->main_screen, cl->socket))
+			return 0;
+		return fb_flip(ctx);
 	}
 	else if (cl->sync_flags & SPRITESYNC_FLAG_ASYNC) {
-		if (!spr16_server_is_active()) {
+		if (spr16_server_is_active()) {
 			return sync_dmg_to_fb(ctx, cl);
 		}
 	}
@@ -20,6 +20,7 @@
 #define LINUX_FB_H__
 
 #include "../../spr16.h"
+#include "../../defines.h"
 #include "platform.h"
 
 /* aligns sync rectangle to grid
@@ -29,16 +30,30 @@
  * but is no good @24bpp, which is currently left unsupported
  *
  * large grid alignment does more harm than good on older cpu's
- * that do not support the newer instructions, repl movsb instruction
- * should probably be used for anything that supports it? i don't have
- * any such space-age hardware to test these theories.
+ * that do not support the newer instructions. the copy kernel itself
+ * (sse2, avx2, avx512, rep movsb) is picked at runtime in platform/blit.c,
+ * widths and pitches off the grid get their row edges copied separately.
  */
 
-#ifndef PIXL_ALIGN
-#define PIXL_ALIGN 16 /* right now this is kind of hacked up, 32 will use
-			 xmm sse2 instructions, for generic memcpy set this to 16 */
-#endif
-int fb_drm_fd_callback(int fd, int event_flags, void *user_data);
+/* PIXL_ALIGN defaults to 16 in defines.h */
+/* deadline 0 copies vblank syncs when the event arrives, otherwise a timer
+ * fires just before the predicted vblank */
+int fb_frame_init(struct server_context *ctx, int deadline);
+void fb_frame_shutdown(struct server_context *ctx);
+/* output backend got the vblank it was asked for, timestamp is in ns on
+ * CLOCK_MONOTONIC. presents what was copied at the deadline, or queues the
+ * frame if it was waiting on this event. clients are presented when their
+ * compositor fence completes */
+int fb_vblank(struct server_context *ctx, uint64_t timestamp, uint32_t sequence);
+/* call before freeing a client that may be in the frame */
+void fb_frame_remove(struct server_context *ctx, struct client *cl);
+/* flip requested by fb_sync_client is now on screen */
+int fb_flip_complete(struct server_context *ctx, uint64_t timestamp, uint32_t sequence);
+/* move sprites on and off overlay planes, call when the screen changes.
+ * returns 1 if a sprite came off a plane and has to be composited again */
+int fb_assign_planes(struct server_context *ctx);
+/* clear the parts of the screen no sprite covers */
+void fb_clear_background(struct server_context *ctx);
 int fb_sync_client(struct server_context *ctx, struct client *cl);
 
 #endif
@@ -0,0 +1,98 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <string.h>
+#include "frame-sched.h"
+
+/* ~5GB/s until measured */
+#define DEFAULT_PS_PER_BYTE 200
+
+uint64_t frame_sched_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * FRAME_SCHED_NSEC) + ts.tv_nsec;
+}
+
+void frame_sched_init(struct frame_sched *self, uint16_t refresh)
+{
+	memset(self, 0, sizeof(struct frame_sched));
+	if (!refresh)
+		refresh = 60;
+	self->period = FRAME_SCHED_NSEC / refresh;
+	self->ps_per_byte = DEFAULT_PS_PER_BYTE;
+}
+
+void frame_sched_vblank(struct frame_sched *self, uint64_t ts, uint32_t seq)
+{
+	if (self->last_vblank && ts > self->last_vblank && seq != self->last_seq) {
+		const uint64_t sample = (ts - self->last_vblank)
+					/ (uint32_t)(seq - self->last_seq);
+		/* ignore anything way off, like a mode change */
+		if (sample > self->period / 2 && sample < self->period * 2)
+			self->period = ((self->period * 7) + sample) / 8;
+	}
+	self->last_vblank = ts;
+	self->last_seq = seq;
+}
+
+uint64_t frame_sched_deadline(struct frame_sched *self, uint64_t now,
+			      uint64_t bytes, uint64_t *target)
+{
+	uint64_t cost;
+	uint64_t vblanks;
+
+	if (!self->last_vblank || now < self->last_vblank
+			|| now - self->last_vblank > self->period * FRAME_SCHED_STALE)
+		return 0;
+	if (bytes < self->bytes_avg)
+		bytes = self->bytes_avg;
+	cost = ((bytes * self->ps_per_byte) / 1000) + FRAME_SCHED_MARGIN;
+
+	/* first vblank we can still make */
+	vblanks = ((now + cost - self->last_vblank) / self->period) + 1;
+	*target = self->last_vblank + (vblanks * self->period);
+	return *target - cost;
+}
+
+uint32_t frame_sched_sequence(struct frame_sched *self, uint64_t ts)
+{
+	if (!self->last_vblank)
+		return 0;
+	if (ts <= self->last_vblank)
+		return self->last_seq;
+	return self->last_seq + (uint32_t)(((ts - self->last_vblank)
+				+ (self->period / 2)) / self->period);
+}
+
+int frame_sched_done(struct frame_sched *self, uint64_t start, uint64_t end,
+		     uint64_t bytes, uint64_t target)
+{
+	++self->frames;
+	self->bytes_avg = ((self->bytes_avg * 7) + bytes) / 8;
+	/* tiny copies are mostly call overhead */
+	if (bytes >= 65536 && end > start) {
+		const uint64_t sample = ((end - start) * 1000) / bytes;
+		self->ps_per_byte = ((self->ps_per_byte * 7) + sample) / 8;
+	}
+	if (target && end > target) {
+		++self->misses;
+		return 1;
+	}
+	return 0;
+}
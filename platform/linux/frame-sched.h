@@ -0,0 +1,59 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * frame deadline prediction. vblank timestamps give the display clock, the
+ * period is a moving average of their spacing. copies are timed to keep a
+ * moving average of cost per byte, a frame is composed at the last moment
+ * that should still finish before the vblank it is aiming for. composing
+ * late means clients get the most time to render, and the copy never races
+ * the scanout of the frame being replaced.
+ */
+
+#ifndef LINUX_FRAME_SCHED_H__
+#define LINUX_FRAME_SCHED_H__
+
+#include <stdint.h>
+
+#define FRAME_SCHED_NSEC   ((uint64_t)1000000000)
+/* timer wakeup slop added to every estimate */
+#define FRAME_SCHED_MARGIN 1000000
+/* vblank clock older than this many periods is not trusted */
+#define FRAME_SCHED_STALE  16
+
+struct frame_sched {
+	uint64_t last_vblank; /* ns CLOCK_MONOTONIC, 0 until first vblank */
+	uint64_t period;      /* ns */
+	uint64_t bytes_avg;   /* bytes copied per frame */
+	uint32_t last_seq;
+	uint32_t ps_per_byte; /* copy cost in picoseconds */
+	uint32_t frames;
+	uint32_t misses;      /* frames that finished after their vblank */
+};
+
+uint64_t frame_sched_now();
+void frame_sched_init(struct frame_sched *self, uint16_t refresh);
+void frame_sched_vblank(struct frame_sched *self, uint64_t ts, uint32_t seq);
+/* when to start copying bytes so they make the first vblank they still can,
+ * that vblank is returned in target. 0 if there is no recent vblank to
+ * predict from */
+uint64_t frame_sched_deadline(struct frame_sched *self, uint64_t now,
+			      uint64_t bytes, uint64_t *target);
+/* predicted vblank sequence at ts, 0 if there is no clock yet */
+uint32_t frame_sched_sequence(struct frame_sched *self, uint64_t ts);
+/* copy of bytes ran from start to end, returns 1 if target was missed */
+int frame_sched_done(struct frame_sched *self, uint64_t start, uint64_t end,
+		     uint64_t bytes, uint64_t target);
+
+#endif
@@ -145,19 +145,28 @@ int generic_flush(struct input_device *self)
 	return -1;
 }
 
-static int get_focused_client(struct server_context *ctx)
+static struct client *get_focused_client(struct server_context *ctx)
 {
 
 	if (g_input_muted || !ctx->main_screen || !ctx->main_screen->clients) {
-		return -1;
+		return NULL;
 	}
 	else {
 		if (ctx->main_screen->clients->recv_fd_wait)
-			return -1;
-		return ctx->main_screen->clients->socket;
+			return NULL;
+		return ctx->main_screen->clients;
 	}
 }
 
+/* goes nowhere if nobody has focus, staged until the input frame is done */
+static int stage_input(struct server_context *ctx, struct client *cl,
+		       struct spr16_msghdr *hdr, void *msgdata, size_t msgdata_len)
+{
+	if (cl == NULL)
+		return 0;
+	return spr16_server_stage(ctx, cl, hdr, msgdata, msgdata_len);
+}
+
 static int bit_count(unsigned long bits[], unsigned int nlongs)
 {
 	int count = 0;
@@ -219,7 +228,7 @@ static int update_state(struct server_context *ctx)
 		g_input_muted = 0;
 
 		if (ctx->main_screen && ctx->main_screen->clients)
-			spr16_server_reset_client(ctx->main_screen->clients);
+			spr16_server_reset_client(ctx, ctx->main_screen->clients);
 		if (input_flush_all_devices(ctx->input_devices))
 			return -1;
 		server_sync_fullscreen(ctx);
@@ -242,10 +251,10 @@ int transceive_ascii(int fd, int event_flags, void *user_data)
 	unsigned char buf[1024];
 	int i, r;
 	struct input_device *self = user_data;
-	int cl_fd;
+	struct client *cl;
 
 	printf("ascii input callback..........\n");
-	cl_fd = get_focused_client(self->srv_ctx); /* TODO this doesn't get set yet */
+	cl = get_focused_client(self->srv_ctx); /* TODO this doesn't get set yet */
 	update_state(self->srv_ctx);
 
 	/* TODO for correctness, loop until EAGAIN */
@@ -264,7 +273,7 @@ interrupted:
 	}
 	if (!spr16_server_is_active())
 		return FDPOLL_HANDLER_OK;
-	if (cl_fd != -1) {
+	if (cl != NULL) {
 		/* 1 char == 1 keycode */
 		for (i = 0; i < r; ++i)
 		{
@@ -274,10 +283,12 @@ interrupted:
 			data.code = buf[i];
 			data.type = SPR16_INPUT_KEY_ASCII;
 			data.id = self->device_id;
-			if (spr16_write_msg(cl_fd, &hdr, &data, sizeof(data))) {
+			if (spr16_server_stage(self->srv_ctx, cl, &hdr,
+						&data, sizeof(data))) {
 				return FDPOLL_HANDLER_OK;
 			}
 		}
+		spr16_server_commit(self->srv_ctx, cl);
 	}
 	return FDPOLL_HANDLER_OK;
 }
@@ -754,7 +765,8 @@ static int get_id(int *id_array, int contact)
 }
 
 /* returns number of surface events consumed */
-static unsigned int consume_surface_report(struct input_device *self, int client,
+static unsigned int consume_surface_report(struct input_device *self,
+					   struct client *client,
 					   struct input_event *events, unsigned int i,
 					   unsigned int count)
 {
@@ -793,7 +805,7 @@ static unsigned int consume_surface_report(struct input_device *self, int client
 			data.ypos = pvt->contact_y[active_contact];
 			data.xmax = pvt->contact_xmax;
 			data.ymax = pvt->contact_ymax;
-			spr16_write_msg(client, &hdr, &data, sizeof(data));
+			stage_input(self->srv_ctx, client, &hdr, &data, sizeof(data));
 			memset(&data, 0, sizeof(data));
 			send_msg = 0;
 		}
@@ -827,7 +839,7 @@ static unsigned int consume_surface_report(struct input_device *self, int client
 			data.ypos = pvt->contact_y[active_contact];
 			data.xmax = pvt->contact_xmax;
 			data.ymax = pvt->contact_ymax;
-			spr16_write_msg(client, &hdr, &data, sizeof(data));
+			stage_input(self->srv_ctx, client, &hdr, &data, sizeof(data));
 			memset(&data, 0, sizeof(data));
 			send_msg = 0;
 			active_id = set_id(pvt->contact_ids, active_contact, -1);
@@ -924,7 +936,7 @@ static unsigned int consume_surface_report(struct input_device *self, int client
 				data.ypos = pvt->contact_y[active_contact];
 				data.xmax = pvt->contact_xmax;
 				data.ymax = pvt->contact_ymax;
-				spr16_write_msg(client, &hdr, &data, sizeof(data));
+				stage_input(self->srv_ctx, client, &hdr, &data, sizeof(data));
 				memset(&data, 0, sizeof(data));
 				send_msg = 0;
 			}
@@ -948,7 +960,7 @@ ret_out:
 int transceive_evdev(int fd, int event_flags, void *user_data)
 {
 	struct input_device *self = user_data;
-	int cl_fd;
+	struct client *cl;
 	/* TODO gui+config file settings for these */
 	const float min_delta = 0.000075f; /* % of surface */
 	const float max_delta = 1.0f;
@@ -960,7 +972,7 @@ int transceive_evdev(int fd, int event_flags, void *user_data)
 	int r;
 
 
-	cl_fd = get_focused_client(self->srv_ctx);
+	cl = get_focused_client(self->srv_ctx);
 	update_state(self->srv_ctx);
 
 	/* TODO for correctness loop until EAGAIN */
@@ -1044,7 +1056,7 @@ interrupted:
 			data.val  = event->value;
 			/* multi-touch surface */
 			if (data.code >= ABS_MT_SLOT && data.code <= ABS_MT_TOOL_Y) {
-				i+= consume_surface_report(self,cl_fd,events,i,count);
+				i+= consume_surface_report(self,cl,events,i,count);
 				continue;
 			}
 			else if (data.code >= ABS_CNT) {
@@ -1066,25 +1078,24 @@ interrupted:
 			if (event->code == SYN_DROPPED) {
 				printf("SYN DROPPED\n");
 			}
+			/* everything since the last report goes out together */
+			else if (event->code == SYN_REPORT && cl != NULL) {
+				if (spr16_server_commit(self->srv_ctx, cl))
+					return FDPOLL_HANDLER_OK;
+			}
 			continue;
 		default:
 			continue;
 		}
 
-		if (cl_fd == -1) {
+		if (cl == NULL) {
 			return FDPOLL_HANDLER_OK; /* TODO this is prolly wrong,
 						     should continue to check
 				     	for SYN_DROPPED and change state if needed.
 				     	how to test that?? */
 		}
-		if (spr16_write_msg(cl_fd, &hdr, &data, sizeof(data))) {
-			/* FIXME eagain will end up dropping events,
-			 *
-			 * message functions could be handled a little better,
-			 * like a peer object that can buffer events to handle eagain.
-			 * and send all messages once instead of multiple syscalls.
-			 */
-			/*return (errno == EAGAIN) ? 0 : -1;*/
+		/* fails if the client is being dropped */
+		if (spr16_server_stage(self->srv_ctx, cl, &hdr, &data, sizeof(data))) {
 			return FDPOLL_HANDLER_OK;
 		}
 	}
@@ -1101,13 +1112,14 @@ interrupted:
 			data.code = SPR16_KEYCODE_CONTACT;
 			data.val  = 1;
 			pvt->has_tapped = 1;
-			if (spr16_write_msg(cl_fd, &hdr, &data, sizeof(data))) {
-				/* FIXME too  ^^ */
-				/*return (errno == EAGAIN) ? 0 : -1;*/
+			if (stage_input(self->srv_ctx, cl, &hdr, &data, sizeof(data))) {
 				return FDPOLL_HANDLER_OK;
 			}
 		}
 	}
+	/* report cut off by the end of the read, don't hold it back */
+	if (cl != NULL)
+		spr16_server_commit(self->srv_ctx, cl);
 	return FDPOLL_HANDLER_OK;
 }
 
@@ -24,24 +24,82 @@
  * start flying over the socket, i suppose this could be a future problem, but i
  * don't think there is any good reason to be transfering fd's after handshake?
  *
+ * message rings: a sealed memfd holds a single producer single consumer ring
+ * for each direction, and an idle flag for each consumer. a consumer sets
+ * it's flag right before it goes back to sleep, the producer only writes the
+ * eventfd doorbell if it can take that flag back, so while the peer is busy
+ * messages cost no syscalls at all. once a ring is attached to a socket,
+ * spr16_write_msg goes through it and a full ring is EAGAIN, like a full
+ * socket buffer. a producer that finds the ring full sets a blocked flag the
+ * same way, and the consumer rings back once it has made room. the socket
+ * stays open for hangup and fd passing.
+ *
+ * the peer can scribble over the whole mapping, so slot count and size are
+ * constants here instead of read from the ring, each side keeps a private
+ * copy of the index it owns, and messages are copied out of their slot
+ * before anything looks at them.
  */
 
 #define _GNU_SOURCE
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include "../../spr16.h"
+#include "../spsc.h"
 
 #define STRERR strerror(errno)
 
-/* leave room for truncated message */
-#define MAX_MSGBUF_READ ((SPR16_MAXMSGLEN * 16) - SPR16_MAXMSGLEN)
-#define MIN_MSGBUF_READ (sizeof(struct spr16_msghdr)+2)
-char g_msgbuf[MAX_MSGBUF_READ+SPR16_MAXMSGLEN];
+/* a few of the longest messages, the unread part only moves back to the
+ * front once there is less than one of them left to read into */
+#define RXBUF_SIZE ((uint32_t)SPR16_MAXVARMSGLEN * 4)
+
+#define MSGRING_SLOTS 256 /* power of two */
+#define MSGRING_BYTES (sizeof(struct spsc_ring) + (MSGRING_SLOTS * SPR16_MAXMSGLEN))
+#define MSGRING_MAXFD 1024
+
+/* messages longer than a slot take consecutive slots */
+#define MSGRING_MSGSLOTS(len) (((len) + SPR16_MAXMSGLEN - 1) / SPR16_MAXMSGLEN)
+
+/* ring 0 is server to client, ring 1 client to server, they follow this */
+struct msgring_shm {
+	uint32_t flags[4 * (SPSC_CACHELINE / sizeof(uint32_t))];
+};
+#define MSGRING_FLAG(shm, i) (&(shm)->flags[(i) * (SPSC_CACHELINE / sizeof(uint32_t))])
+#define MSGRING_IDLE(shm, n)    MSGRING_FLAG(shm, (n))
+#define MSGRING_BLOCKED(shm, n) MSGRING_FLAG(shm, 2 + (n))
+
+struct spr16_msgring {
+	char *addr;
+	struct spsc_ring *tx;
+	struct spsc_ring *rx;
+	uint32_t *tx_idle; /* peer is asleep */
+	uint32_t *rx_idle;
+	uint32_t *tx_blocked; /* we found tx full */
+	uint32_t *rx_blocked;
+	uint32_t tx_head;  /* private copies of the indexes we own */
+	uint32_t rx_tail;
+	int asleep;
+	int tx_bell;
+	int rx_bell;
+	int fds[SPR16_MSGRING_FDS];
+};
+
+/* attached rings, indexed by socket */
+static struct spr16_msgring *g_msgrings[MSGRING_MAXFD];
+
+struct spr16_rxbuf {
+	uint32_t start; /* first byte not handed out yet */
+	uint32_t end;   /* end of what has been read */
+	char buf[RXBUF_SIZE];
+};
 
 static void print_bytes(char *buf, const uint16_t len)
 {
@@ -53,6 +111,80 @@ static void print_bytes(char *buf, const uint16_t len)
 	fprintf(stderr, "\n");
 }
 
+uint16_t spr16_format_bpp(uint16_t format)
+{
+	switch (format)
+	{
+	case SPR16_FORMAT_XRGB8888:
+		return 32;
+	case SPR16_FORMAT_RGB565:
+		return 16;
+	case SPR16_FORMAT_INDEX8:
+		return 8;
+	case SPR16_FORMAT_NV12:
+	case SPR16_FORMAT_I420:
+		return 12;
+	default:
+		return 0;
+	}
+}
+
+/* palette follows the pixels, 4 byte aligned */
+static uint32_t palette_offset(uint16_t width, uint16_t height)
+{
+	return (((uint32_t)width * height) + 3) & ~3U;
+}
+
+/* 4:2:0 chroma plane */
+static uint32_t chroma_size(uint16_t width, uint16_t height)
+{
+	return ((width + 1U) / 2) * ((height + 1U) / 2);
+}
+
+uint32_t spr16_sprite_size(uint16_t format, uint16_t width, uint16_t height)
+{
+	if (format == SPR16_FORMAT_INDEX8)
+		return palette_offset(width, height)
+			+ (SPR16_PALETTE_COUNT * sizeof(uint32_t));
+	if (SPR16_FORMAT_IS_YUV(format))
+		return ((uint32_t)width * height) + (chroma_size(width, height) * 2);
+	return (uint32_t)width * height * (spr16_format_bpp(format)/8);
+}
+
+char *spr16_sprite_plane(struct spr16 *sprite, unsigned int plane, uint32_t *stride)
+{
+	const uint32_t luma = (uint32_t)sprite->width * sprite->height;
+	const uint32_t cw = (sprite->width + 1U) / 2;
+
+	if (sprite->shmem.addr == NULL)
+		return NULL;
+	if (plane == 0) {
+		if (SPR16_FORMAT_IS_YUV(sprite->format))
+			*stride = sprite->width;
+		else
+			*stride = sprite->width * (spr16_format_bpp(sprite->format)/8);
+		return sprite->shmem.addr;
+	}
+	if (sprite->format == SPR16_FORMAT_NV12 && plane == 1) {
+		*stride = cw * 2;
+		return sprite->shmem.addr + luma;
+	}
+	if (sprite->format == SPR16_FORMAT_I420 && plane <= 2) {
+		*stride = cw;
+		return sprite->shmem.addr + luma
+			+ ((plane - 1) * chroma_size(sprite->width, sprite->height));
+	}
+	return NULL;
+}
+
+uint32_t *spr16_sprite_palette(struct spr16 *sprite)
+{
+	if (sprite->format != SPR16_FORMAT_INDEX8 || sprite->shmem.addr == NULL)
+		return NULL;
+	return (uint32_t *)(sprite->shmem.addr
+			+ palette_offset(sprite->width, sprite->height));
+}
+
 uint32_t get_msghdr_typelen(struct spr16_msghdr *hdr)
 {
 	switch (hdr->type)
@@ -60,6 +192,8 @@ uint32_t get_msghdr_typelen(struct spr16_msghdr *hdr)
 	case SPRITEMSG_SERVINFO:
 		return (uint32_t)sizeof(struct spr16_msgdata_servinfo);
 	case SPRITEMSG_REGISTER_SPRITE:
+		if (!(hdr->bits & SPRITEREG_FLAG_EXTENDED))
+			return (uint32_t)sizeof(struct spr16_msgdata_register_sprite_v0);
 		return (uint32_t)sizeof(struct spr16_msgdata_register_sprite);
 	case SPRITEMSG_INPUT:
 		return (uint32_t)sizeof(struct spr16_msgdata_input);
@@ -69,120 +203,439 @@ uint32_t get_msghdr_typelen(struct spr16_msghdr *hdr)
 		return (uint32_t)sizeof(struct spr16_msgdata_ack);
 	case SPRITEMSG_SYNC:
 		return (uint32_t)sizeof(struct spr16_msgdata_sync);
+	case SPRITEMSG_SYNC_RECTS:
+		if (!SPRITESYNC_RECTS_COUNT(hdr->bits))
+			return 0xffffffff;
+		return (uint32_t)sizeof(struct spr16_msgdata_sync)
+			* SPRITESYNC_RECTS_COUNT(hdr->bits);
+	case SPRITEMSG_PRESENT:
+		return (uint32_t)sizeof(struct spr16_msgdata_present);
 	default:
 		fprintf(stderr, "bad type(%d)\n", hdr->type);
-		print_bytes(g_msgbuf, 32);
+		print_bytes((char *)hdr, sizeof(*hdr));
 		return 0xffffffff;
 	}
 }
-/* may return -1 with EAGAIN */
-int spr16_write_msg(int fd, struct spr16_msghdr *hdr,
-		void *msgdata, size_t msgdata_len)
+uint32_t spr16_msgring_size()
 {
-	char msg[SPR16_MAXMSGLEN];
-	unsigned int intr_count = 0;
-	memcpy(msg, hdr, sizeof(*hdr));
-	memcpy(msg + sizeof(*hdr), msgdata, msgdata_len);
-interrupted:
-	errno = 0;
-	if (write(fd, msg, msgdata_len + sizeof(*hdr)) == -1) {
-		if (errno == EINTR) {
-			if (++intr_count > 1000) {
-				errno = EAGAIN;
-				return -1;
-			}
-			else {
-				goto interrupted;
-			}
-		}
+	return sizeof(struct msgring_shm) + (MSGRING_BYTES * 2);
+}
+
+static char *msgring_slot(struct spsc_ring *ring, uint32_t idx)
+{
+	return (char *)(ring + 1) + ((idx & (MSGRING_SLOTS - 1)) * SPR16_MAXMSGLEN);
+}
+
+/* tx and rx are swapped for the client */
+static struct spr16_msgring *msgring_map(int *fds, int tx)
+{
+	struct spr16_msgring *self;
+	struct msgring_shm *shm;
+	char *addr;
+
+	addr = mmap(0, spr16_msgring_size(), PROT_READ|PROT_WRITE,
+			MAP_SHARED, fds[0], 0);
+	if (addr == MAP_FAILED) {
+		printf("msgring mmap: %s\n", STRERR);
+		return NULL;
+	}
+	self = calloc(1, sizeof(struct spr16_msgring));
+	if (self == NULL) {
+		munmap(addr, spr16_msgring_size());
+		return NULL;
+	}
+	shm = (struct msgring_shm *)addr;
+	self->addr    = addr;
+	self->tx      = (struct spsc_ring *)(addr + sizeof(*shm) + (MSGRING_BYTES * tx));
+	self->rx      = (struct spsc_ring *)(addr + sizeof(*shm) + (MSGRING_BYTES * !tx));
+	self->tx_idle = MSGRING_IDLE(shm, tx);
+	self->rx_idle = MSGRING_IDLE(shm, !tx);
+	self->tx_blocked = MSGRING_BLOCKED(shm, tx);
+	self->rx_blocked = MSGRING_BLOCKED(shm, !tx);
+	self->tx_head = self->tx->head;
+	self->rx_tail = self->rx->tail;
+	self->asleep  = 1;
+	self->tx_bell = fds[1 + tx];
+	self->rx_bell = fds[1 + !tx];
+	memcpy(self->fds, fds, sizeof(self->fds));
+	return self;
+}
+
+struct spr16_msgring *spr16_msgring_create(int memfd)
+{
+	struct spr16_msgring *self;
+	struct msgring_shm *shm;
+	int fds[SPR16_MSGRING_FDS];
+	unsigned int i;
+
+	fds[0] = memfd;
+	fds[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	fds[2] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (fds[1] == -1 || fds[2] == -1) {
+		printf("eventfd: %s\n", STRERR);
+		goto failure;
+	}
+	self = msgring_map(fds, 0);
+	if (self == NULL)
+		goto failure;
+
+	shm = (struct msgring_shm *)self->addr;
+	for (i = 0; i < 2; ++i)
+	{
+		struct spsc_ring *ring;
+		ring = (struct spsc_ring *)(self->addr + sizeof(*shm) + (MSGRING_BYTES * i));
+		ring->count = MSGRING_SLOTS;
+		ring->slot_size = SPR16_MAXMSGLEN;
+		/* nobody is reading yet, first message rings */
+		*MSGRING_IDLE(shm, i) = 1;
+	}
+	return self;
+
+failure:
+	if (fds[1] != -1)
+		close(fds[1]);
+	if (fds[2] != -1)
+		close(fds[2]);
+	return NULL;
+}
+
+struct spr16_msgring *spr16_msgring_open(int *fds)
+{
+	struct spr16_msgring *self = msgring_map(fds, 1);
+	if (self == NULL)
+		return NULL;
+	if (self->tx->count != MSGRING_SLOTS || self->tx->slot_size != SPR16_MAXMSGLEN) {
+		printf("msgring size mismatch\n");
+		spr16_msgring_destroy(self);
+		return NULL;
+	}
+	return self;
+}
+
+void spr16_msgring_destroy(struct spr16_msgring *self)
+{
+	unsigned int i;
+	if (self == NULL)
+		return;
+	if (munmap(self->addr, spr16_msgring_size()))
+		printf("msgring munmap: %s\n", STRERR);
+	for (i = 0; i < SPR16_MSGRING_FDS; ++i)
+	{
+		close(self->fds[i]);
+	}
+	free(self);
+}
+
+int *spr16_msgring_fds(struct spr16_msgring *self)
+{
+	return self->fds;
+}
+
+int spr16_msgring_bell(struct spr16_msgring *self)
+{
+	return self->rx_bell;
+}
+
+void spr16_msgring_wake(struct spr16_msgring *self)
+{
+	uint64_t rang;
+	if (read(self->rx_bell, &rang, sizeof(rang)) == -1 && errno != EAGAIN)
+		printf("msgring bell: %s\n", STRERR);
+}
+
+int spr16_msgring_attach(int sock, struct spr16_msgring *self)
+{
+	if (sock < 0 || sock >= MSGRING_MAXFD || g_msgrings[sock]) {
+		errno = EINVAL;
 		return -1;
 	}
+	g_msgrings[sock] = self;
 	return 0;
 }
 
-/* space is reserved at end of read buffer to read a truncated message */
-static int spr16_reassemble_fragment(int fd)
+void spr16_msgring_detach(int sock)
 {
-	char *fragpos;
-	uint32_t typelen;
-	int rdpos;
-	int bytesleft = 0;
-	int intr_count = 0;
-	int fragbytes;
-	int msglen;
-	int r;
+	if (sock >= 0 && sock < MSGRING_MAXFD)
+		g_msgrings[sock] = NULL;
+}
+
+/* buf holds whole messages, they all go in or none do */
+static int msgring_write(struct spr16_msgring *self, char *buf, uint32_t len)
+{
+	uint32_t tail = __atomic_load_n(&self->tx->tail, __ATOMIC_ACQUIRE);
+	uint32_t slots = 0;
+	uint32_t msglen;
+	uint32_t pos;
 
-	/* find fragment */
-	rdpos = 0;
-	while (rdpos < MAX_MSGBUF_READ)
+	for (pos = 0; pos < len; pos += msglen)
 	{
-		fragpos = g_msgbuf+rdpos;
-		typelen = get_msghdr_typelen((struct spr16_msghdr *)fragpos);
-		if (typelen > SPR16_MAXMSGLEN - sizeof(struct spr16_msghdr)) {
-			errno = EPROTO;
+		msglen = sizeof(struct spr16_msghdr)
+			+ get_msghdr_typelen((struct spr16_msghdr *)(buf + pos));
+		slots += MSGRING_MSGSLOTS(msglen);
+	}
+	if (slots > MSGRING_SLOTS) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (self->tx_head - tail > MSGRING_SLOTS - slots) {
+		/* same handoff as idle, either the peer sees blocked after it
+		 * moves tail or we see the room it made here */
+		__atomic_store_n(self->tx_blocked, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		tail = __atomic_load_n(&self->tx->tail, __ATOMIC_ACQUIRE);
+		if (self->tx_head - tail > MSGRING_SLOTS - slots) {
+			errno = EAGAIN;
 			return -1;
 		}
-		msglen = sizeof(struct spr16_msghdr) + typelen;
-		rdpos += msglen;
+		__atomic_store_n(self->tx_blocked, 0, __ATOMIC_RELAXED);
 	}
-
-	/* size of fragment we already have */
-	fragbytes = msglen - (rdpos - MAX_MSGBUF_READ);
-	if (fragbytes == msglen) {
-		return MAX_MSGBUF_READ; /* not actually truncated. */
+	for (pos = 0; pos < len; pos += msglen)
+	{
+		uint32_t off;
+		msglen = sizeof(struct spr16_msghdr)
+			+ get_msghdr_typelen((struct spr16_msghdr *)(buf + pos));
+		for (off = 0; off < msglen; off += SPR16_MAXMSGLEN)
+		{
+			uint32_t chunk = msglen - off;
+			if (chunk > SPR16_MAXMSGLEN)
+				chunk = SPR16_MAXMSGLEN;
+			memcpy(msgring_slot(self->tx, self->tx_head), buf + pos + off, chunk);
+			++self->tx_head;
+		}
 	}
-	else if (fragbytes < 2) {
-		/* fragment == 1 byte, this shouldn't happen. if it does
-		 * make sure read buffer + all structs divide by 2 evenly */
-		fprintf(stderr, "check struct alignment.\n");
-		errno = EPROTO;
-		return -1;
+	__atomic_store_n(&self->tx->head, self->tx_head, __ATOMIC_RELEASE);
+
+	/* either the peer sees the new head when it checks again after setting
+	 * idle, or we see idle here. only one producer write can take it */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(self->tx_idle, __ATOMIC_RELAXED)
+			&& __atomic_exchange_n(self->tx_idle, 0, __ATOMIC_ACQ_REL)) {
+		uint64_t ring = 1;
+		if (write(self->tx_bell, &ring, sizeof(ring)) == -1 && errno != EAGAIN)
+			printf("msgring doorbell: %s\n", STRERR);
 	}
+	return 0;
+}
+
+int spr16_msgring_read(struct spr16_msgring *self, char *buf, uint32_t size)
+{
+	char hdr[sizeof(struct spr16_msghdr)];
+	uint32_t pos = 0;
+	int full = 0;
 
-	/* continue with 2'nd read */
-	bytesleft = msglen-fragbytes;
-	if (bytesleft <= 0 || bytesleft+fragbytes > SPR16_MAXMSGLEN) {
-		errno = EPROTO;
+	if (size < SPR16_MAXVARMSGLEN) {
+		errno = EINVAL;
 		return -1;
 	}
-interrupted:
-	r = read(fd, &g_msgbuf[MAX_MSGBUF_READ], bytesleft);
-	if (r == -1 && errno == EINTR) {
-		if (++intr_count < 100)
-			goto interrupted;
-		else
+
+	if (self->asleep) {
+		__atomic_store_n(self->rx_idle, 0, __ATOMIC_RELAXED);
+		self->asleep = 0;
+	}
+	while (1)
+	{
+		const uint32_t head = __atomic_load_n(&self->rx->head, __ATOMIC_ACQUIRE);
+
+		if (head - self->rx_tail > MSGRING_SLOTS) {
+			errno = EPROTO;
 			return -1;
+		}
+		if (head == self->rx_tail) {
+			if (self->asleep)
+				return pos;
+			/* check once more after setting idle, see msgring_write */
+			__atomic_store_n(self->rx_idle, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			self->asleep = 1;
+			continue;
+		}
+		if (self->asleep) {
+			__atomic_store_n(self->rx_idle, 0, __ATOMIC_RELAXED);
+			self->asleep = 0;
+		}
+		while (self->rx_tail != head)
+		{
+			uint32_t msglen;
+			uint32_t off;
+			/* length comes from our copy of the header */
+			memcpy(hdr, msgring_slot(self->rx, self->rx_tail), sizeof(hdr));
+			msglen = get_msghdr_typelen((struct spr16_msghdr *)hdr);
+			if (msglen > SPR16_MAXVARMSGLEN - sizeof(struct spr16_msghdr)) {
+				errno = EPROTO;
+				return -1;
+			}
+			msglen += sizeof(struct spr16_msghdr);
+			/* messages are committed whole */
+			if (head - self->rx_tail < MSGRING_MSGSLOTS(msglen)) {
+				errno = EPROTO;
+				return -1;
+			}
+			if (pos + msglen > size) {
+				full = 1;
+				break;
+			}
+			memcpy(buf + pos, hdr, sizeof(hdr));
+			for (off = 0; off < msglen; off += SPR16_MAXMSGLEN)
+			{
+				uint32_t skip = off ? 0 : sizeof(hdr);
+				uint32_t chunk = msglen - off;
+				if (chunk > SPR16_MAXMSGLEN)
+					chunk = SPR16_MAXMSGLEN;
+				memcpy(buf + pos + off + skip,
+				       msgring_slot(self->rx, self->rx_tail) + skip,
+				       chunk - skip);
+				++self->rx_tail;
+			}
+			pos += msglen;
+		}
+		__atomic_store_n(&self->rx->tail, self->rx_tail, __ATOMIC_RELEASE);
+		/* peer is waiting for room, it's rx bell is our tx bell */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(self->rx_blocked, __ATOMIC_RELAXED)
+				&& __atomic_exchange_n(self->rx_blocked, 0, __ATOMIC_ACQ_REL)) {
+			uint64_t ring = 1;
+			if (write(self->tx_bell, &ring, sizeof(ring)) == -1
+					&& errno != EAGAIN)
+				printf("msgring doorbell: %s\n", STRERR);
+		}
+		if (full)
+			return pos;
 	}
-	if (r != bytesleft) {
-		errno = EPROTO;
+}
+
+/* may return -1 with EAGAIN */
+int spr16_write_msg(int fd, struct spr16_msghdr *hdr,
+		void *msgdata, size_t msgdata_len)
+{
+	char msg[SPR16_MAXMSGLEN];
+	if (msgdata_len > SPR16_MAXMSGLEN - sizeof(*hdr)) {
+		errno = EMSGSIZE;
 		return -1;
 	}
-	return MAX_MSGBUF_READ+r;
+	memcpy(msg, hdr, sizeof(*hdr));
+	memcpy(msg + sizeof(*hdr), msgdata, msgdata_len);
+	return spr16_write_msgs(fd, msg, msgdata_len + sizeof(*hdr));
 }
 
-char *spr16_read_msgs(int fd, uint32_t *outlen)
+int spr16_write_some(int fd, char *buf, uint32_t len)
 {
+	unsigned int intr_count = 0;
+	uint32_t pos = 0;
 	int r;
 
-	r = read(fd, g_msgbuf, MAX_MSGBUF_READ);
-	if (r == -1) {
-		return NULL;
+	if (fd >= 0 && fd < MSGRING_MAXFD && g_msgrings[fd]) {
+		if (msgring_write(g_msgrings[fd], buf, len) == 0)
+			return len;
+		return (errno == EAGAIN) ? 0 : -1;
 	}
-	if (r == MAX_MSGBUF_READ) {
-		/* possibly truncated */
-		r = spr16_reassemble_fragment(fd);
-		if (r <= 0 ) {
-			printf("reassamble failed\n");
-			return NULL;
+	while (pos < len)
+	{
+		r = write(fd, buf + pos, len - pos);
+		if (r == -1 && errno == EINTR) {
+			if (++intr_count > 1000)
+				break;
+			continue;
+		}
+		else if (r == -1 && errno == EAGAIN) {
+			break;
+		}
+		else if (r == -1) {
+			return -1;
+		}
+		pos += r;
+	}
+	return pos;
+}
+
+/* nothing is written if the socket is full, but once part of buf went out
+ * the rest has to follow or the stream is corrupt, wait for room then.
+ * the server can't wait on a client, it uses spr16_write_some */
+int spr16_write_msgs(int fd, char *buf, uint32_t len)
+{
+	uint32_t pos = 0;
+	int r;
+
+	while (pos < len)
+	{
+		struct pollfd pfd;
+		r = spr16_write_some(fd, buf + pos, len - pos);
+		if (r == -1)
+			return -1;
+		pos += r;
+		if (pos == len)
+			break;
+		if (pos == 0) {
+			errno = EAGAIN;
+			return -1;
 		}
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		r = poll(&pfd, 1, 1000);
+		if (r == 0)
+			errno = ETIMEDOUT;
+		if (r <= 0 && errno != EINTR)
+			return -1;
 	}
+	return 0;
+}
+
+struct spr16_rxbuf *spr16_rxbuf_create()
+{
+	return calloc(1, sizeof(struct spr16_rxbuf));
+}
 
-	if (r > (int)sizeof(g_msgbuf) || r < (int)MIN_MSGBUF_READ) {
-		errno = EPROTO;
+void spr16_rxbuf_destroy(struct spr16_rxbuf *self)
+{
+	free(self);
+}
+
+char *spr16_rxbuf_read(struct spr16_rxbuf *self, int fd, uint32_t *outlen)
+{
+	char *msgs;
+	uint32_t pos;
+	int r;
+
+	if (self->start == self->end) {
+		self->start = 0;
+		self->end = 0;
+	}
+	else if (RXBUF_SIZE - self->end < SPR16_MAXVARMSGLEN) {
+		/* at most one message, cut off by the last read */
+		memmove(self->buf, self->buf + self->start, self->end - self->start);
+		self->end -= self->start;
+		self->start = 0;
+	}
+	do {
+		r = read(fd, self->buf + self->end, RXBUF_SIZE - self->end);
+	} while (r == -1 && errno == EINTR);
+	if (r == -1)
+		return NULL;
+	if (r == 0) {
+		errno = ECONNRESET;
 		return NULL;
 	}
-	*outlen = r;
-	return g_msgbuf;
+	self->end += r;
+
+	/* hand out whole messages, the rest waits for the next read */
+	pos = self->start;
+	while (self->end - pos >= sizeof(struct spr16_msghdr))
+	{
+		uint32_t msglen;
+		msglen = get_msghdr_typelen((struct spr16_msghdr *)(self->buf + pos));
+		if (msglen > SPR16_MAXVARMSGLEN - sizeof(struct spr16_msghdr)) {
+			errno = EPROTO;
+			return NULL;
+		}
+		msglen += sizeof(struct spr16_msghdr);
+		if (self->end - pos < msglen)
+			break;
+		pos += msglen;
+	}
+	msgs = self->buf + self->start;
+	*outlen = pos - self->start;
+	self->start = pos;
+	return msgs;
 }
 
 int spr16_send_ack(int fd, uint16_t ackinfo)
@@ -217,24 +670,32 @@ int spr16_send_nack(int fd, uint16_t ackinfo)
 	return 0;
 }
 
-int afunix_send_fd(int sock, int fd)
+int afunix_send_fds(int sock, int *fds, unsigned int count)
 {
 	union {
 		struct cmsghdr cmh;
-		char control[CMSG_SPACE(sizeof(int))];
+		char control[CMSG_SPACE(sizeof(int) * SPR16_MAXFDS)];
 	} control_un;
 	struct cmsghdr *cmhp;
 	struct msghdr msgh;
 	struct iovec iov;
+	unsigned int i;
 	int  retval;
 	char data = 'F';
 	int  c = 5000;
 	int *fdp;
 
-	if (sock == -1 || fd == -1) {
+	if (sock == -1 || !count || count > SPR16_MAXFDS) {
 		fprintf(stderr, "invalid descriptor\n");
 		return -1;
 	}
+	for (i = 0; i < count; ++i)
+	{
+		if (fds[i] == -1) {
+			fprintf(stderr, "invalid descriptor\n");
+			return -1;
+		}
+	}
 
 	memset(&msgh, 0, sizeof(msgh));
 	msgh.msg_iov = &iov;
@@ -242,17 +703,17 @@ int afunix_send_fd(int sock, int fd)
 	msgh.msg_name = NULL;
 	msgh.msg_namelen = 0;
 	msgh.msg_control = control_un.control;
-	msgh.msg_controllen = sizeof(control_un.control);
+	msgh.msg_controllen = CMSG_SPACE(sizeof(int) * count);
 
 	iov.iov_base = &data;
 	iov.iov_len = sizeof(data);
 
 	cmhp = CMSG_FIRSTHDR(&msgh);
-	cmhp->cmsg_len = CMSG_LEN(sizeof(int));
+	cmhp->cmsg_len = CMSG_LEN(sizeof(int) * count);
 	cmhp->cmsg_level = SOL_SOCKET;
 	cmhp->cmsg_type = SCM_RIGHTS;
 	fdp = ((int *)CMSG_DATA(cmhp));
-	*fdp = fd;
+	memcpy(fdp, fds, sizeof(int) * count);
 	while (--c > 0) {
 		retval = sendmsg(sock, &msgh, MSG_DONTWAIT);
 		if (retval == -1 && errno == EINTR) {
@@ -278,33 +739,34 @@ int afunix_send_fd(int sock, int fd)
 	return 0;
 }
 
-int afunix_recv_fd(int sock, int *fd_out)
+int afunix_send_fd(int sock, int fd)
+{
+	return afunix_send_fds(sock, &fd, 1);
+}
+
+int afunix_recv_fds(int sock, int *fds_out, unsigned int max, unsigned int *count)
 {
 	union {
 		struct cmsghdr cmh;
-		char control[CMSG_SPACE(sizeof(int))];
+		char control[CMSG_SPACE(sizeof(int) * SPR16_MAXFDS)];
 	} control_un;
 	struct cmsghdr *cmhp;
 	struct msghdr msgh;
 	struct iovec iov;
+	unsigned int i, n;
 	char data;
-	int fd;
-	int *fdp;
+	int fds[SPR16_MAXFDS];
 	int retval;
 
 	errno = 0;
-	if (fd_out == NULL)
+	if (fds_out == NULL || count == NULL || !max || max > SPR16_MAXFDS)
 		return -1;
-	*fd_out = -1;
+	*count = 0;
 
 	memset(&control_un, 0, sizeof(control_un));
-	control_un.cmh.cmsg_len = CMSG_LEN(sizeof(int));
-	control_un.cmh.cmsg_level = SOL_SOCKET;
-	control_un.cmh.cmsg_type = SCM_RIGHTS;
-
 	memset(&msgh, 0, sizeof(msgh));
 	msgh.msg_control = control_un.control;
-	msgh.msg_controllen = sizeof(control_un.control);
+	msgh.msg_controllen = CMSG_SPACE(sizeof(int) * max);
 	msgh.msg_name = NULL;
 	msgh.msg_namelen = 0;
 	msgh.msg_iov = &iov;
@@ -327,11 +789,6 @@ int afunix_recv_fd(int sock, int *fd_out)
 		fprintf(stderr, "recv_fd error, no message header\n");
 		return -1;
 	}
-	if ( cmhp->cmsg_len != CMSG_LEN(sizeof(int))) {
-		fprintf(stderr, "cmhp(%p)\n", (void *)cmhp);
-		fprintf(stderr, "bad cmsg header / message length\n");
-		return -1;
-	}
 	if (cmhp->cmsg_level != SOL_SOCKET) {
 		fprintf(stderr, "cmsg_level != SOL_SOCKET");
 		return -1;
@@ -340,16 +797,35 @@ int afunix_recv_fd(int sock, int *fd_out)
 		fprintf(stderr, "cmsg_type != SCM_RIGHTS");
 		return -1;
 	}
+	if (cmhp->cmsg_len < CMSG_LEN(sizeof(int))
+			|| cmhp->cmsg_len > CMSG_LEN(sizeof(int) * max)
+			|| (cmhp->cmsg_len - CMSG_LEN(0)) % sizeof(int)) {
+		fprintf(stderr, "cmhp(%p)\n", (void *)cmhp);
+		fprintf(stderr, "bad cmsg header / message length\n");
+		return -1;
+	}
 
-	fdp = ((int *) CMSG_DATA(cmhp));
-
-	fd = *fdp;
+	n = (cmhp->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	memcpy(fds, CMSG_DATA(cmhp), sizeof(int) * n);
 
-	if (data != 'F') {
+	if (data != 'F' || (msgh.msg_flags & MSG_CTRUNC)) {
 		fprintf(stderr, "received an improper file, closing.\n");
-		close(fd);
+		for (i = 0; i < n; ++i)
+		{
+			close(fds[i]);
+		}
 		return -1;
 	}
-	*fd_out = fd;
+	memcpy(fds_out, fds, sizeof(int) * n);
+	*count = n;
 	return 0;
 }
+
+int afunix_recv_fd(int sock, int *fd_out)
+{
+	unsigned int count;
+	if (fd_out == NULL)
+		return -1;
+	*fd_out = -1;
+	return afunix_recv_fds(sock, fd_out, 1, &count);
+}
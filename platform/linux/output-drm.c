@@ -0,0 +1,254 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <memory.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/udmabuf.h>
+#include "platform.h"
+#include "output.h"
+#include "drm.h"
+#include "fb.h"
+
+static void drm_output_swap(struct output *self)
+{
+	struct drm_kms *card = self->pvt;
+	self->fb.addr = card->sfb->addr;
+	self->back = card->back->addr;
+	self->front ^= 1;
+	self->flip_pending = 0;
+}
+
+static int drm_fd_callback(int fd, int event_flags, void *user_data)
+{
+	/* kernel drm_file.c advises 4K buffer since read only returns 1 event */
+	char buf[4096];
+	struct drm_event *event;
+	struct drm_event_vblank *vbl;
+	uint64_t timestamp;
+	int r;
+	unsigned int pos = 0;
+	struct server_context *ctx = user_data;
+
+	if (event_flags & (FDPOLLHUP | FDPOLLERR)) {
+		printf("drm fd HUP/ERR\n");
+		return FDPOLL_HANDLER_REMOVE;
+	}
+
+	do {
+		r = read(fd, buf, sizeof(buf));
+	} while (r == -1 && errno == EINTR);
+
+	if (r < 0) {
+		printf("drm_handle_events, read: %s\n", strerror(errno));
+		return FDPOLL_HANDLER_REMOVE;
+	}
+	else if (r < (int)sizeof(struct drm_event)) {
+		printf("drm_handle_events, read size error");
+		return FDPOLL_HANDLER_REMOVE;
+	}
+
+	while (pos < (unsigned int)r)
+	{
+		if (pos > r - sizeof(struct drm_event)) {
+			printf("event size error\n");
+			return FDPOLL_HANDLER_REMOVE;
+		}
+		event = (struct drm_event *)(buf+pos);
+		if (pos > r - event->length) {
+			printf("event length error\n");
+			return FDPOLL_HANDLER_REMOVE;
+		}
+
+		/* both events carry the vblank's CLOCK_MONOTONIC timestamp */
+		vbl = (struct drm_event_vblank *)event;
+		timestamp = ((uint64_t)vbl->tv_sec * FRAME_SCHED_NSEC)
+				+ ((uint64_t)vbl->tv_usec * 1000);
+		switch (event->type)
+		{
+		case DRM_EVENT_VBLANK:
+			if (ctx == NULL) {
+				return FDPOLL_HANDLER_REMOVE;
+			}
+			fb_vblank(ctx, timestamp, vbl->sequence);
+			break;
+
+		case DRM_EVENT_FLIP_COMPLETE:
+			if (ctx == NULL) {
+				return FDPOLL_HANDLER_REMOVE;
+			}
+			drm_kms_flip_complete(ctx->output->pvt);
+			drm_output_swap(ctx->output);
+			fb_flip_complete(ctx, timestamp, vbl->sequence);
+			break;
+
+		default:
+			printf("unknown drm event received: %d\n", event->type);
+			break;
+		}
+		pos += event->length;
+	}
+	return FDPOLL_HANDLER_OK;
+}
+
+/* note: page flipping will require drm master, which is dropped when vt is switched
+ * also, there is a race condition, if flip is issued and the program exits screen
+ * will lock up since it's still being referenced mid switch, or something...
+ * */
+static int drm_vblank(struct output *self)
+{
+	struct drm_kms *card = self->pvt;
+	struct drm_wait_vblank_request vblank;
+	int retry;
+	memset(&vblank, 0, sizeof(vblank));
+	vblank.type = _DRM_VBLANK_RELATIVE | _DRM_VBLANK_EVENT;
+	vblank.sequence = 1;
+
+	for (retry = 5000; retry >= 0; --retry)
+	{
+		int r = ioctl(card->card_fd, DRM_IOCTL_WAIT_VBLANK, &vblank);
+		if (r == 0)
+			break;
+		else if (r == -1 && errno == EINTR)
+			continue;
+
+		printf("ioctl(DRM_IOCTL_WAIT_VBLANK): %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int drm_flip(struct output *self)
+{
+	if (drm_kms_page_flip(self->pvt))
+		return -1;
+	self->flip_pending = 1;
+	return 0;
+}
+
+static int drm_export_fd(struct output *self, int *out_fd)
+{
+	struct drm_kms *card = self->pvt;
+	return drm_prime_export_fd(card->card_fd, card->sfb, out_fd);
+}
+
+static int g_udmabuf = -1;
+
+static int drm_plane_attach(struct output *self, struct client *cl)
+{
+	struct drm_kms *card = self->pvt;
+	struct udmabuf_create create;
+	const long page = sysconf(_SC_PAGESIZE);
+	uint32_t i;
+	int dmabuf;
+	int r;
+
+	for (i = 0; i < card->plane_count; ++i)
+	{
+		if (card->planes[i].fb_id == 0)
+			break;
+	}
+	if (i >= card->plane_count)
+		return 1;
+
+	if (g_udmabuf == -1) {
+		g_udmabuf = open("/dev/udmabuf", O_RDWR|O_CLOEXEC);
+		if (g_udmabuf == -1) {
+			printf("open(/dev/udmabuf): %s, overlays disabled\n",
+					strerror(errno));
+			self->plane_attach = NULL;
+			return -1;
+		}
+	}
+
+	/* memfd is sealed against shrinking, udmabuf wants whole pages */
+	memset(&create, 0, sizeof(create));
+	create.memfd = cl->sprite.shmem.fd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.size  = (cl->sprite.shmem.size + page - 1) & ~(page - 1);
+	dmabuf = ioctl(g_udmabuf, UDMABUF_CREATE, &create);
+	if (dmabuf == -1) {
+		printf("ioctl(UDMABUF_CREATE): %s\n", strerror(errno));
+		return -1;
+	}
+	r = drm_kms_plane_set(card, i, dmabuf, cl->sprite.x, cl->sprite.y,
+			      cl->sprite.width, cl->sprite.height,
+			      cl->sprite.width * (cl->sprite.bpp/8));
+	close(dmabuf);
+	if (r)
+		return -1;
+	card->planes[i].owner = cl;
+	printf("client(%d) on overlay plane %d\n", cl->socket,
+			card->planes[i].plane_id);
+	return 0;
+}
+
+static void drm_plane_detach(struct output *self, struct client *cl)
+{
+	struct drm_kms *card = self->pvt;
+	uint32_t i;
+	for (i = 0; i < card->plane_count; ++i)
+	{
+		if (card->planes[i].owner == cl)
+			drm_kms_plane_clear(card, i);
+	}
+}
+
+static void drm_output_destroy(struct output *self)
+{
+	drm_kms_destroy(self->pvt);
+	if (g_udmabuf != -1)
+		close(g_udmabuf);
+	g_udmabuf = -1;
+	free(self);
+}
+
+struct output *output_drm_create(struct drm_kms *card)
+{
+	struct output *self = calloc(1, sizeof(struct output));
+	if (self == NULL) {
+		drm_kms_destroy(card);
+		return NULL;
+	}
+	snprintf(self->name, sizeof(self->name), "drm");
+	self->fb.width  = card->sfb->width;
+	self->fb.height = card->sfb->height;
+	self->fb.bpp    = card->sfb->bpp;
+	self->fb.pitch  = card->sfb->pitch;
+	self->fb.addr   = card->sfb->addr;
+	self->fb.size   = card->sfb->size;
+	self->refresh   = card->display.cur_mode->vrefresh;
+	self->fd          = card->card_fd;
+	self->fd_callback = drm_fd_callback;
+	self->vblank      = drm_vblank;
+	self->export_fd   = drm_export_fd;
+	self->destroy     = drm_output_destroy;
+	if (card->plane_count) {
+		self->plane_attach = drm_plane_attach;
+		self->plane_detach = drm_plane_detach;
+	}
+	if (card->back) {
+		self->back = card->back->addr;
+		self->flip = drm_flip;
+	}
+	self->pvt         = card;
+	return self;
+}
@@ -0,0 +1,183 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include "platform.h"
+#include "output.h"
+#include "fb.h"
+
+#define STRERR strerror(errno)
+
+struct headless {
+	int memfd;
+	int vblank_pending;
+	uint32_t sequence;
+};
+
+/* timer runs at refresh rate whether anyone is waiting or not, like a crtc */
+static int headless_fd_callback(int fd, int event_flags, void *user_data)
+{
+	struct server_context *ctx = user_data;
+	struct headless *pvt = ctx->output->pvt;
+	uint64_t expirations;
+	int r;
+
+	if (event_flags & (FDPOLLHUP | FDPOLLERR)) {
+		printf("timerfd HUP/ERR\n");
+		return FDPOLL_HANDLER_REMOVE;
+	}
+
+	do {
+		r = read(fd, &expirations, sizeof(expirations));
+	} while (r == -1 && errno == EINTR);
+
+	if (r == -1 && errno == EAGAIN)
+		return FDPOLL_HANDLER_OK;
+	if (r != sizeof(expirations)) {
+		printf("timerfd read: %s\n", STRERR);
+		return FDPOLL_HANDLER_REMOVE;
+	}
+
+	pvt->sequence += expirations;
+	if (pvt->vblank_pending) {
+		pvt->vblank_pending = 0;
+		fb_vblank(ctx, frame_sched_now(), pvt->sequence);
+	}
+	return FDPOLL_HANDLER_OK;
+}
+
+static int headless_vblank(struct output *self)
+{
+	struct headless *pvt = self->pvt;
+	pvt->vblank_pending = 1;
+	return 0;
+}
+
+static int headless_export_fd(struct output *self, int *out_fd)
+{
+	struct headless *pvt = self->pvt;
+	int fd = fcntl(pvt->memfd, F_DUPFD_CLOEXEC, 0);
+	if (fd == -1) {
+		printf("fcntl(F_DUPFD_CLOEXEC): %s\n", STRERR);
+		return -1;
+	}
+	*out_fd = fd;
+	return 0;
+}
+
+static void headless_destroy(struct output *self)
+{
+	struct headless *pvt = self->pvt;
+	if (self->fb.addr)
+		munmap(self->fb.addr, self->fb.size);
+	if (self->fd != -1)
+		close(self->fd);
+	if (pvt->memfd != -1)
+		close(pvt->memfd);
+	free(pvt);
+	free(self);
+}
+
+struct output *output_headless_create(uint16_t width,
+				      uint16_t height,
+				      uint32_t pitch,
+				      uint16_t refresh)
+{
+	struct itimerspec its;
+	struct output *self;
+	struct headless *pvt;
+
+	if (!width || !height || !refresh) {
+		printf("bad headless mode %dx%d@%d\n", width, height, refresh);
+		return NULL;
+	}
+	if (pitch == 0)
+		pitch = width * 4;
+	if (pitch < (uint32_t)width * 4) {
+		printf("headless pitch %d too small for width %d\n", pitch, width);
+		return NULL;
+	}
+
+	self = calloc(1, sizeof(struct output));
+	pvt  = calloc(1, sizeof(struct headless));
+	if (self == NULL || pvt == NULL) {
+		free(self);
+		free(pvt);
+		return NULL;
+	}
+	self->pvt = pvt;
+	self->fd = -1;
+	pvt->memfd = -1;
+
+	snprintf(self->name, sizeof(self->name), "headless");
+	self->fb.width  = width;
+	self->fb.height = height;
+	self->fb.bpp    = 32;
+	self->fb.pitch  = pitch;
+	self->fb.size   = (size_t)pitch * height;
+	self->refresh   = refresh;
+	self->fd_callback = headless_fd_callback;
+	self->vblank      = headless_vblank;
+	self->export_fd   = headless_export_fd;
+	self->destroy     = headless_destroy;
+
+	pvt->memfd = syscall(SYS_memfd_create, "spr16_headless", MFD_CLOEXEC);
+	if (pvt->memfd == -1) {
+		printf("memfd_create: %s\n", STRERR);
+		goto err;
+	}
+	if (ftruncate(pvt->memfd, self->fb.size)) {
+		printf("ftruncate: %s\n", STRERR);
+		goto err;
+	}
+	self->fb.addr = mmap(0, self->fb.size, PROT_READ|PROT_WRITE,
+			     MAP_SHARED, pvt->memfd, 0);
+	if (self->fb.addr == MAP_FAILED) {
+		printf("mmap: %s\n", STRERR);
+		self->fb.addr = NULL;
+		goto err;
+	}
+
+	self->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
+	if (self->fd == -1) {
+		printf("timerfd_create: %s\n", STRERR);
+		goto err;
+	}
+	memset(&its, 0, sizeof(its));
+	/* 1hz is a whole second, tv_nsec can't hold that */
+	its.it_interval.tv_sec  = 1 / refresh;
+	its.it_interval.tv_nsec = (1000000000 / refresh) % 1000000000;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(self->fd, 0, &its, NULL)) {
+		printf("timerfd_settime: %s\n", STRERR);
+		goto err;
+	}
+
+	printf("headless output %dx%d@%d pitch %d\n", width, height, refresh, pitch);
+	return self;
+err:
+	headless_destroy(self);
+	return NULL;
+}
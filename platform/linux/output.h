@@ -0,0 +1,102 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * output backends, where the server's framebuffer lives and where vblank
+ * events come from. drm scans out a dumb buffer on a real crtc, headless
+ * scans out nowhere, it's a memfd with vblanks produced by a timerfd so the
+ * whole server can run on machines without a gpu.
+ *
+ * drm can also put sprites on overlay planes, the sprite memfd is turned into
+ * a dma-buf with /dev/udmabuf and imported as a framebuffer. try vkms with
+ * enable_overlay=1 to test it without hardware.
+ */
+
+#ifndef LINUX_OUTPUT_H__
+#define LINUX_OUTPUT_H__
+
+#include "../../spr16.h"
+#include "../fdpoll-handler.h"
+#include "frame-sched.h"
+
+struct drm_kms;
+struct client;
+
+/* how the pending frame will be copied */
+enum {
+	FRAME_IDLE = 0,
+	FRAME_VBLANK,  /* when the vblank event arrives */
+	FRAME_DEADLINE /* when timer_fd expires, just before the vblank */
+};
+
+/* clients waiting on the next vblank, there is at most one armed event
+ * no matter how many clients sync per frame. copied clients are held in
+ * shown until the vblank event says when they went out, and the compositor
+ * says their copy is done */
+struct output_frame
+{
+	struct client *pending[SPR16_MAXCLIENTS];
+	struct client *shown[SPR16_MAXCLIENTS];
+	uint32_t count;
+	uint32_t shown_count;
+	int armed;
+	int vblank_armed;  /* an event is on the way, keeps the clock fresh */
+	int timer_fd;      /* -1 if deadline scheduling is off */
+	uint64_t deadline; /* FRAME_DEADLINE timer expiration */
+	uint64_t target;   /* vblank the deadline is aiming for */
+	uint64_t bytes;    /* estimated copy size of the pending frame */
+	uint32_t flip_fence;   /* flip is submitted when this completes */
+	uint32_t sched_fence;  /* deadline copy being timed */
+	uint64_t sched_start;
+	uint64_t sched_bytes;
+	uint64_t sched_target;
+	struct frame_sched sched;
+};
+
+struct output
+{
+	char name[16];
+	struct spr16_framebuffer fb; /* buffer being scanned out */
+	char *back;                  /* flip target, NULL if single buffered */
+	unsigned int front;          /* 0/1 index of fb, for buffer age */
+	int flip_pending;
+	struct output_frame frame;
+	uint16_t refresh;            /* nominal hz, the scheduler seeds from it */
+	int fd; /* polled with fd_callback, user_data is the server_context */
+	fdpoll_handler_cb fd_callback;
+	/* request a single vblank event, backend calls fb_vblank with the
+	 * event's CLOCK_MONOTONIC timestamp. -1 if no event will be delivered */
+	int  (*vblank)(struct output *self);
+	/* scan out back, backend calls fb_flip_complete with the timestamp of
+	 * the vblank it was shown on. NULL if single buffered */
+	int  (*flip)(struct output *self);
+	/* returns a new fd that maps fb, for SPRITE_FLAG_DIRECT_SHM clients */
+	int  (*export_fd)(struct output *self, int *out_fd);
+	/* scan out a sprite's shared memory on a hardware plane, no copies.
+	 * 1 if no plane is free, -1 if it can't be imported. NULL if unsupported */
+	int  (*plane_attach)(struct output *self, struct client *cl);
+	void (*plane_detach)(struct output *self, struct client *cl);
+	void (*destroy)(struct output *self);
+	void *pvt;
+};
+
+/* output takes ownership of card */
+struct output *output_drm_create(struct drm_kms *card);
+/* pitch 0 for tightly packed rows */
+struct output *output_headless_create(uint16_t width,
+				      uint16_t height,
+				      uint32_t pitch,
+				      uint16_t refresh);
+
+#endif
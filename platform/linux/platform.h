@@ -19,7 +19,7 @@
 
 #include "../../spr16.h"
 #include "../fdpoll-handler.h"
-#include "drm.h"
+#include "output.h"
 
 /* saves a client lookup, on systems without epoll make this a large static sized array
  * and use fd as 1:1 index lookup, otherwise you need to use a hashmap, or worse... */
@@ -42,15 +42,22 @@ struct server_context {
 	int listen_fd;
 
 	/* TODO /dev/fb fallback */
-	struct drm_kms *card0;
+	struct output *output;
 };
 
 struct server_context *spr16_server_init(char *sockname,
 					 struct fdpoll_handler *fdpoll,
-					 struct spr16_framebuffer *fb);
+					 struct output *output);
 int spr16_server_update(struct server_context *self);
 int spr16_server_shutdown(struct server_context *self);
-int spr16_server_reset_client(struct client *cl);
+int spr16_server_reset_client(struct server_context *self, struct client *cl);
+/* queues if the client is backed up, -1 if it should be dropped */
+int spr16_server_send(struct server_context *self, struct client *cl,
+		      struct spr16_msghdr *hdr, void *msgdata, size_t msgdata_len);
+/* stage messages that belong together, commit sends them in one write */
+int spr16_server_stage(struct server_context *self, struct client *cl,
+		       struct spr16_msghdr *hdr, void *msgdata, size_t msgdata_len);
+int spr16_server_commit(struct server_context *self, struct client *cl);
 void server_sync_fullscreen(struct server_context *self);
 
 
@@ -0,0 +1,266 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "sendq.h"
+
+/* messages gathered into one write when flushing */
+#define SENDQ_BATCH 16
+
+#define SENDQ_SLOT(self, i) ((self)->msgs + \
+		((((self)->head + (i)) % (self)->max) * SPR16_MAXMSGLEN))
+
+struct sendq *sendq_create(uint32_t max)
+{
+	struct sendq *self;
+
+	if (max == 0)
+		return NULL;
+	self = calloc(1, sizeof(struct sendq));
+	if (self == NULL)
+		return NULL;
+	self->msgs = malloc(max * SPR16_MAXMSGLEN);
+	self->lens = malloc(max * sizeof(uint16_t));
+	self->stage = malloc(SENDQ_FRAME * SPR16_MAXMSGLEN);
+	if (self->msgs == NULL || self->lens == NULL || self->stage == NULL) {
+		sendq_destroy(self);
+		return NULL;
+	}
+	self->max = max;
+	return self;
+}
+
+void sendq_destroy(struct sendq *self)
+{
+	if (self == NULL)
+		return;
+	free(self->msgs);
+	free(self->lens);
+	free(self->stage);
+	free(self);
+}
+
+/* only axis updates and held contacts describe state that a newer message
+ * can replace, everything else is an event the client has to see */
+static int sendq_is_transition(char *msg)
+{
+	struct spr16_msghdr *hdr = (struct spr16_msghdr *)msg;
+	struct spr16_msgdata_input *input;
+
+	input = (struct spr16_msgdata_input *)(msg + sizeof(*hdr));
+	switch (hdr->type)
+	{
+	case SPRITEMSG_INPUT:
+		return (input->type != SPR16_INPUT_AXIS_RELATIVE
+				&& input->type != SPR16_INPUT_AXIS_ABSOLUTE);
+	case SPRITEMSG_INPUT_SURFACE:
+		/* contact released */
+		return (input->val == 0);
+	default:
+		return 0;
+	}
+}
+
+/* returns 1 if msg was folded into a queued message */
+static int sendq_merge(struct sendq *self, char *msg)
+{
+	struct spr16_msghdr *hdr = (struct spr16_msghdr *)msg;
+	struct spr16_msgdata_input *input;
+	uint32_t i;
+
+	if (sendq_is_transition(msg))
+		return 0;
+	if (hdr->type != SPRITEMSG_INPUT && hdr->type != SPRITEMSG_INPUT_SURFACE)
+		return 0;
+	input = (struct spr16_msgdata_input *)(msg + sizeof(*hdr));
+
+	/* newest to oldest, only as far back as the last transition. the head
+	 * is already partly on the wire if sent is set, leave it alone */
+	i = self->count;
+	while (i > (self->sent ? 1u : 0u))
+	{
+		char *qmsg = SENDQ_SLOT(self, --i);
+		struct spr16_msghdr *qhdr = (struct spr16_msghdr *)qmsg;
+		struct spr16_msgdata_input *qinput;
+
+		if (sendq_is_transition(qmsg))
+			return 0;
+		qinput = (struct spr16_msgdata_input *)(qmsg + sizeof(*qhdr));
+		if (qhdr->type != hdr->type || qinput->type != input->type
+				|| qinput->id != input->id
+				|| qinput->code != input->code)
+			continue;
+		if (hdr->type == SPRITEMSG_INPUT_SURFACE) {
+			/* same contact still held, take the newer position */
+			memcpy(qinput, input, sizeof(struct spr16_msgdata_input_surface));
+		}
+		else if (input->type == SPR16_INPUT_AXIS_RELATIVE) {
+			qinput->val += input->val;
+		}
+		else {
+			qinput->val = input->val;
+			qinput->ext = input->ext;
+		}
+		++self->merged;
+		return 1;
+	}
+	return 0;
+}
+
+/* merge or append behind the backlog */
+static int sendq_push(struct sendq *self, char *msg, uint32_t len)
+{
+	if (self->count && sendq_merge(self, msg))
+		return 0;
+	if (self->count >= self->max) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	memcpy(SENDQ_SLOT(self, self->count), msg, len);
+	self->lens[(self->head + self->count) % self->max] = len;
+	++self->count;
+	return 0;
+}
+
+/* drop whatever went out, a message that was cut short stays at the head */
+static void sendq_pop(struct sendq *self, uint32_t bytes)
+{
+	bytes += self->sent;
+	while (self->count && bytes >= self->lens[self->head])
+	{
+		bytes -= self->lens[self->head];
+		self->head = (self->head + 1) % self->max;
+		--self->count;
+	}
+	self->sent = bytes;
+}
+
+/* buf holds whole messages, each one fits a slot */
+static int sendq_send(struct sendq *self, int fd, char *buf, uint32_t len)
+{
+	uint32_t pos;
+	uint32_t msglen;
+	uint32_t sent = 0;
+	int ret = 0;
+
+	/* try to get the backlog out first so nothing is sent out of order */
+	if (self->count && sendq_flush(self, fd) == -1)
+		return -1;
+	if (self->count == 0) {
+		int r = spr16_write_some(fd, buf, len);
+		if (r == -1)
+			return -1;
+		if ((uint32_t)r == len)
+			return 0;
+		sent = r;
+	}
+	for (pos = 0; pos < len; pos += msglen)
+	{
+		msglen = sizeof(struct spr16_msghdr)
+			+ get_msghdr_typelen((struct spr16_msghdr *)(buf + pos));
+		if (pos + msglen <= sent)
+			continue;
+		if (sendq_push(self, buf + pos, msglen)) {
+			ret = -1;
+			continue;
+		}
+		/* the queue was empty, this one is the head */
+		if (pos < sent)
+			self->sent = sent - pos;
+	}
+	return ret;
+}
+
+int sendq_write(struct sendq *self, int fd, struct spr16_msghdr *hdr,
+		void *msgdata, size_t msgdata_len)
+{
+	char msg[SPR16_MAXMSGLEN];
+
+	if (msgdata_len > SPR16_MAXMSGLEN - sizeof(*hdr)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	memcpy(msg, hdr, sizeof(*hdr));
+	memcpy(msg + sizeof(*hdr), msgdata, msgdata_len);
+	return sendq_send(self, fd, msg, msgdata_len + sizeof(*hdr));
+}
+
+int sendq_stage(struct sendq *self, struct spr16_msghdr *hdr,
+		void *msgdata, size_t msgdata_len)
+{
+	if (msgdata_len > SPR16_MAXMSGLEN - sizeof(*hdr)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (self->stage_len + sizeof(*hdr) + msgdata_len
+			> SENDQ_FRAME * SPR16_MAXMSGLEN) {
+		errno = ENOSPC;
+		return -1;
+	}
+	memcpy(self->stage + self->stage_len, hdr, sizeof(*hdr));
+	memcpy(self->stage + self->stage_len + sizeof(*hdr), msgdata, msgdata_len);
+	self->stage_len += sizeof(*hdr) + msgdata_len;
+	return 0;
+}
+
+int sendq_commit(struct sendq *self, int fd)
+{
+	uint32_t len = self->stage_len;
+
+	if (len == 0)
+		return 0;
+	self->stage_len = 0;
+	return sendq_send(self, fd, self->stage, len);
+}
+
+int sendq_flush(struct sendq *self, int fd)
+{
+	char buf[SPR16_MAXMSGLEN * SENDQ_BATCH];
+	uint32_t batch = SENDQ_BATCH;
+
+	while (self->count)
+	{
+		uint32_t len = 0;
+		uint32_t n;
+		int r;
+
+		for (n = 0; n < batch && n < self->count; ++n)
+		{
+			uint16_t mlen = self->lens[(self->head + n) % self->max];
+			memcpy(buf + len, SENDQ_SLOT(self, n), mlen);
+			len += mlen;
+		}
+		len -= self->sent;
+		r = spr16_write_some(fd, buf + self->sent, len);
+		if (r == -1)
+			return -1;
+		if (r == 0) {
+			/* a ring takes whole batches only, there may be room
+			 * for some of it */
+			if (batch == 1)
+				return self->count;
+			batch = 1;
+			continue;
+		}
+		sendq_pop(self, r);
+		/* socket is full, the rest waits for FDPOLLOUT */
+		if ((uint32_t)r < len)
+			return self->count;
+	}
+	return 0;
+}
@@ -0,0 +1,66 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * per client outbound message queue. messages are written straight to the
+ * socket until it fills, then they wait here until the server sees FDPOLLOUT
+ * (or the client's ring doorbell) and flushes them in order. while a client
+ * is backed up, new axis and surface contact updates are merged into ones
+ * still queued so a slow client catches up to the current state instead of
+ * replaying every step. key, button, control and contact release messages
+ * are never merged or moved, and nothing merges across them. when the queue
+ * is full the client has stopped reading.
+ *
+ * the server never waits on a client, if a socket takes only part of a
+ * message the rest stays queued and goes out first on the next flush.
+ *
+ * messages can also be staged and committed together, an input frame goes
+ * out in one write and the client never sees half of it.
+ */
+
+#ifndef LINUX_SENDQ_H__
+#define LINUX_SENDQ_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../../spr16.h"
+
+#define SENDQ_MSGS 256
+#define SENDQ_FRAME 32 /* messages staged before a commit is forced */
+
+struct sendq {
+	char *msgs;        /* max slots of SPR16_MAXMSGLEN */
+	uint16_t *lens;
+	uint32_t max;
+	uint32_t head;     /* oldest queued message */
+	uint32_t count;
+	uint32_t sent;     /* bytes of the head message already written */
+	uint32_t merged;   /* updates merged into queued messages */
+	char *stage;       /* packed messages waiting for commit */
+	uint32_t stage_len;
+};
+
+struct sendq *sendq_create(uint32_t max);
+void sendq_destroy(struct sendq *self);
+/* -1 with ENOBUFS if queue is full, other errno's are from write */
+int sendq_write(struct sendq *self, int fd, struct spr16_msghdr *hdr,
+		void *msgdata, size_t msgdata_len);
+/* -1 with ENOSPC if the stage is full, commit and try again */
+int sendq_stage(struct sendq *self, struct spr16_msghdr *hdr,
+		void *msgdata, size_t msgdata_len);
+/* writes or queues everything staged, errors are the same as sendq_write */
+int sendq_commit(struct sendq *self, int fd);
+/* returns number of messages still queued, or -1 on write error */
+int sendq_flush(struct sendq *self, int fd);
+
+#endif
@@ -41,20 +41,24 @@
 
 #include "../../spr16.h"
 #include "../../screen.h"
+#include "../../dmg.h"
 #include "../fdpoll-handler.h"
 #include "platform.h"
 #include "vt.h"
 #include "fb.h"
+#include "compositor.h"
+#include "sendq.h"
 
 sig_atomic_t g_input_muted; /* don't forward input if muted */
 sig_atomic_t g_unmute_input;
 sig_atomic_t g_is_active;
-extern struct drm_kms *g_card0; /* last remaining drm specific hack */
+extern struct server_options g_srv_opts;
 
 #define MAX_ACCEPT 5
 #define STRERR strerror(errno)
 
 int client_callback(int fd, int event_flags, void *user_data);
+int msgring_callback(int fd, int event_flags, void *user_data);
 int listener_callback(int fd, int event_flags, void *user_data);
 int hotkey_callback(uint32_t hk, void *v);
 
@@ -145,12 +149,18 @@ static int server_remove_client(struct server_context *self, int fd)
 		}
 		cl = screen_remove_client(scrn, fd);
 		if (cl) {
+			if (cl->on_plane == 1)
+				self->output->plane_detach(self->output, cl);
+			cl->on_plane = 0;
+			fb_frame_remove(self, cl);
 			spr16_send_nack(fd, SPRITENACK_DISCONNECT);
 			if (server_free_client(self, cl))
 				return -1;
-			*trail = scrn->next;
-			/* TODO, clear region? */
-			free(scrn); /* TODO, dont free, for multi-client... */
+			if (scrn->clients == NULL) {
+				*trail = scrn->next;
+				free(scrn);
+			}
+			/* redraws whatever was under it */
 			server_sync_fullscreen(self);
 			return 0;
 		}
@@ -172,15 +182,25 @@ static int server_connect_client(struct server_context *self, struct client *cl)
 {
 	struct screen *scrn, *tmp;
 
+	if (!server_remove_pending(self, cl->socket)) {
+		printf("pending client not found\n");
+		return -1;
+	}
+	if ((cl->sprite.flags & SPRITE_FLAG_SHARED) && self->main_screen
+			&& !(cl->sprite.flags & SPRITE_FLAG_DIRECT_SHM)) {
+		if (screen_add_client(self->main_screen, cl) == 0) {
+			printf("-- sprite added to main screen at (%d, %d, %d) --\n",
+					cl->sprite.x, cl->sprite.y, cl->sprite.z);
+			goto connected;
+		}
+		printf("main screen is full\n");
+	}
+
 	scrn = calloc(1, sizeof(struct screen));
 	if (scrn == NULL)
 		return -1;
 	if (screen_init(scrn))
 		goto err;
-	if (!server_remove_pending(self, cl->socket)) {
-		printf("pending client not found\n");
-		goto err;
-	}
 	if (screen_add_client(scrn, cl))
 		goto err;
 	/* add to end of screen list */
@@ -197,8 +217,12 @@ static int server_connect_client(struct server_context *self, struct client *cl)
 		self->main_screen = scrn;
 		printf("-- new screen added to empty list --\n");
 	}
+connected:
 	cl->connected = 1;
 	cl->handshaking = 0;
+	/* a new sprite can cover one that was on a plane */
+	if (fb_assign_planes(self))
+		server_sync_fullscreen(self);
 	return 0;
 err:
 	free(scrn);
@@ -273,6 +297,12 @@ static int server_addclient(struct server_context *self, int fd)
 		return -1;
 	}
 	cl->sprite.shmem.fd = -1;
+	cl->sendq = sendq_create(SENDQ_MSGS);
+	cl->rxbuf = spr16_rxbuf_create();
+	if (cl->sendq == NULL || cl->rxbuf == NULL) {
+		printf("could not create message buffers\n");
+		goto err;
+	}
 
 	/* send server info to client */
 	if (spr16_server_servinfo(self, fd)) {
@@ -296,7 +326,9 @@ static int server_addclient(struct server_context *self, int fd)
 	printf("client(%d)added to server\n", fd);
 	return 0;
 err:
-	close(cl->socket);
+	close(fd);
+	sendq_destroy(cl->sendq);
+	spr16_rxbuf_destroy(cl->rxbuf);
 	free(cl);
 	return -1;
 }
@@ -312,6 +344,53 @@ static int client_handshake(struct server_context *self, struct client *cl)
 	return 0;
 }
 
+static void destroy_msgring(struct server_context *self, struct client *cl)
+{
+	if (cl->msgring == NULL)
+		return;
+	spr16_msgring_detach(cl->socket);
+	if (cl->msgring_cb) {
+		fdpoll_handler_remove(self->fdpoll, spr16_msgring_bell(cl->msgring));
+		free(cl->msgring_cb);
+		cl->msgring_cb = NULL;
+	}
+	spr16_msgring_destroy(cl->msgring);
+	cl->msgring = NULL;
+}
+
+/* sprite, and message rings if the client gets them. everything after this
+ * goes through the rings, the client clears it's socket buffer before SEND_FD */
+static int send_descriptors(struct server_context *self, struct client *cl)
+{
+	int fds[SPR16_MAXFDS];
+
+	fds[0] = cl->sprite.shmem.fd;
+	if (cl->msgring == NULL)
+		return afunix_send_fds(cl->socket, fds, 1);
+
+	cl->msgring_cb = calloc(1, sizeof(struct cl_cb_data));
+	if (cl->msgring_cb == NULL)
+		goto fallback;
+	cl->msgring_cb->self = self;
+	cl->msgring_cb->cl = cl;
+	if (fdpoll_handler_add(self->fdpoll, spr16_msgring_bell(cl->msgring),
+				FDPOLLIN, msgring_callback, cl->msgring_cb)) {
+		printf("fdpoll_handler_add(msgring) failed\n");
+		free(cl->msgring_cb);
+		cl->msgring_cb = NULL;
+		goto fallback;
+	}
+	if (spr16_msgring_attach(cl->socket, cl->msgring))
+		goto fallback;
+	memcpy(&fds[1], spr16_msgring_fds(cl->msgring), sizeof(int) * SPR16_MSGRING_FDS);
+	return afunix_send_fds(cl->socket, fds, 1 + SPR16_MSGRING_FDS);
+
+fallback:
+	printf("message rings unavailable, using socket\n");
+	destroy_msgring(self, cl);
+	return afunix_send_fds(cl->socket, fds, 1);
+}
+
 static int handle_ack(struct server_context *self, struct client *cl, struct spr16_msgdata_ack *ack)
 {
 	switch (ack->info)
@@ -325,7 +404,7 @@ static int handle_ack(struct server_context *self, struct client *cl, struct spr
 				return -1;
 			if (cl->sprite.shmem.fd <= 0)
 				return -1;
-			if (afunix_send_fd(cl->socket, cl->sprite.shmem.fd)) {
+			if (send_descriptors(self, cl)) {
 				printf("could not send descriptor\n");
 				return -1;
 			}
@@ -368,38 +447,23 @@ int memfd_create(const char *__name, unsigned int __flags)
 	return syscall(SYS_memfd_create, __name, __flags);
 }
 
-int spr16_create_memfd(struct client *cl)
+/* size is sealed so the client can't shrink it out from under our mapping */
+static int create_sealed_memfd(const char *name, uint32_t size)
 {
-	uint32_t shmsize;
-	int memfd = -1;
-	char *addr = NULL;
+	int memfd;
 	unsigned int seals;
 	unsigned int checkseals;
-	uint16_t width = cl->sprite.width;
-	uint16_t height = cl->sprite.height;
-	uint8_t bpp = cl->sprite.bpp;
-
-	shmsize = width * height * (bpp/8);
-	if (!shmsize)
-		return -1;
 
-	/* create sprite memory region */
-	memfd = memfd_create("sprite16", MFD_ALLOW_SEALING);
+	memfd = memfd_create(name, MFD_ALLOW_SEALING);
 	if (memfd == -1) {
 		printf("create error: %s\n", STRERR);
 		return -1;
 	}
-       	if (ftruncate(memfd, shmsize) == -1) {
+	if (ftruncate(memfd, size) == -1) {
 		printf("truncate error: %s\n", STRERR);
 		goto failure;
 	}
 
-	addr = mmap(0, shmsize, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
-	if (addr == MAP_FAILED) {
-		printf("mmap(%d) error: %s\n", memfd, STRERR);
-		goto failure;
-	}
-
 	/* seal size */
 	seals =	  F_SEAL_SHRINK
 		| F_SEAL_GROW
@@ -412,22 +476,60 @@ int spr16_create_memfd(struct client *cl)
 	if (checkseals != seals) {
 		goto failure;
 	}
+	return memfd;
+
+failure:
+	close(memfd);
+	return -1;
+}
+
+int spr16_create_memfd(struct client *cl)
+{
+	uint32_t shmsize;
+	long pagesize;
+	int memfd = -1;
+	char *addr = NULL;
+
+	shmsize = spr16_sprite_size(cl->sprite.format, cl->sprite.width,
+				    cl->sprite.height);
+	if (!shmsize)
+		return -1;
+	/* whole pages, so it can be turned into a dma-buf for overlay planes */
+	pagesize = sysconf(_SC_PAGESIZE);
+
+	/* create sprite memory region */
+	memfd = create_sealed_memfd("sprite16", (shmsize + pagesize - 1) & ~(pagesize - 1));
+	if (memfd == -1)
+		return -1;
+
+	addr = mmap(0, shmsize, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (addr == MAP_FAILED) {
+		printf("mmap(%d) error: %s\n", memfd, STRERR);
+		close(memfd);
+		return -1;
+	}
 	cl->sprite.shmem.size = shmsize;
 	cl->sprite.shmem.addr = addr;
 	cl->sprite.shmem.fd   = memfd;
 	return memfd;
+}
 
-failure:
-	close(memfd);
-	if (addr) {
-		if (munmap(addr, shmsize)) {
-			printf("munmap failed; %s\n", STRERR);
-		}
+/* falls back to the socket if anything goes wrong */
+static void create_msgring(struct client *cl)
+{
+	int memfd = create_sealed_memfd("spr16msg", spr16_msgring_size());
+	if (memfd == -1)
+		return;
+	cl->msgring = spr16_msgring_create(memfd);
+	if (cl->msgring == NULL) {
+		printf("could not create message rings\n");
+		close(memfd);
 	}
-	return -1;
 }
 
-static int spr16_server_register_sprite(struct server_context *self, int fd, struct spr16_msgdata_register_sprite *reg)
+static int spr16_server_register_sprite(struct server_context *self, int fd,
+					 uint16_t bits,
+					 struct spr16_msgdata_register_sprite *reg)
 {
 	/* TODO, pass cl directly  */
 	struct client *cl = server_getclient(self, fd);
@@ -440,30 +542,90 @@ static int spr16_server_register_sprite(struct server_context *self, int fd, str
 		printf("bad client\n");
 		return -1;
 	}
-	if (reg->width > self->fb->width || !reg->width) {
+	if (reg->scale > SPR16_SCALE_MAX || reg->filter > SPR16_FILTER_BILINEAR) {
+		printf("bad scale\n");
+		spr16_send_nack(fd, SPRITENACK_SIZE);
+		return -1;
+	}
+	/* scaled copies only handle opaque xrgb8888 */
+	if (reg->scale > 1 && (reg->format != SPR16_FORMAT_XRGB8888
+				|| (reg->flags & (SPRITE_FLAG_DIRECT_SHM
+						 |SPRITE_FLAG_TRANSLUCENT)))) {
+		printf("bad scale\n");
+		spr16_send_nack(fd, SPRITENACK_SIZE);
+		return -1;
+	}
+	if (SPR16_SCALED(reg, reg->width) > self->fb->width || !reg->width) {
 		printf("bad width\n");
 		spr16_send_nack(fd, SPRITENACK_WIDTH);
 		return -1;
 	}
-	if (reg->height > self->fb->height || !reg->height) {
+	if (SPR16_SCALED(reg, reg->height) > self->fb->height || !reg->height) {
 		printf("bad height\n");
 		spr16_send_nack(fd, SPRITENACK_HEIGHT);
 		return -1;
 	}
-	if (reg->bpp > self->fb->bpp || reg->bpp < 8) {
+	if (reg->bpp != spr16_format_bpp(reg->format) || reg->bpp > self->fb->bpp) {
 		printf("bad bpp\n");
 		spr16_send_nack(fd, SPRITENACK_BPP);
 		return -1;
 	}
+	/* other formats are expanded to 32bpp scanout as they are copied */
+	if (reg->format != SPR16_FORMAT_XRGB8888 && (self->fb->bpp != 32
+				|| (reg->flags & SPRITE_FLAG_DIRECT_SHM))) {
+		printf("bad format\n");
+		spr16_send_nack(fd, SPRITENACK_BPP);
+		return -1;
+	}
 	cl->handshaking = 1;
 	cl->sprite.bpp = reg->bpp;
+	cl->sprite.format = reg->format;
+	cl->sprite.scale = reg->scale ? reg->scale : 1;
+	cl->sprite.filter = reg->filter;
 	cl->sprite.width = reg->width;
 	cl->sprite.height = reg->height;
-	cl->sprite.shmem.size = (reg->bpp/8) * reg->width * reg->height;
+	cl->sprite.shmem.size = spr16_sprite_size(reg->format, reg->width, reg->height);
 	cl->sprite.shmem.addr = NULL;
 	cl->sprite.flags = reg->flags;
+	/* no alpha to blend with */
+	if (reg->format != SPR16_FORMAT_XRGB8888)
+		cl->sprite.flags &= ~SPRITE_FLAG_TRANSLUCENT;
+	/* direct mapped sprites are the scanout buffer, always fullscreen */
+	if (reg->flags & SPRITE_FLAG_DIRECT_SHM) {
+		cl->sprite.flags &= ~SPRITE_FLAG_TRANSLUCENT;
+	}
+	else {
+		cl->sprite.x = reg->x;
+		cl->sprite.y = reg->y;
+		cl->sprite.z = reg->z;
+	}
+	cl->dmg = dmg_tiles_create(reg->width, reg->height);
+	if (cl->dmg == NULL) {
+		printf("could not create damage tiles\n");
+		return -1;
+	}
+	/* only the luma plane would be hashed, chroma changes would be lost */
+	if (g_srv_opts.tile_hash && !(cl->sprite.flags & SPRITE_FLAG_DIRECT_SHM)
+			&& !SPR16_FORMAT_IS_YUV(reg->format)) {
+		if (dmg_tiles_enable_hash(cl->dmg)) {
+			printf("could not enable tile hashing\n");
+			return -1;
+		}
+	}
+	if (self->output->flip && !(cl->sprite.flags & SPRITE_FLAG_DIRECT_SHM)) {
+		cl->age[0] = dmg_tiles_create(reg->width, reg->height);
+		cl->age[1] = dmg_tiles_create(reg->width, reg->height);
+		if (cl->age[0] == NULL || cl->age[1] == NULL) {
+			printf("could not create buffer age tiles\n");
+			return -1;
+		}
+	}
 
 	printf("client requesting sprite(%dx%d:%d)\n", reg->width, reg->height, reg->bpp);
+	if (cl->sprite.scale > 1)
+		printf("scaled %dx to %dx%d\n", cl->sprite.scale,
+				SPR16_SCALED(&cl->sprite, reg->width),
+				SPR16_SCALED(&cl->sprite, reg->height));
 
 	if (cl->sprite.flags & SPRITE_FLAG_DIRECT_SHM) {
 		char *addr = NULL;
@@ -472,10 +634,8 @@ static int spr16_server_register_sprite(struct server_context *self, int fd, str
 		uint16_t height = cl->sprite.height;
 		uint8_t bpp = cl->sprite.bpp;
 		size_t size = width * height * (bpp/8);
-		/* TODO make all drm calls from main.c, get rid of struct in server
-		 * and only allow this if client requests full screen, unless overlays
-		 */
-		if (drm_prime_export_fd(g_card0->card_fd, g_card0->sfb, &prime_fd)) {
+		/* TODO only allow this if client requests full screen, unless overlays */
+		if (self->output->export_fd(self->output, &prime_fd)) {
 			printf("could not export prime fd\n");
 			spr16_send_nack(fd, SPRITENACK_SHMEM);
 			return -1;
@@ -492,7 +652,7 @@ static int spr16_server_register_sprite(struct server_context *self, int fd, str
 
 		cl->sprite.shmem.addr = addr;
 		cl->sprite.shmem.fd = prime_fd;
-		cl->sprite.shmem.size = g_card0->sfb->size;
+		cl->sprite.shmem.size = self->fb->size;
 	}
 	else {
 		if (spr16_create_memfd(cl) == -1) {
@@ -502,6 +662,9 @@ static int spr16_server_register_sprite(struct server_context *self, int fd, str
 		}
 	}
 
+	if ((bits & SPRITEREG_FLAG_MSGRINGS) && g_srv_opts.msg_rings)
+		create_msgring(cl);
+
 	if (spr16_send_ack(fd, SPRITEACK_RECV_FD)) {
 		printf("send_descriptor ack failed\n");
 		return -1;
@@ -590,7 +753,7 @@ static int server_create_socket(struct server_context *self, char *sockname)
 
 struct server_context *spr16_server_init(char *sockname,
 					 struct fdpoll_handler *fdpoll,
-					 struct spr16_framebuffer *fb)
+					 struct output *output)
 {
 	struct server_context *self = calloc(1, sizeof(struct server_context));
 	if (self == NULL)
@@ -602,12 +765,17 @@ struct server_context *spr16_server_init(char *sockname,
 	self->free_count = 0;
 	self->fdpoll = fdpoll;
 	self->listen_fd = server_create_socket(self, sockname);
-	self->card0 = g_card0;
+	self->output = output;
 	if (self->listen_fd == -1) {
 		free(self);
 		return NULL;
 	}
-	self->fb = fb;
+	self->fb = &output->fb;
+	if (fb_frame_init(self, g_srv_opts.frame_sched)) {
+		close(self->listen_fd);
+		free(self);
+		return NULL;
+	}
 
 	/* TODO maybe turn off kbd if using evdev, but i like having the kernel
 	 * trigger vt switching, despite the xorg alt-keystate annoyances */
@@ -636,31 +804,6 @@ int spr16_server_is_active()
 	return g_is_active;
 }
 
-/* i really want TODO some smarter damage merging. at very least a grid that
- * prevents syncing the same region twice would be the best optimization,
- * when e.g. rapidly syncing large regions in async mode...
- */
-static void accumulate_dmg(struct client *cl, struct spr16_msgdata_sync dmg)
-{
-	const uint16_t last_idx = SPR16_DMG_SLOTS - 1;
-
-	if (cl->dmg_count < SPR16_DMG_SLOTS) {
-		cl->dmg[cl->dmg_count] = dmg;
-		++cl->dmg_count;
-	}
-	else {
-		struct spr16_msgdata_sync old = cl->dmg[last_idx];
-		if (dmg.xmin < old.xmin)
-			cl->dmg[last_idx].xmin = dmg.xmin;
-		if (dmg.ymin < old.ymin)
-			cl->dmg[last_idx].ymin = dmg.ymin;
-		if (dmg.xmax > old.xmax)
-			cl->dmg[last_idx].xmax = dmg.xmax;
-		if (dmg.ymax > old.ymax)
-			cl->dmg[last_idx].ymax = dmg.ymax;
-	}
-}
-
 static int add_sync_client(struct server_context *self, struct client *cl)
 {
 	int i;
@@ -678,9 +821,8 @@ static int add_sync_client(struct server_context *self, struct client *cl)
 	return -1;
 }
 
-static int spr16_server_sync(struct server_context *self,
+static int sync_damage(struct server_context *self,
 		       struct client *cl,
-		       uint16_t flags,
 		       struct spr16_msgdata_sync *region)
 {
 	struct spr16_msgdata_sync dmg;
@@ -696,18 +838,38 @@ static int spr16_server_sync(struct server_context *self,
 		return -1;
 	}
 
+	dmg.xmin   = region->xmin;
+	dmg.xmax   = region->xmax;
+	dmg.ymin   = region->ymin;
+	dmg.ymax   = region->ymax;
+	if (dmg_tiles_add(cl->dmg, &dmg)) {
+		/* still ack any vblank flags, the client may be waiting on it */
+		printf("sync outside of sprite(%d, %d, %d, %d)\n",
+				dmg.xmin, dmg.ymin, dmg.xmax, dmg.ymax);
+	}
+	return 0;
+}
 
-	if (!self->fb->addr || !cl->sprite.shmem.addr) {
+/* regions are added to damage first, flags apply once to all of them */
+static int spr16_server_sync(struct server_context *self,
+		       struct client *cl,
+		       uint16_t flags,
+		       struct spr16_msgdata_sync *regions,
+		       uint32_t count)
+{
+	uint32_t i;
+
+	if (!self->fb->addr || !cl->sprite.shmem.addr || !cl->dmg) {
 		printf("bad ptr %p %p\n", (void *)self->fb->addr,
 					  (void *)cl->sprite.shmem.addr);
 		return -1;
 	}
 
-	dmg.xmin   = region->xmin;
-	dmg.xmax   = region->xmax;
-	dmg.ymin   = region->ymin;
-	dmg.ymax   = region->ymax;
-	accumulate_dmg(cl, dmg);
+	for (i = 0; i < count; ++i)
+	{
+		if (sync_damage(self, cl, &regions[i]))
+			return -1;
+	}
 
 	if (flags & ~(SPRITESYNC_FLAG_MASK)) {
 		return -1;
@@ -725,10 +887,13 @@ static int server_free_list(struct server_context *self)
 	if (self->free_count) {
 		struct client *cl;
 		unsigned int i;
+		/* queued copies may still read from the sprites */
+		compositor_wait();
 		for (i = 0; i < self->free_count; ++i)
 		{
 			cl = self->free_list[i];
 
+			destroy_msgring(self, cl);
 			close(cl->socket);
 			/* free shared memory */
 			if (cl->sprite.shmem.size) {
@@ -741,6 +906,11 @@ static int server_free_list(struct server_context *self)
 					ret = -1;
 				}
 			}
+			dmg_tiles_destroy(cl->dmg);
+			dmg_tiles_destroy(cl->age[0]);
+			dmg_tiles_destroy(cl->age[1]);
+			sendq_destroy(cl->sendq);
+			spr16_rxbuf_destroy(cl->rxbuf);
 			free(cl);
 			self->free_list[i] = NULL;
 		}
@@ -767,6 +937,7 @@ int spr16_server_update(struct server_context *self)
 				break;
 			if (fb_sync_client(self, cl))
 				printf("fb_sync_client(%d) failed\n", cl->socket);
+			cl->sync_flags = 0;
 			cl->syncing = 0;
 			self->sync_clients[i] = NULL;
 		}
@@ -799,6 +970,7 @@ int spr16_server_shutdown(struct server_context *self)
 	}
 	self->main_screen = NULL;
 	server_free_list(self);
+	fb_frame_shutdown(self);
 	close(self->listen_fd);
 	free(self);
 	return 0;
@@ -811,22 +983,86 @@ void server_sync_fullscreen(struct server_context *self)
 	if (self->main_screen == NULL)
 		return;
 
+	fb_assign_planes(self);
+	fb_clear_background(self);
 	cl = self->main_screen->clients;
 	while (cl)
 	{
-		/* will have to choose between flip/vblank when flip is implemented*/
-		uint16_t flags = SPRITESYNC_FLAG_ASYNC|SPRITESYNC_FLAG_VBLANK;
+		/* page flip falls back to vblank if the output can't flip */
+		uint16_t flags = SPRITESYNC_FLAG_ASYNC|SPRITESYNC_FLAG_PAGE_FLIP;
 		struct spr16_msgdata_sync sync;
 		sync.xmin = 0;
 		sync.ymin = 0;
 		sync.xmax = cl->sprite.width-1;
 		sync.ymax = cl->sprite.height-1;
-		spr16_server_sync(self, cl, flags, &sync);
+		/* scanout no longer holds what the hashes describe */
+		if (cl->dmg)
+			dmg_tiles_hash_reset(cl->dmg);
+		spr16_server_sync(self, cl, flags, &sync, 1);
 		cl = cl->next;
 	}
 }
 
-int spr16_server_reset_client(struct client *cl)
+/* anything left behind waits for the client, rings wake us through their
+ * doorbell when there is room, sockets need FDPOLLOUT */
+static int server_sendq_check(struct server_context *self, struct client *cl,
+			      int err)
+{
+	if (err) {
+		if (errno == ENOBUFS) {
+			/* hangup removes it on the next poll */
+			printf("client(%d) stopped reading, disconnecting\n", cl->socket);
+			shutdown(cl->socket, SHUT_RDWR);
+		}
+		return -1;
+	}
+	if (cl->sendq->count && !cl->sendq_armed && !cl->msgring) {
+		if (fdpoll_handler_modify(self->fdpoll, cl->socket, FDPOLLIN|FDPOLLOUT))
+			return -1;
+		cl->sendq_armed = 1;
+	}
+	return 0;
+}
+
+/* queues behind anything the client hasn't taken yet */
+int spr16_server_send(struct server_context *self, struct client *cl,
+		      struct spr16_msghdr *hdr, void *msgdata, size_t msgdata_len)
+{
+	int err = sendq_write(cl->sendq, cl->socket, hdr, msgdata, msgdata_len);
+	return server_sendq_check(self, cl, err);
+}
+
+/* held until spr16_server_commit, unless the stage fills up first */
+int spr16_server_stage(struct server_context *self, struct client *cl,
+		       struct spr16_msghdr *hdr, void *msgdata, size_t msgdata_len)
+{
+	if (sendq_stage(cl->sendq, hdr, msgdata, msgdata_len) == 0)
+		return 0;
+	if (errno != ENOSPC || spr16_server_commit(self, cl))
+		return -1;
+	return sendq_stage(cl->sendq, hdr, msgdata, msgdata_len);
+}
+
+int spr16_server_commit(struct server_context *self, struct client *cl)
+{
+	int err = sendq_commit(cl->sendq, cl->socket);
+	return server_sendq_check(self, cl, err);
+}
+
+static int server_flush_client(struct server_context *self, struct client *cl)
+{
+	int r = sendq_flush(cl->sendq, cl->socket);
+	if (r == -1)
+		return -1;
+	if (r == 0 && cl->sendq_armed) {
+		if (fdpoll_handler_modify(self->fdpoll, cl->socket, FDPOLLIN))
+			return -1;
+		cl->sendq_armed = 0;
+	}
+	return 0;
+}
+
+int spr16_server_reset_client(struct server_context *self, struct client *cl)
 {
 	struct spr16_msgdata_input data;
 	struct spr16_msghdr hdr;
@@ -836,17 +1072,17 @@ int spr16_server_reset_client(struct client *cl)
 	data.type = SPR16_INPUT_CONTROL;
 	data.code = SPR16_CTRLCODE_RESET;
 
-	if (spr16_write_msg(cl->socket, &hdr, &data, sizeof(data))) {
+	if (spr16_server_send(self, cl, &hdr, &data, sizeof(data))) {
 		return -1;
 	}
 	return 0;
 }
 
-static int focus_client(struct client *cl)
+static int focus_client(struct server_context *self, struct client *cl)
 {
 	if (!cl)
 		return -1;
-	return spr16_server_reset_client(cl);
+	return spr16_server_reset_client(self, cl);
 }
 
 /*
@@ -887,7 +1123,7 @@ static int main_screen_switch(struct server_context *self, int scrn)
 	}
 	input_flush_all_devices(self->input_devices);
 	server_sync_fullscreen(self);
-	focus_client(self->main_screen->clients);
+	focus_client(self, self->main_screen->clients);
 	return 0;
 }
 
@@ -954,8 +1190,24 @@ int spr16_server_ack(struct server_context *self, struct client *cl, struct spr1
 	else
 		return handle_nack(self, cl, ack);
 }
+/* clients built against the original protocol, everything new is left 0 */
+static void register_sprite_v0(struct spr16_msgdata_register_sprite *reg,
+			       char *msgdata)
+{
+	struct spr16_msgdata_register_sprite_v0 v0;
+
+	memcpy(&v0, msgdata, sizeof(v0));
+	memset(reg, 0, sizeof(*reg));
+	memcpy(reg->name, v0.name, sizeof(reg->name));
+	reg->flags  = v0.flags;
+	reg->width  = v0.width;
+	reg->height = v0.height;
+	reg->bpp    = v0.bpp;
+}
+
 int spr16_dispatch_server_msgs(struct server_context *self, struct client *cl, char *msgbuf, uint32_t buflen)
 {
+	struct spr16_msgdata_register_sprite reg;
 	struct spr16_msghdr *msghdr;
 	char *msgpos, *msgdata;
 	int rdpos;
@@ -968,7 +1220,7 @@ int spr16_dispatch_server_msgs(struct server_context *self, struct client *cl, c
 		msghdr  = (struct spr16_msghdr *)msgpos;
 		msgdata = msgpos+sizeof(struct spr16_msghdr);
 		typelen = get_msghdr_typelen(msghdr);
-		if (typelen > SPR16_MAXMSGLEN - sizeof(struct spr16_msghdr)
+		if (typelen > SPR16_MAXVARMSGLEN - sizeof(struct spr16_msghdr)
 				|| msgdata+typelen > msgbuf+buflen) {
 			errno = EPROTO;
 			return -1;
@@ -983,16 +1235,28 @@ int spr16_dispatch_server_msgs(struct server_context *self, struct client *cl, c
 			}
 			break;
 		case SPRITEMSG_REGISTER_SPRITE:
+			if (msghdr->bits & SPRITEREG_FLAG_EXTENDED)
+				memcpy(&reg, msgdata, sizeof(reg));
+			else
+				register_sprite_v0(&reg, msgdata);
 			if (spr16_server_register_sprite(self, cl->socket,
-					(struct spr16_msgdata_register_sprite *)
-					msgdata)) {
+					msghdr->bits, &reg)) {
 				printf("register failed\n");
 				return -1;
 			}
 			break;
 		case SPRITEMSG_SYNC:
 			if (spr16_server_sync(self, cl, msghdr->bits,
-						(struct spr16_msgdata_sync *)msgdata)){
+						(struct spr16_msgdata_sync *)msgdata, 1)){
+				printf("sync failed\n");
+				return -1;
+			}
+			break;
+		case SPRITEMSG_SYNC_RECTS:
+			if (spr16_server_sync(self, cl,
+					SPRITESYNC_RECTS_FLAGS(msghdr->bits),
+					(struct spr16_msgdata_sync *)msgdata,
+					SPRITESYNC_RECTS_COUNT(msghdr->bits))) {
 				printf("sync failed\n");
 				return -1;
 			}
@@ -1039,9 +1303,22 @@ int client_callback(int fd, int event_flags, void *user_data)
 		cb_data_remove(self, cl);
 		return FDPOLL_HANDLER_OK;
 	}
+	if (event_flags & FDPOLLOUT) {
+		if (server_flush_client(self, cl)) {
+			printf("flush: %s\n", STRERR);
+			if (server_remove_client(self, fd))
+				goto remove_failed;
+			cb_data_remove(self, cl);
+			return FDPOLL_HANDLER_OK;
+		}
+	}
+	if (!(event_flags & FDPOLLIN))
+		return FDPOLL_HANDLER_OK;
 
 	/* normal read and dispatch */
-	msgbuf = spr16_read_msgs(fd, &msglen);
+	msgbuf = spr16_rxbuf_read(cl->rxbuf, fd, &msglen);
+	if (msgbuf == NULL && errno == EAGAIN)
+		return FDPOLL_HANDLER_OK;
 	if (msgbuf == NULL) {
 		printf("read_msgs: %s\n", STRERR);
 		if (server_remove_client(self, fd))
@@ -1063,3 +1340,39 @@ remove_failed:
 	cb_data_remove(self, cl);
 	return FDPOLL_HANDLER_REMOVE;
 }
+
+/* messages the client put in it's ring */
+int msgring_callback(int fd, int event_flags, void *user_data)
+{
+	char msgbuf[SPR16_MAXVARMSGLEN * 2];
+	struct cl_cb_data *dat = user_data;
+	struct server_context *self = dat->self;
+	struct client *cl = dat->cl;
+	int msglen;
+
+	(void)fd;
+	(void)event_flags;
+	/* removed earlier in this poll, the ring goes away with the free list */
+	if (in_free_list(self, cl))
+		return FDPOLL_HANDLER_OK;
+
+	spr16_msgring_wake(cl->msgring);
+	while ((msglen = spr16_msgring_read(cl->msgring, msgbuf, sizeof(msgbuf))) > 0)
+	{
+		if (spr16_dispatch_server_msgs(self, cl, msgbuf, msglen))
+			break;
+		/* dispatch can remove the client */
+		if (in_free_list(self, cl))
+			return FDPOLL_HANDLER_OK;
+	}
+	/* the client also rings when it drains a ring we found full */
+	if (msglen == 0 && (cl->sendq->count == 0 || server_flush_client(self, cl) == 0))
+		return FDPOLL_HANDLER_OK;
+
+	printf("msgring: %s\n", STRERR);
+	if (server_remove_client(self, cl->socket))
+		printf("failed removing client(%d)\n", cl->socket);
+	else
+		cb_data_remove(self, cl);
+	return FDPOLL_HANDLER_OK;
+}
@@ -46,12 +46,14 @@ void vt_sig(int signum)
 		if (ioctl(g_ttyfd, VT_RELDISP, VT_ACKACQ) == -1) {
 			printf("ioctl(VT_RELDISP, VT_ACKACQ): %s\n", STRERR);
 		}
-		drm_acquire_signal(g_card0);
+		if (g_card0)
+			drm_acquire_signal(g_card0);
 		g_unmute_input = 1;
 		break;
 	case SIGUSR2:
 		/* vt is switchign off */
-		drm_release_signal(g_card0);
+		if (g_card0)
+			drm_release_signal(g_card0);
 		if (ioctl(g_ttyfd, VT_RELDISP, 1) == -1) {
 			printf("ioctl(VT_RELDISP, 1): %s\n", STRERR);
 		}
@@ -0,0 +1,67 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include "spsc.h"
+
+#define SLOT(self, idx) ((char *)((self) + 1) \
+		+ (((idx) & ((self)->count - 1)) * (self)->slot_size))
+
+uint32_t spsc_ring_bytes(uint32_t count, uint32_t slot_size)
+{
+	return sizeof(struct spsc_ring) + (count * slot_size);
+}
+
+int spsc_ring_init(struct spsc_ring *self, uint32_t count, uint32_t slot_size)
+{
+	if (!count || (count & (count - 1)) || !slot_size)
+		return -1;
+	memset(self, 0, sizeof(struct spsc_ring));
+	self->count = count;
+	self->slot_size = slot_size;
+	return 0;
+}
+
+void *spsc_ring_reserve(struct spsc_ring *self)
+{
+	const uint32_t tail = __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE);
+	if (self->head - tail >= self->count)
+		return NULL;
+	return SLOT(self, self->head);
+}
+
+void spsc_ring_commit(struct spsc_ring *self)
+{
+	__atomic_store_n(&self->head, self->head + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t spsc_ring_used(struct spsc_ring *self)
+{
+	return self->head - __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE);
+}
+
+void *spsc_ring_peek(struct spsc_ring *self)
+{
+	const uint32_t head = __atomic_load_n(&self->head, __ATOMIC_ACQUIRE);
+	if (head == self->tail)
+		return NULL;
+	return SLOT(self, self->tail);
+}
+
+void spsc_ring_release(struct spsc_ring *self)
+{
+	__atomic_store_n(&self->tail, self->tail + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,55 @@
+/* Copyright (C) 2017 Michael R. Tirado <mtirado418@gmail.com> -- GPLv3+
+ *
+ * This program is libre software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. You should have
+ * received a copy of the GNU General Public License version 3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * single producer, single consumer ring of fixed size slots. head only ever
+ * moves on the producer side and tail on the consumer side, so neither needs
+ * a lock, just acquire/release ordering on the index the other side owns.
+ * indexes are free running and wrap at 2^32, count must be a power of two.
+ * slots directly follow the struct, so a ring can be placed anywhere,
+ * including shared memory.
+ */
+
+#ifndef SPSC_H__
+#define SPSC_H__
+
+#include <stdint.h>
+
+#define SPSC_CACHELINE 64
+
+struct spsc_ring {
+	uint32_t head; /* next slot to fill, written by producer */
+	char pad0[SPSC_CACHELINE - sizeof(uint32_t)];
+	uint32_t tail; /* next slot to drain, written by consumer */
+	char pad1[SPSC_CACHELINE - sizeof(uint32_t)];
+	uint32_t count;
+	uint32_t slot_size;
+	char pad2[SPSC_CACHELINE - (sizeof(uint32_t) * 2)];
+};
+
+/* bytes needed for the struct and it's slots */
+uint32_t spsc_ring_bytes(uint32_t count, uint32_t slot_size);
+int spsc_ring_init(struct spsc_ring *self, uint32_t count, uint32_t slot_size);
+
+/* producer, NULL if full. the slot is not visible until commit */
+void *spsc_ring_reserve(struct spsc_ring *self);
+void  spsc_ring_commit(struct spsc_ring *self);
+/* producer, slots not drained yet */
+uint32_t spsc_ring_used(struct spsc_ring *self);
+
+/* consumer, NULL if empty. the slot is not reused until release */
+void *spsc_ring_peek(struct spsc_ring *self);
+void  spsc_ring_release(struct spsc_ring *self);
+
+#endif
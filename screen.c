@@ -27,10 +27,18 @@ int screen_init(struct screen *self)
 
 int screen_add_client(struct screen *self, struct client *cl)
 {
-	if (self->clients)
-		return -1; /* FIXME */
-	cl->next = self->clients;
-	self->clients = cl;
+	struct client **trail;
+	if (self->count >= SCREEN_MAX_SPRITES)
+		return -1;
+	/* new sprite goes above others with the same z */
+	trail = &self->clients;
+	while (*trail && (*trail)->sprite.z > cl->sprite.z)
+	{
+		trail = &(*trail)->next;
+	}
+	cl->next = *trail;
+	*trail = cl;
+	++self->count;
 	return 0;
 }
 
@@ -62,6 +70,7 @@ struct client *screen_remove_client(struct screen *self, int cl_fd)
 	{
 		if (cl->socket == cl_fd) {
 			*trail = cl->next;
+			--self->count;
 			return cl;
 		}
 		trail = &cl->next;
@@ -69,3 +78,118 @@ struct client *screen_remove_client(struct screen *self, int cl_fd)
 	}
 	return NULL;
 }
+
+/* split every piece in src around o, pieces outside of o are kept as is */
+static uint32_t subtract_rect(struct spr16_msgdata_sync *src, uint32_t count,
+			      int32_t oxmin, int32_t oymin,
+			      int32_t oxmax, int32_t oymax,
+			      struct spr16_msgdata_sync *out)
+{
+	uint32_t i;
+	uint32_t n = 0;
+	for (i = 0; i < count; ++i)
+	{
+		struct spr16_msgdata_sync r = src[i];
+		struct spr16_msgdata_sync piece;
+		if (oxmin > r.xmax || oxmax < r.xmin || oymin > r.ymax || oymax < r.ymin) {
+			out[n++] = r;
+			continue;
+		}
+		if (oymin > r.ymin) { /* above */
+			piece = r;
+			piece.ymax = oymin - 1;
+			out[n++] = piece;
+			r.ymin = oymin;
+		}
+		if (oymax < r.ymax) { /* below */
+			piece = r;
+			piece.ymin = oymax + 1;
+			out[n++] = piece;
+			r.ymax = oymax;
+		}
+		if (oxmin > r.xmin) { /* left */
+			piece = r;
+			piece.xmax = oxmin - 1;
+			out[n++] = piece;
+		}
+		if (oxmax < r.xmax) { /* right */
+			piece = r;
+			piece.xmin = oxmax + 1;
+			out[n++] = piece;
+		}
+	}
+	return n;
+}
+
+uint32_t screen_visible_rects(struct screen *self,
+			      struct client *cl,
+			      struct spr16_msgdata_sync *rect,
+			      struct spr16_msgdata_sync *out)
+{
+	static struct spr16_msgdata_sync scratch[SCREEN_MAX_VISIBLE];
+	struct spr16_msgdata_sync *src = out;
+	struct spr16_msgdata_sync *dst = scratch;
+	struct client *above;
+	uint32_t count = 1;
+
+	out[0] = *rect;
+	for (above = self->clients; above && above != cl; above = above->next)
+	{
+		struct spr16_msgdata_sync *tmp;
+		const int32_t xmin = above->sprite.x;
+		const int32_t ymin = above->sprite.y;
+		if (!above->sprite.width || !above->sprite.height
+				|| (above->sprite.flags & SPRITE_FLAG_TRANSLUCENT))
+			continue;
+		count = subtract_rect(src, count, xmin, ymin,
+				      xmin + SPR16_SCALED(&above->sprite, above->sprite.width) - 1,
+				      ymin + SPR16_SCALED(&above->sprite, above->sprite.height) - 1,
+				      dst);
+		tmp = src;
+		src = dst;
+		dst = tmp;
+		if (count == 0)
+			break;
+	}
+	if (src != out)
+		memcpy(out, src, count * sizeof(struct spr16_msgdata_sync));
+	return count;
+}
+
+int screen_clip_to_sprite(struct client *cl, struct spr16_msgdata_sync *rect)
+{
+	const int32_t xmin = cl->sprite.x;
+	const int32_t ymin = cl->sprite.y;
+	const int32_t xmax = xmin + SPR16_SCALED(&cl->sprite, cl->sprite.width) - 1;
+	const int32_t ymax = ymin + SPR16_SCALED(&cl->sprite, cl->sprite.height) - 1;
+
+	if (xmin > rect->xmax || xmax < rect->xmin
+			|| ymin > rect->ymax || ymax < rect->ymin)
+		return 0;
+	if (xmin > rect->xmin)
+		rect->xmin = xmin;
+	if (ymin > rect->ymin)
+		rect->ymin = ymin;
+	if (xmax < rect->xmax)
+		rect->xmax = xmax;
+	if (ymax < rect->ymax)
+		rect->ymax = ymax;
+	return 1;
+}
+
+int screen_sprite_above(struct screen *self,
+			struct client *cl,
+			struct spr16_msgdata_sync *rect,
+			uint32_t flags)
+{
+	struct client *above;
+	for (above = self->clients; above && above != cl; above = above->next)
+	{
+		struct spr16_msgdata_sync clip = *rect;
+		if ((above->sprite.flags & flags) == flags
+				&& screen_clip_to_sprite(above, &clip))
+			return 1;
+	}
+	return 0;
+}
+
@@ -13,9 +13,13 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  *
  *
- * TODO currently only does 1 sprite per screen which is not very sprite-like :(
- * need to add the good stuff like sprite offsets, tiling, splits, resizing (at least
- * growing), all the basic window manager type features.
+ * a screen holds up to SCREEN_MAX_SPRITES positioned sprites sorted by z,
+ * the highest z is at the list head and has focus. damage is clipped against
+ * every opaque sprite above it so covered pixels are never copied. translucent
+ * sprites never cover anything, where they overlap damage it is composed.
+ *
+ * TODO tiling, splits, resizing (at least growing), moving sprites, all the
+ * basic window manager type features.
  *
  */
 #ifndef SCREEN_H__
@@ -23,13 +27,35 @@
 
 #include "spr16.h"
 
+#define SCREEN_MAX_SPRITES 16
+/* every visible piece is a cell of the grid made by occluder edges */
+#define SCREEN_MAX_VISIBLE ((SCREEN_MAX_SPRITES * 2 + 1) * (SCREEN_MAX_SPRITES * 2 + 1))
+
 struct screen {
 	struct screen *next;
-	struct client *clients; /* head is focused client */
+	struct client *clients; /* sorted by z, head is focused client */
+	uint32_t count;
 };
 
 int screen_init(struct screen *self);
+/* -1 if screen is full */
 int screen_add_client(struct screen *self, struct client *cl);
+/* rect is inclusive in screen coordinates, out gets the pieces of rect not
+ * covered by opaque sprites above cl, or any opaque sprite if cl is NULL.
+ * out must hold SCREEN_MAX_VISIBLE rects, returns count
+ */
+uint32_t screen_visible_rects(struct screen *self,
+			      struct client *cl,
+			      struct spr16_msgdata_sync *rect,
+			      struct spr16_msgdata_sync *out);
+/* clips screen rect to the sprite, 0 if they don't intersect */
+int screen_clip_to_sprite(struct client *cl, struct spr16_msgdata_sync *rect);
+/* is any sprite with all of flags set above cl touching rect.
+ * cl NULL checks every sprite, flags 0 matches any sprite */
+int screen_sprite_above(struct screen *self,
+			struct client *cl,
+			struct spr16_msgdata_sync *rect,
+			uint32_t flags);
 struct client *screen_find_client(struct screen *self, int cl_fd);
 struct client *screen_remove_client(struct screen *self, int cl_fd);
 int screen_free(struct screen *self);
@@ -33,7 +33,8 @@
  * compression in addition to proper serialization if taking that route.
  *
  * NOTE: all structs must be evenly sized / divide evenly by 2
- * FIXME currently only supports 32bpp ARGB
+ * scanout is 32bpp XRGB, sprites may be registered in a smaller format and
+ * are expanded as they are copied out, see SPR16_FORMAT_*
  * TODO set sticky bit and check that, + perms on socket
  */
 
@@ -45,7 +46,6 @@
 #define SPR16_ACK  1
 #define SPR16_NACK 0
 #define SPR16_MAXCLIENTS 128
-#define SPR16_DMG_SLOTS 32
 
 /* added precision for acceleration curve, 1 hardware unit == 10 spr16
  * don't change this, it should be safe to assume this is universally 10
@@ -62,7 +62,10 @@
  * 		     maps shared memory between server and client.
  * ACK             - ACK or NACK message.
  * SYNC            - Sync modified sprite region.
+ * SYNC_RECTS      - Sync several regions with one set of flags.
  * INPUT           - Send input event to client.
+ * PRESENT         - Vblank or page flip sync is on screen, replaces the
+ * 		     SYNC_VSYNC / SYNC_PAGEFLIP acks.
  */
 enum {
 	SPRITEMSG_SERVINFO=100,
@@ -72,7 +75,9 @@ enum {
 	SPRITEMSG_ACK,
 	SPRITEMSG_SYNC,
 	SPRITEMSG_INPUT,
-	SPRITEMSG_INPUT_SURFACE
+	SPRITEMSG_INPUT_SURFACE,
+	SPRITEMSG_PRESENT,
+	SPRITEMSG_SYNC_RECTS
 };
 
 /* ack info
@@ -96,7 +101,8 @@ enum {
 	SPRITENACK_BPP,
 	SPRITENACK_SHMEM,
 	SPRITENACK_FD,
-	SPRITENACK_DISCONNECT
+	SPRITENACK_DISCONNECT,
+	SPRITENACK_SYNC  /* sync could not be copied, it won't be presented */
 };
 
 struct spr16_shmem {
@@ -106,6 +112,30 @@ struct spr16_shmem {
 };
 
 #define SPRITE_FLAG_DIRECT_SHM 0x0001 /* client renders directly to sprite */
+#define SPRITE_FLAG_SHARED     0x0002 /* placed at x,y,z on the main screen */
+#define SPRITE_FLAG_TRANSLUCENT 0x0004 /* premultiplied alpha, blended over */
+
+/* sprite pixel formats, only XRGB8888 can be translucent or direct mapped.
+ * INDEX8 sprites are followed by SPR16_PALETTE_COUNT XRGB8888 colors in
+ * shared memory at a 4 byte aligned offset, see spr16_sprite_palette. the
+ * palette is not damage tracked, sync whatever a palette change affects.
+ * NV12 and I420 are 4:2:0 bt.601 limited range, a full size luma plane is
+ * followed by chroma planes of half width and height rounded up, packed
+ * with no padding. see spr16_sprite_plane */
+#define SPR16_FORMAT_XRGB8888 0 /* ARGB8888 when translucent */
+#define SPR16_FORMAT_RGB565   1
+#define SPR16_FORMAT_INDEX8   2
+#define SPR16_FORMAT_NV12     3 /* y, interleaved cb cr */
+#define SPR16_FORMAT_I420     4 /* y, cb, cr */
+#define SPR16_PALETTE_COUNT   256
+#define SPR16_FORMAT_IS_YUV(f) ((f) == SPR16_FORMAT_NV12 || (f) == SPR16_FORMAT_I420)
+
+/* the server can scale an opaque XRGB8888 sprite up by a whole number as it
+ * is copied out, the client renders and syncs at the registered size */
+#define SPR16_SCALE_MAX       8
+#define SPR16_FILTER_NEAREST  0
+#define SPR16_FILTER_BILINEAR 1
+
 /* sprite object */
 struct spr16 {
 	char name[SPR16_MAXNAME];
@@ -117,15 +147,30 @@ struct spr16 {
 	uint16_t width;
 	uint16_t height;
 	uint16_t bpp;
+	uint16_t format;
+	uint8_t  scale;  /* on screen size is width * scale by height * scale */
+	uint8_t  filter;
 };
+/* on screen size, scale 0 is unscaled */
+#define SPR16_SCALED(sprite, len) ((uint32_t)(len) * ((sprite)->scale ? (sprite)->scale : 1))
 
 /* msghdr bit flags/values */
 #define SPRITESYNC_FLAG_ASYNC          0x0001
 #define SPRITESYNC_FLAG_VBLANK         0x0002
-#define SPRITESYNC_FLAG_PAGE_FLIP      0x0004 /* TODO */
+#define SPRITESYNC_FLAG_PAGE_FLIP      0x0004
 #define SPRITESYNC_FLAG_MASK (	SPRITESYNC_FLAG_ASYNC     | \
 				SPRITESYNC_FLAG_VBLANK    | \
 				SPRITESYNC_FLAG_PAGE_FLIP )
+/* SYNC_RECTS msghdr bits, flags in the low byte and rect count in the high */
+#define SPRITESYNC_RECTS_BITS(flags, count) ((uint16_t)((flags) | ((count) << 8)))
+#define SPRITESYNC_RECTS_FLAGS(bits) ((bits) & 0x00ff)
+#define SPRITESYNC_RECTS_COUNT(bits) ((bits) >> 8)
+#define SPR16_MAXSYNCRECTS 255
+/* register msghdr bits, client would like shared memory message rings */
+#define SPRITEREG_FLAG_MSGRINGS        0x0001
+/* register message has the current layout, without it the client was built
+ * against the original protocol and sent spr16_msgdata_register_sprite_v0 */
+#define SPRITEREG_FLAG_EXTENDED        0x0002
 /*
  * the msghdr is immediately followed by specific msgdata struct
  * these two structs should be written in the same write call
@@ -146,8 +191,23 @@ struct spr16_msgdata_servinfo {
 };
 
 /* this message is immediately followed by 1 byte SCM_RIGHTS message
- * to transfer sprite file descriptor to server process */
+ * to transfer sprite file descriptor to server process. if message rings
+ * were granted the ring descriptors follow the sprite in that message */
 struct spr16_msgdata_register_sprite {
+	char name[SPR16_MAXNAME];
+	uint32_t flags;
+	int16_t  x;
+	int16_t  y;
+	int16_t  z;
+	uint16_t width;
+	uint16_t height;
+	uint16_t bpp;
+	uint16_t format; /* bpp must match it */
+	uint8_t  scale;  /* 0 or 1 is unscaled */
+	uint8_t  filter;
+};
+/* original register message, an unscaled XRGB8888 sprite at 0,0 */
+struct spr16_msgdata_register_sprite_v0 {
 	char name[SPR16_MAXNAME];
 	uint32_t flags;
 	uint16_t width;
@@ -161,13 +221,28 @@ struct spr16_msgdata_ack {
 	uint16_t ack; /* 0 == nack */
 };
 
-/* client requesting synchronization */
+/* client requesting synchronization, SYNC_RECTS is an array of these */
 struct spr16_msgdata_sync {
 	uint16_t xmin;
 	uint16_t ymin;
 	uint16_t xmax;
 	uint16_t ymax;
 };
+/* longest message, only SYNC_RECTS goes beyond SPR16_MAXMSGLEN */
+#define SPR16_MAXVARMSGLEN (sizeof(struct spr16_msghdr) \
+		+ (SPR16_MAXSYNCRECTS * sizeof(struct spr16_msgdata_sync)))
+
+/* server reporting when a vblank or page flip sync was scanned out.
+ * timestamp is CLOCK_MONOTONIC, when the vblank it went out on started */
+struct spr16_msgdata_present {
+	uint32_t sequence; /* vblank counter, consecutive frames differ by 1 */
+	uint32_t tv_sec;
+	uint32_t tv_nsec;
+	uint32_t wait_us;  /* sync received until the copy started */
+	uint32_t copy_us;  /* time spent copying the sprite to scanout */
+	uint32_t dropped;  /* syncs that missed their vblank, since connecting */
+	uint32_t flags;    /* SPRITESYNC_FLAG_VBLANK or PAGE_FLIP, how it went out */
+};
 
 /*
  * type values:
@@ -284,6 +359,7 @@ enum {
 typedef int (*input_handler)(struct spr16_msgdata_input *input);
 typedef int (*input_surface_handler)(struct spr16_msgdata_input_surface *surface);
 typedef int (*servinfo_handler)(struct spr16_msgdata_servinfo *sinfo);
+typedef int (*present_handler)(struct spr16_msgdata_present *present);
 
 /*----------------------------------------------*
  * message handling                             *
@@ -291,12 +367,59 @@ typedef int (*servinfo_handler)(struct spr16_msgdata_servinfo *sinfo);
 struct client;
 uint32_t get_msghdr_typelen(struct spr16_msghdr *hdr);
 struct spr16_msgdata_servinfo *spr16_get_servinfo_msg(int fd, uint32_t *outlen, int timeout);
-char *spr16_read_msgs(int fd, uint32_t *outlen);
+/* each connection reads into it's own buffer, a message cut off by the end
+ * of a read is kept there until the rest arrives */
+struct spr16_rxbuf;
+struct spr16_rxbuf *spr16_rxbuf_create();
+void spr16_rxbuf_destroy(struct spr16_rxbuf *self);
+/* returns whole messages in place, outlen can be 0 if only part of one has
+ * arrived. NULL with EAGAIN if there was nothing to read */
+char *spr16_rxbuf_read(struct spr16_rxbuf *self, int fd, uint32_t *outlen);
 int spr16_write_msg(int fd, struct spr16_msghdr *hdr, void *msgdata, size_t msgdata_len);
+/* buf holds whole messages, they are all sent or none are (-1 with EAGAIN).
+ * any other error after part of buf went out leaves the stream torn */
+int spr16_write_msgs(int fd, char *buf, uint32_t len);
+/* returns bytes written, 0 if the socket or ring is full. a ring takes all
+ * of buf or none of it, a socket can stop anywhere */
+int spr16_write_some(int fd, char *buf, uint32_t len);
 int spr16_send_ack(int fd, uint16_t ackinfo);
 int spr16_send_nack(int fd, uint16_t ackinfo);
 int afunix_send_fd(int sock, int fd);
 int afunix_recv_fd(int sock, int *fd_out);
+/* up to SPR16_MAXFDS in one message */
+int afunix_send_fds(int sock, int *fds, unsigned int count);
+int afunix_recv_fds(int sock, int *fds_out, unsigned int max, unsigned int *count);
+/* 0 if format is unknown */
+uint16_t spr16_format_bpp(uint16_t format);
+/* shared memory bytes, including the palette */
+uint32_t spr16_sprite_size(uint16_t format, uint16_t width, uint16_t height);
+/* NULL unless sprite is INDEX8 */
+uint32_t *spr16_sprite_palette(struct spr16 *sprite);
+/* plane 0 is luma, or the pixels of a packed format. NULL if there is no
+ * such plane, stride is bytes per row */
+char *spr16_sprite_plane(struct spr16 *sprite, unsigned int plane, uint32_t *stride);
+
+/* shared memory message rings, one per direction with an eventfd doorbell
+ * each. once attached to a socket spr16_write_msg goes through the ring */
+#define SPR16_MAXFDS 4
+#define SPR16_MSGRING_FDS 3 /* memfd, server to client bell, client to server bell */
+struct spr16_msgring;
+uint32_t spr16_msgring_size();
+/* server side, memfd must be spr16_msgring_size() bytes, the ring owns it
+ * once this succeeds */
+struct spr16_msgring *spr16_msgring_create(int memfd);
+/* client side, takes ownership of the descriptors */
+struct spr16_msgring *spr16_msgring_open(int *fds);
+void spr16_msgring_destroy(struct spr16_msgring *self);
+/* SPR16_MSGRING_FDS descriptors to send to the client */
+int *spr16_msgring_fds(struct spr16_msgring *self);
+/* readable when the peer rang, call wake and then read until it returns 0 */
+int spr16_msgring_bell(struct spr16_msgring *self);
+void spr16_msgring_wake(struct spr16_msgring *self);
+/* copies whole messages out to buf, 0 when there are none left */
+int spr16_msgring_read(struct spr16_msgring *self, char *buf, uint32_t size);
+int spr16_msgring_attach(int sock, struct spr16_msgring *self);
+void spr16_msgring_detach(int sock);
 
 
 /*----------------------------------------------*
@@ -308,6 +431,12 @@ int spr16_client_handshake_start(char *name, uint16_t width, uint16_t height, ui
 int spr16_client_handshake_wait(uint32_t timeout);
 int spr16_client_servinfo(struct spr16_msgdata_servinfo *sinfo);
 int spr16_client_register_sprite(char *name, uint16_t width, uint16_t height, uint32_t flags);
+/* call before handshake, only used with SPRITE_FLAG_SHARED */
+int spr16_client_set_position(int16_t x, int16_t y, int16_t z);
+/* call before handshake, SPR16_FORMAT_XRGB8888 by default */
+int spr16_client_set_format(uint16_t format);
+/* call before handshake, width * scale must fit the server's width */
+int spr16_client_set_scale(uint8_t scale, uint8_t filter);
 int spr16_client_update(int poll_timeout); /* timeout in milliseconds, <0 blocks */
 int spr16_client_shutdown();
 struct spr16_msgdata_servinfo *spr16_client_get_servinfo();
@@ -316,10 +445,16 @@ struct spr16 *spr16_client_get_sprite();
 /* may return -1 with errno set to EAGAIN, if server buffer is full */
 int spr16_client_sync(uint16_t xmin, uint16_t ymin,
 		      uint16_t xmax, uint16_t ymax, uint16_t flags);
+/* same as above for count regions, flags apply once to all of them */
+int spr16_client_sync_rects(struct spr16_msgdata_sync *rects, uint32_t count,
+			    uint16_t flags);
 int spr16_client_waiting_for_vsync();
 int spr16_client_input(struct spr16_msgdata_input *msg);
 int spr16_client_input_surface(struct spr16_msgdata_input_surface *msg);
 int spr16_client_set_servinfo_handler(servinfo_handler func);
+/* called when a vblank or page flip sync reaches the screen */
+int spr16_client_set_present_handler(present_handler func);
+int spr16_client_present(struct spr16_msgdata_present *msg);
 
 /* input callbacks */
 int spr16_client_set_input_handler(input_handler func);
@@ -336,6 +471,7 @@ struct spr16_framebuffer
 	uint16_t width;
 	uint16_t height;
 	uint16_t bpp;
+	uint32_t pitch; /* bytes per row */
 	/*uint16_t depth;*/
 };
 
@@ -343,6 +479,14 @@ struct server_options
 {
 	/* TODO sweep up common global clutter here */
 	char socket_name[SPR16_MAX_SOCKET];
+	char blit_kernel[16];
+	int blit_threads; /* -1 for one per cpu */
+	int tile_hash;    /* skip copying tiles whose content did not change */
+	int frame_sched;  /* copy vblank syncs at a predicted deadline */
+	int compositor_thread; /* copy on it's own thread, 0 on the event loop */
+	int msg_rings;    /* grant shared memory message rings to clients */
+	char output[16];  /* drm, headless */
+	uint32_t request_pitch; /* headless only */
 	uint16_t request_width;
 	uint16_t request_height;
 	uint16_t request_refresh;
@@ -352,18 +496,36 @@ struct server_options
 	int inactive_vt;
 };
 
+struct dmg_tiles;
+struct cl_cb_data;
+struct sendq;
 struct client
 {
 	struct spr16 sprite;
-	struct spr16_msgdata_sync dmg[SPR16_DMG_SLOTS];
+	struct dmg_tiles *dmg;
+	struct dmg_tiles *age[2]; /* damage each scanout buffer is missing */
 	struct client *next;
-	uint16_t dmg_count;
 	uint32_t sync_flags;
 	int syncing;
+	int vsync_wait;           /* present on next vblank */
+	int flip_queued;          /* wants to be in the next flip */
+	int flip_wait;            /* ack when current flip completes */
+	int on_plane;             /* 1 on overlay plane, -1 plane was refused */
+	uint32_t palette_hash;    /* INDEX8, tile hashes are stale if it changes */
+	uint64_t sync_time;       /* when the vblank or flip sync arrived */
+	uint64_t copy_time;       /* when it's copy was queued */
+	uint32_t fence;           /* compositor fence of that copy, 0 if done */
+	int stamped;              /* present holds the vblank it went out on */
+	struct spr16_msgdata_present present; /* feedback for that sync */
 	int handshaking;
 	int connected; /* set nonzero after handshake */
 	int recv_fd_wait;
 	int socket;
+	struct spr16_msgring *msgring;  /* NULL if messages go over the socket */
+	struct cl_cb_data *msgring_cb;  /* doorbell handler data */
+	struct sendq *sendq;            /* messages waiting for the socket */
+	struct spr16_rxbuf *rxbuf;      /* messages coming from the socket */
+	int sendq_armed;                /* polling for FDPOLLOUT */
 };
 
 /* TODO move this into framebuffer struct */